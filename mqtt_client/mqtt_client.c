@@ -16,26 +16,176 @@
  * 
  */
 
+#define _GNU_SOURCE                                 //F_SETOWN_EX
+#include <sys/syscall.h>
 #include "mqtt_client.h"
 
+/********************************** Typedef *********************************/
+typedef struct
+{
+    char host[MQTT_HOST_MAX_LEN];
+    uint16_t port;
+} MqttEndpointStruct;
+
+typedef struct
+{
+    char topic[MQTT_SUBSCRIBE_TOPIC_MAX_LEN];
+    uint8_t qos;
+    uint8_t used;
+} MqttSubscribeStruct;
+
+/* 接收队列中的一条消息, 主题和数据连续存放在数据区中 */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t length;                //主题 + 数据
+    uint32_t sequence;
+    uint16_t topic_length;
+    uint16_t packet_identifier;
+    uint8_t qos;
+    uint8_t state;                  //MQTT_INBOUND_SLOT_QUEUED / DELIVERED / COMPLETED
+} MqttInboundSlotStruct;
+
+#define MQTT_INBOUND_SLOT_QUEUED        1
+#define MQTT_INBOUND_SLOT_DELIVERED     2
+#define MQTT_INBOUND_SLOT_COMPLETED     3
+
+/* 持久会话下发出的一条未完成的QoS1/2报文, 报文保存在数据区中 */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t length;
+    uint16_t packet_identifier;
+    uint8_t state;                  //MQTT_INFLIGHT_SLOT_PUBLISH / PUBREL / COMPLETED
+} MqttInflightSlotStruct;
+
+#define MQTT_INFLIGHT_SLOT_PUBLISH      1           //等待PUBACK/PUBREC
+#define MQTT_INFLIGHT_SLOT_PUBREL       2           //已收到PUBREC, 等待PUBCOMP
+#define MQTT_INFLIGHT_SLOT_COMPLETED    3
+
+#define MQTT_ACK_PACKET_LEN             4           //PUBACK/PUBREC/PUBREL/PUBCOMP: 固定报头(2) + 报文标识符(2)
+
+/* mqtt_reconnect_poll的状态 */
+#define MQTT_RECONNECT_IDLE             0           //未在重连, 下一次调用开始新一轮重连
+#define MQTT_RECONNECT_BACKOFF          1           //退避等待
+#define MQTT_RECONNECT_CONNECT          2           //对下一个服务器地址发起连接
+#define MQTT_RECONNECT_CONNECTING       3           //等待TCP连接完成
+#define MQTT_RECONNECT_CONNACK          4           //已发送CONNECT, 等待CONNACK
+
 /****************************** Global Variable *****************************/
-static uint8_t gs_mqtt_rx_buffer[MQTT_RX_BUFFER_MAX_LEN] = {0};
+static uint8_t *gs_mqtt_rx_buffer = NULL;
 static MqttParamStruct gsst_mqtt_param_data;
 static uint16_t gs_unsubscribe_identifier = 1;
 static uint16_t gs_subscribe_identifier = 1;
 static uint16_t gs_publish_identifier = 0;
+static MqttEndpointStruct gsst_mqtt_endpoint[MQTT_ENDPOINT_MAX_NUM];
+static MqttSubscribeStruct gsst_mqtt_subscribe[MQTT_SUBSCRIBE_MAX_NUM];
+static uint8_t gs_endpoint_num = 0;
+static uint8_t gs_endpoint_index = 0;
+static uint8_t gs_clean_session = 1;
+static volatile uint8_t gs_session_present = 0;
+static volatile uint8_t gs_connected = 0;
+static uint32_t gs_reconnect_attempt = 0;
+static uint32_t gs_reconnect_backoff_min = MQTT_RECONNECT_BACKOFF_MIN_MS;
+static uint32_t gs_reconnect_backoff_max = MQTT_RECONNECT_BACKOFF_MAX_MS;
+static uint8_t gs_reconnect_state = MQTT_RECONNECT_IDLE;
+static uint64_t gs_reconnect_deadline = 0;      //退避结束或当前步骤超时的时间(ms)
+static uint8_t gs_reconnect_tried = 0;          //本轮已尝试的服务器地址个数
+static uint8_t gs_reconnect_index = 0;          //正在连接的服务器地址索引
+static struct addrinfo *gs_reconnect_addr_list = NULL;
+static struct addrinfo *gs_reconnect_addr = NULL;   //下一个待尝试的解析结果
+static uint8_t gs_reconnect_connack[4];
+static uint8_t gs_reconnect_received = 0;
+static uint8_t *gs_mqtt_tx_buffer = NULL;
+static uint32_t gs_tx_head = 0;
+static uint32_t gs_tx_tail = 0;
+static uint32_t gs_tx_high_watermark = MQTT_TX_HIGH_WATERMARK;
+static uint32_t gs_tx_low_watermark = MQTT_TX_LOW_WATERMARK;
+static uint8_t gs_tx_blocked = 0;
+static writable_callback_function gs_writable_callback = NULL;
+static volatile uint8_t gs_writable_pending = 0;   //异步通知中只记录, 由调用者线程调用可写回调
+static uint32_t gs_rx_length = 0;
+static volatile uint8_t gs_rx_stalled = 0;      //发送缓冲区放不下确认报文, 暂停处理接收的报文
+static int gs_capture_fd = -1;
+static uint8_t gs_fasync_enable = 1;
+static ack_callback_function gs_ack_callback = NULL;
+static message_callback_function gs_message_callback = NULL;
+static MqttInboundSlotStruct *gsst_inbound_slot = NULL;
+static uint8_t *gs_inbound_arena = NULL;
+static MqttInboundLimitStruct gsst_inbound_limit;
+static uint8_t gs_inbound_enable = 0;
+static volatile uint8_t gs_inbound_paused = 0;
+static uint32_t gs_inbound_head = 0;            //下一条入队消息的序号
+static uint32_t gs_inbound_deliver = 0;         //下一条交付给应用的消息的序号
+static uint32_t gs_inbound_tail = 0;            //最早的未完成消息的序号
+static uint32_t gs_inbound_arena_head = 0;
+static uint32_t gs_inbound_arena_tail = 0;
+static uint32_t gs_inbound_bytes = 0;
+static uint32_t gs_inbound_unacked = 0;
+static MqttInflightSlotStruct *gsst_inflight_slot = NULL;
+static uint8_t *gs_inflight_arena = NULL;
+static uint32_t gs_inflight_head = 0;           //下一条发出的报文的序号
+static uint32_t gs_inflight_tail = 0;           //最早的未完成报文的序号
+static uint32_t gs_inflight_arena_head = 0;
+static uint32_t gs_inflight_arena_tail = 0;
+static uint32_t gs_inflight_resend = 0;         //重连后下一条待重发报文的序号
+static uint32_t gs_inflight_resend_end = 0;     //重连时的gs_inflight_head, 之后发出的报文不需要重发
 
 int g_sockfd = -1;
 
 /********************************** Constant ********************************/
 
 /********************************** Function ********************************/
-static uint16_t mqtt_receive_data_parse(uint8_t *src_data, uint8_t *msg_data);
+static void mqtt_receive_process(void);
+static void mqtt_receive_buffer_process(void);
+static void mqtt_receive_frame_process(uint8_t *frame, uint32_t frame_len);
+static void mqtt_connection_abort(void);
+static uint8_t mqtt_inbound_space_check(uint32_t length);
+static void mqtt_inbound_enqueue(const MqttPacketStruct *packet);
+static void mqtt_inbound_resume(void);
+static uint8_t mqtt_inbound_over_limit(void);
+static int mqtt_inflight_record(const struct iovec *iov, int iovcnt, uint16_t packet_identifier, uint8_t nonblock);
+static void mqtt_inflight_unrecord(void);
+static void mqtt_inflight_update(uint16_t packet_identifier, uint8_t ack_type);
+static void mqtt_inflight_resume(void);
+static void mqtt_inflight_resend_fill(void);
 static void mqtt_receive_ack_code(uint8_t ack_type, uint8_t ack_code);
 static void mqtt_fasync_callback_function(int signal);
+static void mqtt_fasync_enable(void);
+static int mqtt_connect_packet_send(void);
+static int mqtt_connack_check(const uint8_t *connack);
+static void mqtt_reconnect_reset(void);
+static void mqtt_reconnect_complete(void);
+static void mqtt_reconnect_fail(void);
+static int mqtt_reconnect_wait(int fd, short events, int *timeout_ms);
+static uint64_t mqtt_now_ms(void);
+static void mqtt_subscribe_record(const char *topic, uint8_t qos);
+static void mqtt_subscribe_remove(const char *topic);
+static void mqtt_subscribe_restore(void);
+static uint8_t mqtt_ack_required(uint8_t fixed_header);
+static int mqtt_ack_send(uint8_t ack_type, uint16_t packet_identifier);
+static uint32_t mqtt_reconnect_backoff(void);
+static int mqtt_publish_prepared_send(MqttPublishHandle *handle, const char *msg, uint16_t msg_len, uint8_t nonblock, uint16_t *packet_id);
+static int mqtt_publish_send(const char *topic, const char *msg, uint16_t msg_len, uint8_t retain, uint8_t qos, uint8_t nonblock, uint16_t *packet_id);
+static void mqtt_sigio_block(sigset_t *old_mask);
+static void mqtt_sigio_restore(sigset_t *old_mask);
+static void mqtt_capture_write(uint8_t direction, const struct iovec *iov, int iovcnt);
+static uint8_t mqtt_remain_length_encode(uint8_t *buffer, uint32_t remain_length);
+static uint16_t mqtt_publish_identifier_get(void);
 static int socket_send_data(int fd, void *buffer, uint64_t len);
+static int socket_send_iov(int fd, struct iovec *iov, int iovcnt);
+static int socket_send_iov_nonblock(int fd, struct iovec *iov, int iovcnt);
+static int socket_tx_flush(int fd, int timeout_ms);
+static void socket_tx_writable_check(void);
+static void mqtt_writable_dispatch(void);
+static uint8_t *socket_tx_reserve(uint32_t len);
+static int socket_wait_writable(int fd, int timeout_ms);
 static int socket_deinit(int fd);
 static int socket_init(void);
+static int socket_connect(const char *host, uint16_t port);
+static int socket_connect_start(const struct addrinfo *rp);
+static int socket_connect_next(void);
+static const char *socket_endpoint_get(uint8_t index, uint16_t *port);
 
 
 /**
@@ -59,6 +209,24 @@ int mqtt_init(MqttParamStruct param_data)
     memcpy(gsst_mqtt_param_data.user_name, param_data.user_name, strlen(param_data.user_name));
     gsst_mqtt_param_data.mqtt_callback_function = param_data.mqtt_callback_function;
 
+    /* 收发缓冲区从缓冲区池中申请, 只申请一次, 接收时不再清零. 接收缓冲区多1字节用于消息回调时的结束符 */
+    if (gs_mqtt_rx_buffer == NULL)
+    {
+        gs_mqtt_rx_buffer = (uint8_t *)mqtt_pool_alloc(MQTT_RX_BUFFER_MAX_LEN + 1);
+    }
+    if (gs_mqtt_tx_buffer == NULL)
+    {
+        gs_mqtt_tx_buffer = (uint8_t *)mqtt_pool_alloc(MQTT_TX_BUFFER_MAX_LEN);
+    }
+    if ((gs_mqtt_rx_buffer == NULL) || (gs_mqtt_tx_buffer == NULL))
+    {
+        PRINT_LOG("mqtt buffer alloc error");
+        return -1;
+    }
+
+    /* 连接被服务端断开后写socket会产生SIGPIPE, 忽略该信号, 由发送函数返回错误并等待重连 */
+    signal(SIGPIPE, SIG_IGN);
+
     /* 建立socket网络连接 */
     if (socket_init() < 0)
     {
@@ -77,18 +245,31 @@ int mqtt_init(MqttParamStruct param_data)
  */
 void mqtt_connect(void)
 {
+    if (mqtt_connect_packet_send() < 0)
+    {
+        return;
+    }
+
+    /* 使能异步通知, 也用于接收已订阅主题的消息 */
+    mqtt_fasync_enable();
+}
+
+/**
+ * @brief 发送CONNECT报文
+ * 
+ * @return -1: 失败; 0: 成功
+ */
+static int mqtt_connect_packet_send(void)
+{
+    int ret = 0;
     uint8_t flags = 0x00;
     uint8_t *packet = NULL;
-    uint16_t packet_length = 0;
-    uint16_t packet_offset = 0;
-    uint8_t remain_length = 0;
-    uint8_t *fixed_header = NULL;
-    uint8_t fixed_header_size = 2;
-    uint8_t variable_header[10] = {0};
+    uint32_t packet_offset = 0;
+    uint32_t remain_length = 0;
     uint16_t clientid_length = strlen(gsst_mqtt_param_data.client_id);
     uint16_t username_length = strlen(gsst_mqtt_param_data.user_name);
     uint16_t password_length = strlen(gsst_mqtt_param_data.password);
-    uint16_t payload_length = clientid_length + 2;
+    uint32_t payload_length = clientid_length + 2;
 
     /* 网络连接成功后, 第一个报文必须是CONNECT报文 */
 
@@ -102,110 +283,302 @@ void mqtt_connect(void)
         payload_length += password_length + 2;
         flags |= MQTT_PASSWORD_FLAG;
     }
-    flags |= MQTT_CLEAN_SESSION;
-
-    remain_length = sizeof(variable_header) + payload_length;   //剩余长度 = 可变报头 + 有效载荷长度
-    if (remain_length > 127)
-    {
-        fixed_header_size++;
-    }
-    /* 固定报头 */
-    fixed_header = (uint8_t *)malloc(fixed_header_size);
-    *fixed_header = MQTT_MSG_CONNECT;   //报文类型为connect
-    if (remain_length <= 127)
+    if (gs_clean_session)
     {
-        *(fixed_header + 1) = remain_length;
+        flags |= MQTT_CLEAN_SESSION;                        //为0时服务端保留会话(订阅和未完成的QoS1/2消息)
     }
-    else 
+
+    remain_length = 10 + payload_length;                    //剩余长度 = 可变报头(10字节) + 有效载荷长度
+    packet = (uint8_t *)mqtt_pool_alloc(MQTT_FIXED_HEADER_MAX_LEN + remain_length);
+    if (packet == NULL)
     {
-        *(fixed_header + 1) = remain_length % 128;
-        *(fixed_header + 1) = *(fixed_header + 1) | 0x80;
-        *(fixed_header + 2) = remain_length / 128;
+        return -1;
     }
 
+    /* 固定报头 */
+    packet[packet_offset++] = MQTT_MSG_CONNECT;             //报文类型为connect
+    packet_offset += mqtt_remain_length_encode(packet + packet_offset, remain_length);
+
     /* 可变报头 */
-    variable_header[0] = 0x00;
-    variable_header[1] = 0x04;          //协议名长度
-    variable_header[2] = 0x4D;
-    variable_header[3] = 0x51;
-    variable_header[4] = 0x54;
-    variable_header[5] = 0x54;          //协议名为"MQTT"
-    variable_header[6] = 0x04;          //协议级别, 3.1.1版协议的协议级别字段的值为4(0x04)
-    variable_header[7] = flags;         //连接标记
-    variable_header[8] = (uint8_t)((gsst_mqtt_param_data.keep_alive >> 8) & 0xFF);
-    variable_header[9] = (uint8_t)(gsst_mqtt_param_data.keep_alive & 0xFF);
-
-    packet_length = fixed_header_size + sizeof(variable_header) + payload_length;
-    packet = (uint8_t *)malloc(packet_length);
-    memset(packet, 0, packet_length);
-
-    /* 有效载荷: 客户端ID、遗嘱主题、遗嘱消息、用户名、密码, 遗嘱主题和遗嘱消息为可选, 此处未使用 */
-
-    /* 填充报文数据包 */
-    memcpy(packet, fixed_header, fixed_header_size);                                //填充固定报头
-    packet_offset += fixed_header_size;
-    memcpy(packet + packet_offset, variable_header, sizeof(variable_header));       //填充可变报头
-    packet_offset += sizeof(variable_header);
-    packet[packet_offset++] = (uint8_t)((clientid_length >> 8) & 0xFF);             //填充有效载荷
+    packet[packet_offset++] = 0x00;
+    packet[packet_offset++] = 0x04;                         //协议名长度
+    packet[packet_offset++] = 0x4D;
+    packet[packet_offset++] = 0x51;
+    packet[packet_offset++] = 0x54;
+    packet[packet_offset++] = 0x54;                         //协议名为"MQTT"
+    packet[packet_offset++] = 0x04;                         //协议级别, 3.1.1版协议的协议级别字段的值为4(0x04)
+    packet[packet_offset++] = flags;                        //连接标记
+    packet[packet_offset++] = (uint8_t)((gsst_mqtt_param_data.keep_alive >> 8) & 0xFF);
+    packet[packet_offset++] = (uint8_t)(gsst_mqtt_param_data.keep_alive & 0xFF);
+
+    /* 有效载荷: 客户端ID、遗嘱主题、遗嘱消息、用户名、密码, 遗嘱主题和遗嘱消息为可选, 此处未使用.
+       用户名和密码只有在对应标志置位时才出现 */
+    packet[packet_offset++] = (uint8_t)((clientid_length >> 8) & 0xFF);
     packet[packet_offset++] = (uint8_t)(clientid_length & 0xFF);
     memcpy(packet + packet_offset, gsst_mqtt_param_data.client_id, clientid_length);
     packet_offset += clientid_length;
-    packet[packet_offset++] = (uint8_t)((username_length >> 8) & 0xFF);
-    packet[packet_offset++] = (uint8_t)(username_length & 0xFF);
-    memcpy(packet + packet_offset, gsst_mqtt_param_data.user_name, username_length);
-    packet_offset += username_length;
-    packet[packet_offset++] = (uint8_t)((password_length >> 8) & 0xFF);
-    packet[packet_offset++] = (uint8_t)(password_length & 0xFF);
-    memcpy(packet + packet_offset, gsst_mqtt_param_data.password, password_length);
-    packet_offset += password_length;
-
-    /* 发送CONNECT报文数据包给服务器, 并等待服务器的CONNACK响应(异步通知) */
-    if (socket_send_data(g_sockfd, packet, packet_length) < 0)
+    if (username_length)
+    {
+        packet[packet_offset++] = (uint8_t)((username_length >> 8) & 0xFF);
+        packet[packet_offset++] = (uint8_t)(username_length & 0xFF);
+        memcpy(packet + packet_offset, gsst_mqtt_param_data.user_name, username_length);
+        packet_offset += username_length;
+    }
+    if (password_length)
+    {
+        packet[packet_offset++] = (uint8_t)((password_length >> 8) & 0xFF);
+        packet[packet_offset++] = (uint8_t)(password_length & 0xFF);
+        memcpy(packet + packet_offset, gsst_mqtt_param_data.password, password_length);
+        packet_offset += password_length;
+    }
+
+    /* 发送CONNECT报文数据包给服务器, 并等待服务器的CONNACK响应 */
+    if (socket_send_data(g_sockfd, packet, packet_offset) < 0)
     {
         PRINT_LOG("mqtt send CONNECT packet error");
-        free(fixed_header);
-        free(packet);
+        ret = -1;
+    }
+    mqtt_pool_free(packet);
+
+    return ret;
+}
+
+/**
+ * @brief 使能socket异步通知(SIGIO), SIGIO只发给调用线程
+ * 
+ */
+static void mqtt_fasync_enable(void)
+{
+    /* 事件循环模式下由应用调用mqtt_poll处理收发 */
+    if (gs_fasync_enable == 0)
+    {
         return;
     }
-    free(fixed_header);
-    free(packet);
 
-    /* 使能异步通知, 也用于接收已订阅主题的消息 */
     signal(SIGIO, mqtt_fasync_callback_function);
+
+    /* 发给进程的SIGIO可能由任一未屏蔽该信号的线程处理, 各接口屏蔽SIGIO只对本线程有效,
+       所以SIGIO固定发给调用mqtt_connect/mqtt_reconnect的线程, 所有接口都要在该线程中调用 */
+#ifdef F_SETOWN_EX
+    struct f_owner_ex owner = {F_OWNER_TID, (pid_t)syscall(SYS_gettid)};
+    fcntl(g_sockfd, F_SETOWN_EX, &owner);
+#else
     fcntl(g_sockfd, F_SETOWN, getpid());
+#endif
     int flag = fcntl(g_sockfd, F_GETFL);
     fcntl(g_sockfd, F_SETFL, flag | FASYNC);
 }
 
 /**
- * @brief MQTT重新连接服务器
+ * @brief MQTT重新连接服务器(阻塞), 依次尝试所有服务器地址. 上一次重连失败时先按抖动指数退避等待,
+ *        服务端未保留会话时重新订阅之前的主题. 由mqtt_reconnect_poll完成一轮重连后返回,
+ *        退避和每个地址的连接/CONNACK最多阻塞MQTT_CONNECT_TIMEOUT_MS, 事件循环中应使用mqtt_reconnect_poll
  * 
- * @return 0: 成功; -1: 失败
+ * @return 0: 成功; -1: 本轮所有地址都失败
  */
 int mqtt_reconnect(void)
 {
-    uint64_t ioctl_arg = 1;
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(gsst_mqtt_param_data.port);
-    server_addr.sin_addr.s_addr = inet_addr(gsst_mqtt_param_data.ipaddr);
+    uint32_t attempt = gs_reconnect_attempt;
 
-    int ret = connect(g_sockfd, (struct sockaddr*)&server_addr, sizeof(struct sockaddr));
-    if (ret < 0)
+    /* 每一轮开始时重连次数加1, 已在一轮中时等本轮结束 */
+    if ((gs_reconnect_state != MQTT_RECONNECT_IDLE) && (gs_reconnect_state != MQTT_RECONNECT_BACKOFF))
     {
-        PRINT_LOG("mqtt socket reconnect server error");
-        return -1;
+        attempt--;
     }
-    else 
+    while (mqtt_reconnect_poll(-1) == MQTT_ERR_WOULDBLOCK)
+    {
+        /* 本轮失败后状态机回到退避等待, 留给下一次调用 */
+        if ((gs_reconnect_state == MQTT_RECONNECT_BACKOFF) && (gs_reconnect_attempt != attempt))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 非阻塞重连, 退避等待、TCP连接和等待CONNACK都不阻塞, 用于事件循环.
+ *        每次调用最多等待timeout_ms, 返回MQTT_ERR_WOULDBLOCK时在下一次循环中再次调用, 直到返回0.
+ *        重连完成前mqtt_is_connected返回0, 不要调用mqtt_poll和发布接口. 服务器域名解析仍是同步的
+ * 
+ * @param timeout_ms 最长等待时间(毫秒), 0: 不等待; -1: 等到当前步骤完成或超时
+ * @return 0: 重连成功; MQTT_ERR_WOULDBLOCK: 重连进行中
+ */
+int mqtt_reconnect_poll(int timeout_ms)
+{
+    int ret = 0;
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    ssize_t nread = 0;
+
+    while (1)
+    {
+        switch (gs_reconnect_state)
+        {
+            case MQTT_RECONNECT_IDLE:
+                /* 上一次重连失败时先按抖动指数退避等待 */
+                gs_reconnect_deadline = mqtt_now_ms() + ((gs_reconnect_attempt > 0) ? mqtt_reconnect_backoff() : 0);
+                gs_reconnect_state = MQTT_RECONNECT_BACKOFF;
+                break;
+
+            case MQTT_RECONNECT_BACKOFF:
+                if (mqtt_reconnect_wait(-1, 0, &timeout_ms) == 0)
+                {
+                    return MQTT_ERR_WOULDBLOCK;
+                }
+                gs_reconnect_attempt++;
+                mqtt_reconnect_reset();
+                gs_reconnect_tried = 0;
+                gs_reconnect_state = MQTT_RECONNECT_CONNECT;
+                break;
+
+            case MQTT_RECONNECT_CONNECT:
+                g_sockfd = socket_connect_next();
+                if (g_sockfd < 0)
+                {
+                    PRINT_LOG("mqtt socket reconnect server error");
+                    mqtt_reconnect_fail();
+                    break;
+                }
+                gs_reconnect_deadline = mqtt_now_ms() + MQTT_CONNECT_TIMEOUT_MS;
+                gs_reconnect_state = MQTT_RECONNECT_CONNECTING;
+                break;
+
+            case MQTT_RECONNECT_CONNECTING:
+                ret = mqtt_reconnect_wait(g_sockfd, POLLOUT, &timeout_ms);
+                if (ret == 0)
+                {
+                    return MQTT_ERR_WOULDBLOCK;
+                }
+
+                /* 连接失败或超时时换下一个地址 */
+                if ((ret < 0) || (getsockopt(g_sockfd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0) ||
+                    (error != 0) || (mqtt_connect_packet_send() < 0))
+                {
+                    uint16_t port = 0;
+                    const char *host = socket_endpoint_get(gs_reconnect_index, &port);
+
+                    PRINT_LOG("socket connect server %s:%d error", host, port);
+                    socket_deinit(g_sockfd);
+                    g_sockfd = -1;
+                    gs_reconnect_state = MQTT_RECONNECT_CONNECT;
+                    break;
+                }
+                gs_reconnect_deadline = mqtt_now_ms() + MQTT_CONNECT_TIMEOUT_MS;
+                gs_reconnect_received = 0;
+                gs_reconnect_state = MQTT_RECONNECT_CONNACK;
+                break;
+
+            case MQTT_RECONNECT_CONNACK:
+                ret = mqtt_reconnect_wait(g_sockfd, POLLIN, &timeout_ms);
+                if (ret == 0)
+                {
+                    return MQTT_ERR_WOULDBLOCK;
+                }
+                if (ret > 0)
+                {
+                    /* 只读取CONNACK, 服务端紧跟着重发的消息留给正常接收流程处理 */
+                    nread = read(g_sockfd, gs_reconnect_connack + gs_reconnect_received,
+                                 sizeof(gs_reconnect_connack) - gs_reconnect_received);
+                    if ((nread < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+                    {
+                        break;
+                    }
+                    if (nread > 0)
+                    {
+                        gs_reconnect_received += nread;
+                        if (gs_reconnect_received < sizeof(gs_reconnect_connack))
+                        {
+                            break;
+                        }
+                        if (mqtt_connack_check(gs_reconnect_connack) == 0)
+                        {
+                            gs_endpoint_index = gs_reconnect_index;
+                            gs_connected = 1;
+                            gs_reconnect_state = MQTT_RECONNECT_IDLE;
+                            mqtt_reconnect_complete();
+                            return 0;
+                        }
+                    }
+                }
+                PRINT_LOG("mqtt reconnect CONNACK error");
+                mqtt_reconnect_fail();
+                break;
+
+            default:
+                gs_reconnect_state = MQTT_RECONNECT_IDLE;
+                break;
+        }
+    }
+}
+
+/**
+ * @brief 设置清理会话标志, 为0时断线重连后服务端恢复之前的订阅和未完成的QoS1/2消息,
+ *        客户端保存已发出但未完成的QoS1/2报文, 服务端保留了会话时重连后置DUP重发.
+ *        此时客户端标识符不能为空. 在mqtt_connect/mqtt_reconnect之前设置
+ * 
+ * @param clean_session 1: 清理会话(默认); 0: 持久会话
+ */
+void mqtt_set_clean_session(uint8_t clean_session)
+{
+    gs_clean_session = clean_session ? 1 : 0;
+}
+
+/**
+ * @brief 添加备用服务器地址, 连接时先尝试MqttParamStruct中的地址, 失败后依次尝试备用地址
+ * 
+ * @param host 服务器域名或IP地址(支持IPv4/IPv6)
+ * @param port 端口
+ * @return 0: 成功; -1: 失败
+ */
+int mqtt_add_endpoint(const char *host, uint16_t port)
+{
+    if ((gs_endpoint_num >= MQTT_ENDPOINT_MAX_NUM) || (strlen(host) >= MQTT_HOST_MAX_LEN))
     {
-        PRINT_LOG("mqtt socket reconnect server ok");
+        return -1;
     }
-    ioctl(g_sockfd, FIONBIO, &ioctl_arg);
-    mqtt_connect();
+
+    memset(gsst_mqtt_endpoint[gs_endpoint_num].host, 0, MQTT_HOST_MAX_LEN);
+    memcpy(gsst_mqtt_endpoint[gs_endpoint_num].host, host, strlen(host));
+    gsst_mqtt_endpoint[gs_endpoint_num].port = port;
+    gs_endpoint_num++;
 
     return 0;
 }
 
+/**
+ * @brief 设置重连退避时间, 第n次失败后等待[base/2, base]之间的随机时间, base = min_ms * 2^(n-1), 不超过max_ms
+ * 
+ * @param min_ms 最小退避时间(毫秒)
+ * @param max_ms 最大退避时间(毫秒)
+ */
+void mqtt_set_reconnect_backoff(uint32_t min_ms, uint32_t max_ms)
+{
+    gs_reconnect_backoff_min = min_ms ? min_ms : 1;
+    gs_reconnect_backoff_max = (max_ms > gs_reconnect_backoff_min) ? max_ms : gs_reconnect_backoff_min;
+}
+
+/**
+ * @brief 最近一次CONNACK中服务端是否保留了会话
+ * 
+ * @return 1: 保留; 0: 未保留
+ */
+uint8_t mqtt_session_present(void)
+{
+    return gs_session_present;
+}
+
+/**
+ * @brief 连接状态, 服务端关闭连接或发送失败后变为0, 此时需调用mqtt_reconnect
+ * 
+ * @return 1: 已连接; 0: 未连接
+ */
+uint8_t mqtt_is_connected(void)
+{
+    return gs_connected;
+}
+
 /**
  * @brief MQTT断开连接
  * 
@@ -226,10 +599,13 @@ void mqtt_disconnect(void)
     }
 
     socket_deinit(g_sockfd);
+    g_sockfd = -1;
+    gs_connected = 0;
 }
 
 /**
- * @brief MQTT向某个主题发布消息
+ * @brief MQTT向某个主题发布消息. 阻塞等待socket可写, 最长MQTT_SEND_TIMEOUT_MS,
+ *        报文只发送了一部分时关闭网络连接, 由应用重连后重新发布
  * 
  * @param topic 主题
  * @param msg 消息
@@ -240,17 +616,29 @@ void mqtt_disconnect(void)
  */
 int mqtt_publish(const char *topic, const char *msg, uint16_t msg_len, uint8_t retain, uint8_t qos)
 {
-    uint8_t *packet = NULL;
-    uint8_t *fixed_header = NULL;
-    uint8_t *variable_header = NULL;
-    uint8_t fixed_header_size = 2;
-    uint8_t variable_header_size = 0;
-    uint16_t packet_length = 0;
-    uint16_t remain_length = 0;
-    uint16_t topic_length = strlen(topic);
+    return mqtt_publish_send(topic, msg, msg_len, retain, qos, 0, NULL);
+}
+
+/**
+ * @brief 预编码固定主题的PUBLISH报文头, 供高频发布使用
+ * 
+ * @param topic 主题
+ * @param qos QoS
+ * @param retain 保留位
+ * @return NULL: 失败; 其他: 发布句柄, 不再使用时调用mqtt_release_publish释放
+ */
+MqttPublishHandle *mqtt_prepare_publish(const char *topic, uint8_t qos, uint8_t retain)
+{
+    MqttPublishHandle *handle = NULL;
+    uint32_t topic_length = strlen(topic);
     uint8_t qos_flag = MQTT_QOS0_FLAG;
     uint8_t qos_size = 0;
 
+    if (mqtt_topic_name_check(topic, topic_length) < 0)
+    {
+        PRINT_LOG("mqtt publish topic invalid");
+        return NULL;
+    }
     if (qos == 1)
     {
         qos_size = 2;
@@ -262,500 +650,2580 @@ int mqtt_publish(const char *topic, const char *msg, uint16_t msg_len, uint8_t r
         qos_flag = MQTT_QOS2_FLAG;
     }
 
-    variable_header_size = 2 + topic_length + qos_size;
-    remain_length = variable_header_size + msg_len;         //剩余长度=可变报头的长度(10字节)+有效载荷的长度
-    if (remain_length > 127)
+    handle = (MqttPublishHandle *)mqtt_pool_alloc(sizeof(MqttPublishHandle));
+    if (handle == NULL)
+    {
+        return NULL;
+    }
+    handle->packet = (uint8_t *)mqtt_pool_alloc(MQTT_FIXED_HEADER_MAX_LEN + 2 + topic_length + qos_size);
+    if (handle->packet == NULL)
     {
-        fixed_header_size++;
+        mqtt_pool_free(handle);
+        return NULL;
     }
 
-    /* 固定报头 */
-    fixed_header = (uint8_t *)malloc(fixed_header_size);
-    memset(fixed_header, 0, fixed_header_size);
-    *fixed_header = MQTT_MSG_PUBLISH | qos_flag;            //报文类型为publish
+    /* 固定报头只保存报文类型, 剩余长度在发布时根据消息长度填充到预留空间的末尾 */
+    handle->fixed_header = MQTT_MSG_PUBLISH | qos_flag;
     if (retain)
     {
-        *fixed_header |= MQTT_RETAIN_FLAG;                  //若设置为1, 则服务端必须存储这个应用消息和它的服务质量等级(QoS)
+        handle->fixed_header |= MQTT_RETAIN_FLAG;
     }
-    if (remain_length <= 127)
+    handle->qos_size = qos_size;
+    handle->topic_length = (uint16_t)topic_length;
+
+    /* 可变报头: 主题长度位 + 主题名, 报文标识符在发布时填充 */
+    handle->packet[MQTT_FIXED_HEADER_MAX_LEN] = (uint8_t)((topic_length >> 8) & 0xFF);
+    handle->packet[MQTT_FIXED_HEADER_MAX_LEN + 1] = (uint8_t)(topic_length & 0xFF);
+    memcpy(handle->packet + MQTT_FIXED_HEADER_MAX_LEN + 2, topic, topic_length);
+
+    return handle;
+}
+
+/**
+ * @brief 通过预编码的句柄发布消息, 只填充剩余长度和报文标识符
+ * 
+ * @param handle 发布句柄
+ * @param msg 消息
+ * @param msg_len 消息长度
+ * @return -1: 失败; 0: 成功
+ */
+int mqtt_publish_prepared(MqttPublishHandle *handle, const char *msg, uint16_t msg_len)
+{
+    return mqtt_publish_prepared_send(handle, msg, msg_len, 0, NULL);
+}
+
+/**
+ * @brief 通过预编码的句柄非阻塞发布消息, 见mqtt_publish_nonblock
+ * 
+ * @param handle 发布句柄
+ * @param msg 消息
+ * @param msg_len 消息长度
+ * @param packet_id 输出报文标识符(QoS=0时为0), 可为NULL
+ * @return -1: 失败; 0: 成功; MQTT_ERR_WOULDBLOCK: 发送缓冲区超过高水位, 消息未发送
+ */
+int mqtt_publish_prepared_nonblock(MqttPublishHandle *handle, const char *msg, uint16_t msg_len, uint16_t *packet_id)
+{
+    mqtt_writable_dispatch();
+
+    return mqtt_publish_prepared_send(handle, msg, msg_len, 1, packet_id);
+}
+
+/**
+ * @brief 通过预编码的句柄发送PUBLISH报文
+ * 
+ * @param handle 发布句柄
+ * @param msg 消息
+ * @param msg_len 消息长度
+ * @param nonblock 1: 非阻塞发送; 0: 阻塞发送
+ * @param packet_id 输出报文标识符, 可为NULL
+ * @return -1: 失败; 0: 成功; MQTT_ERR_WOULDBLOCK: 发送缓冲区超过高水位
+ */
+static int mqtt_publish_prepared_send(MqttPublishHandle *handle, const char *msg, uint16_t msg_len, uint8_t nonblock, uint16_t *packet_id)
+{
+    int ret = 0;
+    uint8_t recorded = 0;
+    sigset_t old_mask;
+    uint16_t packet_identifier = 0;
+    struct iovec iov[2];
+    uint8_t remain_bytes = 0;
+    uint8_t header_offset = 0;
+    uint8_t remain_data[4] = {0};
+    uint8_t *variable_end = NULL;
+    uint32_t remain_length = 0;
+
+    if (handle == NULL)
     {
-        *(fixed_header + 1) = remain_length;
+        return -1;
     }
-    else 
+
+    remain_length = 2 + handle->topic_length + handle->qos_size + msg_len;
+    remain_bytes = mqtt_remain_length_encode(remain_data, remain_length);
+
+    /* 固定报头紧贴在主题长度位之前, 报文从header_offset处开始 */
+    header_offset = MQTT_FIXED_HEADER_MAX_LEN - 1 - remain_bytes;
+    handle->packet[header_offset] = handle->fixed_header;
+    memcpy(handle->packet + header_offset + 1, remain_data, remain_bytes);
+
+    if (handle->qos_size)
     {
-        *(fixed_header + 1) = remain_length % 128;          //对于127字节以内的消息, 剩余的长度是1个字节, 大于127则用2个字节
-        *(fixed_header + 1) = *(fixed_header + 1) | 0x80;   //剩余的长度可支持4个字节, 目前最大为2个字节, 即最大可处理16383(约16k)大小的消息
-        *(fixed_header + 2) = remain_length / 128;
+        packet_identifier = mqtt_publish_identifier_get();
+        variable_end = handle->packet + MQTT_FIXED_HEADER_MAX_LEN + 2 + handle->topic_length;
+        variable_end[0] = (uint8_t)((packet_identifier >> 8) & 0xFF);
+        variable_end[1] = (uint8_t)(packet_identifier & 0xFF);
     }
 
-    /* 可变报头 */
-    variable_header = (uint8_t *)malloc(variable_header_size);
-    memset(variable_header, 0, variable_header_size);
-    *variable_header = (uint8_t)((topic_length >> 8) & 0xFF);
-    *(variable_header + 1) = (uint8_t)(topic_length & 0xFF);
-    memcpy(variable_header + 2, topic, topic_length);
-    if (qos_size)
+    /* 报文头和消息数据分开发送, 避免拷贝消息数据 */
+    iov[0].iov_base = handle->packet + header_offset;
+    iov[0].iov_len = MQTT_FIXED_HEADER_MAX_LEN - header_offset + 2 + handle->topic_length + handle->qos_size;
+    iov[1].iov_base = (void *)msg;
+    iov[1].iov_len = msg_len;
+
+    /* 持久会话下先保存报文再发送, 确认报文不会在保存之前到达; 发送失败时删除, 由调用者决定是否重新发布 */
+    mqtt_sigio_block(&old_mask);
+    if (handle->qos_size && (gs_clean_session == 0))
     {
-        /* 只有当QoS等级是1或2时, 报文标识符(Packet Identifier)字段才能出现在PUBLISH报文中 */
-        gs_publish_identifier++;
-        if (gs_publish_identifier == 0)
+        ret = mqtt_inflight_record(iov, 2, packet_identifier, nonblock);
+        recorded = (ret == 0);
+    }
+    if (ret == 0)
+    {
+        ret = nonblock ? socket_send_iov_nonblock(g_sockfd, iov, 2) : socket_send_iov(g_sockfd, iov, 2);
+        if ((ret < 0) && recorded)
         {
-            gs_publish_identifier = 1;
+            mqtt_inflight_unrecord();
         }
-        variable_header[topic_length + 2] = (uint8_t)((gs_publish_identifier >> 8) & 0xFF);
-        variable_header[topic_length + 3] = (uint8_t)(gs_publish_identifier & 0xFF);
     }
-
-    /* 有效载荷: 包含将被发布的应用消息 */
-
-    /* 填充报文数据包 */
-    packet_length = fixed_header_size + variable_header_size + msg_len;
-    packet = (uint8_t *)malloc(packet_length);
-    memset(packet, 0, packet_length);
-    memcpy(packet, fixed_header, fixed_header_size);
-    memcpy(packet + fixed_header_size, variable_header, variable_header_size);
-    memcpy(packet + fixed_header_size + variable_header_size, msg, msg_len);
-
-    /* 发送PUBLISH报文数据包给服务器, 并等待服务器的PUBACK/PUBREC响应(异步通知), QoS=0时无响应 */
-    if (socket_send_data(g_sockfd, packet, packet_length) < 0)
+    mqtt_sigio_restore(&old_mask);
+    if (ret == -1)
     {
         PRINT_LOG("mqtt send PUBLISH packet error");
-        free(variable_header);
-        free(fixed_header);
-        free(packet);
         return -1;
     }
+    else if (ret == MQTT_ERR_WOULDBLOCK)
+    {
+        return MQTT_ERR_WOULDBLOCK;
+    }
+    if (packet_id != NULL)
+    {
+        *packet_id = packet_identifier;
+    }
 
-    free(variable_header);
-    free(fixed_header);
-    free(packet);
     return 0;
 }
 
 /**
- * @brief MQTT订阅主题
+ * @brief MQTT非阻塞发布消息. 写不完的数据暂存在发送缓冲区, 由异步通知在socket可写时继续发送;
+ *        待发送数据超过高水位时不发送并返回MQTT_ERR_WOULDBLOCK, 降到低水位以下后调用可写回调
  * 
  * @param topic 主题
+ * @param msg 消息
+ * @param msg_len 消息长度
+ * @param retain 保留位
  * @param qos QoS
+ * @param packet_id 输出报文标识符(QoS=0时为0), 可为NULL
+ * @return -1: 失败; 0: 成功; MQTT_ERR_WOULDBLOCK: 发送缓冲区超过高水位, 消息未发送
  */
-void mqtt_subscribe(char *topic, uint8_t qos)
+int mqtt_publish_nonblock(const char *topic, const char *msg, uint16_t msg_len, uint8_t retain, uint8_t qos, uint16_t *packet_id)
 {
-    uint16_t message_id = 0;
-    uint8_t *packet = NULL;
-    uint8_t *payload = NULL;
-    uint8_t *fixed_header = NULL;
-    uint8_t *variable_header = NULL;
-    uint8_t payload_size = 0;
-    uint8_t fixed_header_size = 2;
-    uint8_t variable_header_size = 2;
-    uint32_t topic_length = strlen(topic);
-    uint32_t packet_length = 0;
-    uint16_t remain_length = 0;
-
-    remain_length = variable_header_size + 2 + topic_length + 1;    //剩余长度=(可变报头)报文标示符长度2+主题长度位占用2字节+主题长度+qos标识
-
-    /* 固定报头 */
-    fixed_header = (uint8_t *)malloc(fixed_header_size);
-    memset(fixed_header, 0, fixed_header_size);
-    *fixed_header = MQTT_MSG_SUBSCRIBE;                             //报文类型为subscribe
-    *(fixed_header + 1) = remain_length;                            //剩余长度
-
-    /* 可变报头 */
-    message_id = gs_subscribe_identifier++;
-    variable_header = (uint8_t *)malloc(variable_header_size);
-    memset(variable_header, 0, variable_header_size);
-    *variable_header = (uint8_t)((message_id >> 8) & 0xFF);         //标识符
-    *(variable_header + 1) = (uint8_t)(message_id & 0xFF);
-
-    /* 有效载荷 */
-    payload_size = 2 + topic_length + 1;
-    payload = (uint8_t *)malloc(payload_size);
-    memset(payload, 0, payload_size);
-    *payload = (uint8_t)((topic_length >> 8) & 0xFF);
-    *(payload + 1) = (uint8_t)(topic_length & 0xFF);
-    memcpy(payload + 2, topic, topic_length);
-    *(payload + 2 + topic_length) = qos;
-
-    /* 填充报文数据包 */
-    packet_length = fixed_header_size + variable_header_size + payload_size;
-    packet = (uint8_t *)malloc(packet_length);
-    memset(packet, 0, packet_length);
-    memcpy(packet, fixed_header, fixed_header_size);
-    memcpy(packet + fixed_header_size, variable_header, variable_header_size);
-    memcpy(packet + fixed_header_size + variable_header_size, payload, payload_size);
-
-    /* 发送SUBSCRIBE报文数据包给服务器, 并等待服务器的SUBACK响应(异步通知) */
-    if (socket_send_data(g_sockfd, packet, packet_length) < 0)
-    {
-        PRINT_LOG("mqtt send SUBSCRIBE packet error");
-        free(variable_header);
-        free(fixed_header);
-        free(payload);
-        free(packet);
-        return;
-    }
+    /* 先让之前被拒绝的发布者重试, 保持发布顺序 */
+    mqtt_writable_dispatch();
 
-    free(variable_header);
-    free(fixed_header);
-    free(payload);
-    free(packet);
+    return mqtt_publish_send(topic, msg, msg_len, retain, qos, 1, packet_id);
 }
 
 /**
- * @brief MQTT取消订阅主题
+ * @brief 发送PUBLISH报文. 固定报头、主题长度位和报文标识符在栈上编码,
+ *        主题名和消息数据直接引用调用者的缓冲区, 不需要申请和拷贝
  * 
  * @param topic 主题
+ * @param msg 消息
+ * @param msg_len 消息长度
+ * @param retain 保留位
+ * @param qos QoS
+ * @param nonblock 1: 非阻塞发送; 0: 阻塞发送
+ * @param packet_id 输出报文标识符(QoS=0时为0), 可为NULL
+ * @return -1: 失败; 0: 成功; MQTT_ERR_WOULDBLOCK: 发送缓冲区超过高水位
  */
-void mqtt_unsubscribe(char *topic)
+static int mqtt_publish_send(const char *topic, const char *msg, uint16_t msg_len, uint8_t retain, uint8_t qos, uint8_t nonblock, uint16_t *packet_id)
 {
-    uint16_t message_id = 0;
-    uint8_t *packet = NULL;
-    uint8_t *payload = NULL;
-    uint8_t *fixed_header = NULL;
-    uint8_t *variable_header = NULL;
-    uint8_t payload_size = 0;
-    uint8_t fixed_header_size = 2;
-    uint8_t variable_header_size = 2;
+    int ret = 0;
+    uint8_t recorded = 0;
+    sigset_t old_mask;
+    struct iovec iov[4];
+    uint8_t header[MQTT_FIXED_HEADER_MAX_LEN + 2];
+    uint8_t identifier[2];
+    uint8_t header_size = 1;
+    uint8_t qos_size = 0;
+    uint16_t packet_identifier = 0;
     uint32_t topic_length = strlen(topic);
-    uint32_t packet_length = 0;
-    uint16_t remain_length = 0;
 
-    remain_length = variable_header_size + 2 + topic_length;        //剩余长度=(可变报头)报文标示符长度2+主题长度位占用2字节+主题长度
+    /* PUBLISH报文的主题名必须是合法的UTF-8编码, 且不能包含通配符 */
+    if (mqtt_topic_name_check(topic, topic_length) < 0)
+    {
+        PRINT_LOG("mqtt publish topic invalid");
+        return -1;
+    }
 
     /* 固定报头 */
-    fixed_header = (uint8_t *)malloc(fixed_header_size);
-    memset(fixed_header, 0, fixed_header_size);
-    *fixed_header = MQTT_MSG_UNSUBSCRIBE;                           //报文类型为unsubscribe
-    *(fixed_header + 1) = remain_length;                            //剩余长度
-
-    /* 可变报头 */
-    message_id = gs_unsubscribe_identifier++;
-    variable_header = (uint8_t *)malloc(variable_header_size);
-    memset(variable_header, 0, variable_header_size);
-    *variable_header = (uint8_t)((message_id >> 8) & 0xFF);         //标识符
-    *(variable_header + 1) = (uint8_t)(message_id & 0xFF);
-
-    /* 有效载荷 */
-    payload_size = 2 + topic_length;
-    payload = (uint8_t *)malloc(payload_size);
-    memset(payload, 0, payload_size);
-    *payload = (uint8_t)((topic_length >> 8) & 0xFF);
-    *(payload + 1) = (uint8_t)(topic_length & 0xFF);
-    memcpy(payload + 2, topic, topic_length);
-
-    /* 填充报文数据包 */
-    packet_length = fixed_header_size + variable_header_size + payload_size;
-    packet = (uint8_t *)malloc(packet_length);
-    memset(packet, 0, packet_length);
-    memcpy(packet, fixed_header, fixed_header_size);
-    memcpy(packet + fixed_header_size, variable_header, variable_header_size);
-    memcpy(packet + fixed_header_size + variable_header_size, payload, payload_size);
-
-    /* 发送UNSUBSCRIBE报文数据包给服务器, 并等待服务器的UNSUBACK响应(异步通知) */
-    if (socket_send_data(g_sockfd, packet, packet_length) < 0)
+    header[0] = MQTT_MSG_PUBLISH;                           //报文类型为publish
+    if ((qos == QOS_VALUE1) || (qos == QOS_VALUE2))
     {
-        PRINT_LOG("mqtt send UNSUBSCRIBE packet error");
-        free(variable_header);
-        free(fixed_header);
-        free(payload);
-        free(packet);
-        return;
+        /* 只有当QoS等级是1或2时, 报文标识符(Packet Identifier)字段才能出现在PUBLISH报文中 */
+        header[0] |= (qos == QOS_VALUE1) ? MQTT_QOS1_FLAG : MQTT_QOS2_FLAG;
+        qos_size = 2;
+        packet_identifier = mqtt_publish_identifier_get();
+        identifier[0] = (uint8_t)((packet_identifier >> 8) & 0xFF);
+        identifier[1] = (uint8_t)(packet_identifier & 0xFF);
+    }
+    if (retain)
+    {
+        header[0] |= MQTT_RETAIN_FLAG;                      //若设置为1, 则服务端必须存储这个应用消息和它的服务质量等级(QoS)
+    }
+    header_size += mqtt_remain_length_encode(header + 1, 2 + topic_length + qos_size + msg_len);
+
+    /* 可变报头: 主题长度位 + 主题名 + 报文标识符 */
+    header[header_size++] = (uint8_t)((topic_length >> 8) & 0xFF);
+    header[header_size++] = (uint8_t)(topic_length & 0xFF);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_size;
+    iov[1].iov_base = (void *)topic;
+    iov[1].iov_len = topic_length;
+    iov[2].iov_base = identifier;
+    iov[2].iov_len = qos_size;
+    iov[3].iov_base = (void *)msg;                          //有效载荷: 包含将被发布的应用消息
+    iov[3].iov_len = msg_len;
+
+    /* 持久会话下先保存报文再发送, 见mqtt_publish_prepared_send */
+    mqtt_sigio_block(&old_mask);
+    if (qos_size && (gs_clean_session == 0))
+    {
+        ret = mqtt_inflight_record(iov, 4, packet_identifier, nonblock);
+        recorded = (ret == 0);
     }
 
-    free(variable_header);
-    free(fixed_header);
-    free(payload);
-    free(packet);
-}
-
-/**
- * @brief MQTT心跳请求
- * 
- */
-void mqtt_pingreq(void)
-{
-    uint8_t packet[2] = {0};
+    /* 发送PUBLISH报文数据包给服务器, 并等待服务器的PUBACK/PUBREC响应(异步通知), QoS=0时无响应 */
+    if (ret == 0)
+    {
+        ret = nonblock ? socket_send_iov_nonblock(g_sockfd, iov, 4) : socket_send_iov(g_sockfd, iov, 4);
+        if ((ret < 0) && recorded)
+        {
+            mqtt_inflight_unrecord();
+        }
+    }
+    mqtt_sigio_restore(&old_mask);
+    if (ret == -1)
+    {
+        PRINT_LOG("mqtt send PUBLISH packet error");
+        return -1;
+    }
+    else if (ret == MQTT_ERR_WOULDBLOCK)
+    {
+        return MQTT_ERR_WOULDBLOCK;
+    }
+    if (packet_id != NULL)
+    {
+        *packet_id = packet_identifier;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 设置可写回调, 非阻塞发布返回过MQTT_ERR_WOULDBLOCK且待发送数据降到低水位以下时调用.
+ *        回调不在异步通知(SIGIO)中执行, 而是在之后的mqtt_poll或非阻塞发布中于调用者线程执行,
+ *        异步通知模式下等待可写时可调用mqtt_poll(0)
+ * 
+ * @param callback 可写回调
+ */
+void mqtt_set_writable_callback(writable_callback_function callback)
+{
+    gs_writable_callback = callback;
+}
+
+/**
+ * @brief 设置发送缓冲区高低水位
+ * 
+ * @param high 高水位, 不超过MQTT_TX_BUFFER_MAX_LEN
+ * @param low 低水位, 小于高水位
+ */
+void mqtt_set_tx_watermark(uint32_t high, uint32_t low)
+{
+    gs_tx_high_watermark = (high > MQTT_TX_BUFFER_MAX_LEN) ? MQTT_TX_BUFFER_MAX_LEN : high;
+    gs_tx_low_watermark = (low < gs_tx_high_watermark) ? low : gs_tx_high_watermark / 2;
+}
+
+/**
+ * @brief 发送缓冲区中待发送的数据长度
+ * 
+ * @return 待发送字节数
+ */
+uint32_t mqtt_tx_pending(void)
+{
+    return gs_tx_tail - gs_tx_head;
+}
+/**
+ * @brief 设置是否使用异步通知(SIGIO)接收数据, 为0时由应用在自己的事件循环中调用mqtt_poll.
+ *        在mqtt_connect/mqtt_reconnect之前设置. 异步通知模式下SIGIO只发给调用mqtt_connect/mqtt_reconnect的线程,
+ *        客户端没有加锁, 所有接口都必须在该线程中调用
+ * 
+ * @param enable 1: 异步通知(默认); 0: 事件循环
+ */
+void mqtt_set_fasync(uint8_t enable)
+{
+    gs_fasync_enable = enable ? 1 : 0;
+}
+
+/**
+ * @brief 获取当前连接的socket, 事件循环模式下可加入应用自己的epoll, 可读或可写时调用mqtt_poll(0)
+ * 
+ * @return -1: 未连接; 其他: socket文件描述符
+ */
+int mqtt_fd(void)
+{
+    return g_sockfd;
+}
+
+/**
+ * @brief 事件循环模式下等待并处理socket事件: 继续发送发送缓冲区中的数据, 接收并处理报文
+ * 
+ * @param timeout_ms 等待超时时间, 0: 不等待; -1: 一直等待
+ * @return -1: 连接不可用, 需要重连; 0: 超时; 其他: 已处理
+ */
+int mqtt_poll(int timeout_ms)
+{
+    struct pollfd pfd;
+    sigset_t old_mask;
+    int ret = 0;
+
+    if ((g_sockfd < 0) || (gs_connected == 0))
+    {
+        return -1;
+    }
+
+    pfd.fd = g_sockfd;
+    /* 接收暂停时不关心可读事件, 否则poll会一直立即返回 */
+    pfd.events = ((gs_inbound_paused || gs_rx_stalled) ? 0 : POLLIN) | ((gs_tx_tail > gs_tx_head) ? POLLOUT : 0);
+    pfd.revents = 0;
+    ret = poll(&pfd, 1, timeout_ms);
+    if (ret <= 0)
+    {
+        /* 异步通知模式下可写状态由信号处理函数记录, 超时返回时也要通知 */
+        mqtt_writable_dispatch();
+        return ((ret < 0) && (errno != EINTR)) ? -1 : 0;
+    }
+
+    mqtt_sigio_block(&old_mask);
+    if ((gs_tx_tail > gs_tx_head) && (socket_tx_flush(g_sockfd, 0) < 0))
+    {
+        PRINT_LOG("mqtt flush tx buffer error");
+    }
+    if ((pfd.revents & (POLLIN | POLLERR | POLLHUP)) || gs_rx_stalled)
+    {
+        mqtt_receive_process();
+    }
+    mqtt_sigio_restore(&old_mask);
+    mqtt_writable_dispatch();
+
+    return gs_connected ? ret : -1;
+}
+
+/**
+ * @brief 设置确认报文回调函数, 收到CONNACK/PUBACK/PUBCOMP/SUBACK/UNSUBACK时调用,
+ *        通过报文标识符与mqtt_publish_nonblock/mqtt_subscribe的返回值对应
+ * 
+ * @param callback 回调函数, NULL时取消
+ */
+void mqtt_set_ack_callback(ack_callback_function callback)
+{
+    gs_ack_callback = callback;
+}
+
+/**
+ * @brief 设置消息回调函数, 与MqttParamStruct中的回调不同, 可以获取主题、QoS和报文标识符
+ * 
+ * @param callback 回调函数, NULL时取消. 回调返回后报文所在的接收缓冲区会被覆盖
+ */
+void mqtt_set_message_callback(message_callback_function callback)
+{
+    gs_message_callback = callback;
+}
+/**
+ * @brief 设置接收流量控制. 启用后收到的PUBLISH不再调用回调函数, 而是拷贝到接收队列中,
+ *        由应用调用mqtt_message_get取出, 处理完成后调用mqtt_message_complete, 此时才回复PUBACK/PUBREC.
+ *        任一项达到上限时暂停读socket, 全部降到低水位以下时恢复. 在mqtt_connect之前设置
+ * 
+ * @param limit 上限, NULL时关闭接收流量控制(队列中还有消息时不能关闭)
+ * @return -1: 失败; 0: 成功
+ */
+int mqtt_set_inbound_limit(const MqttInboundLimitStruct *limit)
+{
+    sigset_t old_mask;
+
+    if (limit == NULL)
+    {
+        if (gs_inbound_head != gs_inbound_tail)
+        {
+            return -1;
+        }
+        mqtt_sigio_block(&old_mask);
+        gs_inbound_enable = 0;
+        gs_inbound_paused = 0;
+        mqtt_sigio_restore(&old_mask);
+        return 0;
+    }
+    if ((limit->max_messages > MQTT_INBOUND_SLOT_MAX) || (limit->max_unacked > MQTT_INBOUND_SLOT_MAX) ||
+        (limit->max_bytes > MQTT_INBOUND_ARENA_SIZE) || (limit->low_watermark >= 100))
+    {
+        PRINT_LOG("mqtt inbound limit out of range");
+        return -1;
+    }
+
+    /* 队列和数据区只申请一次, 异步通知中只做拷贝 */
+    if (gsst_inbound_slot == NULL)
+    {
+        gsst_inbound_slot = (MqttInboundSlotStruct *)mqtt_pool_alloc(MQTT_INBOUND_SLOT_MAX * sizeof(MqttInboundSlotStruct));
+    }
+    if (gs_inbound_arena == NULL)
+    {
+        gs_inbound_arena = (uint8_t *)mqtt_pool_alloc(MQTT_INBOUND_ARENA_SIZE);
+    }
+    if ((gsst_inbound_slot == NULL) || (gs_inbound_arena == NULL))
+    {
+        PRINT_LOG("mqtt inbound queue alloc error");
+        return -1;
+    }
+
+    mqtt_sigio_block(&old_mask);
+    gsst_inbound_limit.max_messages = limit->max_messages ? limit->max_messages : MQTT_INBOUND_SLOT_MAX;
+    gsst_inbound_limit.max_bytes = limit->max_bytes ? limit->max_bytes : MQTT_INBOUND_ARENA_SIZE;
+    gsst_inbound_limit.max_unacked = limit->max_unacked ? limit->max_unacked : MQTT_INBOUND_SLOT_MAX;
+    gsst_inbound_limit.low_watermark = limit->low_watermark ? limit->low_watermark : MQTT_INBOUND_LOW_WATERMARK;
+    gs_inbound_enable = 1;
+    mqtt_inbound_resume();
+    mqtt_sigio_restore(&old_mask);
+
+    return 0;
+}
+
+/**
+ * @brief 从接收队列中取出最早的一条消息
+ * 
+ * @param message 消息, 主题和数据在mqtt_message_complete之前有效
+ * @return -1: 队列为空; 0: 成功
+ */
+int mqtt_message_get(MqttMessageStruct *message)
+{
+    MqttInboundSlotStruct *slot = NULL;
+    sigset_t old_mask;
+
+    mqtt_sigio_block(&old_mask);
+    if ((gs_inbound_enable == 0) || (gs_inbound_deliver == gs_inbound_head))
+    {
+        mqtt_sigio_restore(&old_mask);
+        return -1;
+    }
+
+    slot = &gsst_inbound_slot[gs_inbound_deliver & (MQTT_INBOUND_SLOT_MAX - 1)];
+    slot->state = MQTT_INBOUND_SLOT_DELIVERED;
+    gs_inbound_deliver++;
+
+    message->topic = (const char *)(gs_inbound_arena + slot->offset);
+    message->topic_length = slot->topic_length;
+    message->payload = gs_inbound_arena + slot->offset + slot->topic_length;
+    message->payload_length = slot->length - slot->topic_length;
+    message->qos = slot->qos;
+    message->packet_identifier = slot->packet_identifier;
+    message->sequence = slot->sequence;
+
+    mqtt_inbound_resume();
+    mqtt_sigio_restore(&old_mask);
+
+    return 0;
+}
+
+/**
+ * @brief 消息处理完成: QoS1回复PUBACK, QoS2回复PUBREC, 释放消息占用的队列空间.
+ *        可以不按取出的顺序完成. 不等待socket可写, 发送缓冲区放不下确认报文时消息保持未完成,
+ *        在可写回调或下一次mqtt_poll之后重试
+ * 
+ * @param message mqtt_message_get取出的消息
+ * @return -1: 消息无效或已完成; 0: 成功; MQTT_ERR_WOULDBLOCK: 发送缓冲区已满, 消息未完成
+ */
+int mqtt_message_complete(const MqttMessageStruct *message)
+{
+    MqttInboundSlotStruct *slot = NULL;
+    sigset_t old_mask;
+    int ret = 0;
+
+    mqtt_sigio_block(&old_mask);
+    slot = &gsst_inbound_slot[message->sequence & (MQTT_INBOUND_SLOT_MAX - 1)];
+    if ((gs_inbound_enable == 0) || (slot->sequence != message->sequence) || (slot->state != MQTT_INBOUND_SLOT_DELIVERED))
+    {
+        mqtt_sigio_restore(&old_mask);
+        return -1;
+    }
+
+    /* 持久会话下, 断线前未确认的消息在重连后确认同样有效 */
+    if (slot->qos == QOS_VALUE1)
+    {
+        ret = mqtt_ack_send(MQTT_MSG_PUBACK, slot->packet_identifier);
+    }
+    else if (slot->qos == QOS_VALUE2)
+    {
+        ret = mqtt_ack_send(MQTT_MSG_PUBREC, slot->packet_identifier);
+    }
+    if (ret == MQTT_ERR_WOULDBLOCK)
+    {
+        /* 待发送数据降到低水位以下时调用可写回调, 通知应用重试 */
+        gs_tx_blocked = 1;
+        mqtt_sigio_restore(&old_mask);
+        return MQTT_ERR_WOULDBLOCK;
+    }
+    if (slot->qos != QOS_VALUE0)
+    {
+        gs_inbound_unacked--;
+    }
+    slot->state = MQTT_INBOUND_SLOT_COMPLETED;
+    gs_inbound_bytes -= slot->length;
+
+    /* 从最早的消息开始回收已完成的消息, 数据区按入队顺序释放 */
+    while (gs_inbound_tail != gs_inbound_deliver)
+    {
+        slot = &gsst_inbound_slot[gs_inbound_tail & (MQTT_INBOUND_SLOT_MAX - 1)];
+        if (slot->state != MQTT_INBOUND_SLOT_COMPLETED)
+        {
+            break;
+        }
+        gs_inbound_tail++;
+    }
+    if (gs_inbound_tail == gs_inbound_head)
+    {
+        gs_inbound_arena_head = 0;
+        gs_inbound_arena_tail = 0;
+    }
+    else
+    {
+        gs_inbound_arena_tail = gsst_inbound_slot[gs_inbound_tail & (MQTT_INBOUND_SLOT_MAX - 1)].offset;
+    }
+
+    mqtt_inbound_resume();
+    mqtt_sigio_restore(&old_mask);
+
+    return 0;
+}
+
+/**
+ * @brief 获取接收队列中未被取走的消息数
+ * 
+ * @return 消息数
+ */
+uint32_t mqtt_inbound_pending(void)
+{
+    return gs_inbound_head - gs_inbound_deliver;
+}
+
+/**
+ * @brief 获取是否已暂停接收
+ * 
+ * @return 1: 已暂停; 0: 未暂停
+ */
+uint8_t mqtt_inbound_paused(void)
+{
+    return gs_inbound_paused;
+}
+
+
+/**
+ * @brief 开始抓包, 之后收发的每个完整报文连同时间戳写入抓包文件, 可用mqtt_replay回放
+ * 
+ * @param path 抓包文件路径, 已存在时覆盖
+ * @return -1: 失败; 0: 成功
+ */
+int mqtt_capture_start(const char *path)
+{
+    MqttCaptureFileStruct file_header;
+    sigset_t old_mask;
+    int fd = -1;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        PRINT_LOG("open mqtt capture file %s error", path);
+        return -1;
+    }
+
+    memcpy(file_header.magic, MQTT_CAPTURE_MAGIC, sizeof(file_header.magic));
+    file_header.version = MQTT_CAPTURE_VERSION;
+    file_header.reserved = 0;
+    if (write(fd, &file_header, sizeof(file_header)) != sizeof(file_header))
+    {
+        PRINT_LOG("write mqtt capture file header error");
+        close(fd);
+        return -1;
+    }
+
+    /* 异步通知中也会写抓包文件, 切换期间屏蔽SIGIO */
+    mqtt_sigio_block(&old_mask);
+    if (gs_capture_fd >= 0)
+    {
+        close(gs_capture_fd);
+    }
+    gs_capture_fd = fd;
+    mqtt_sigio_restore(&old_mask);
+
+    return 0;
+}
+
+/**
+ * @brief 停止抓包并关闭抓包文件
+ * 
+ */
+void mqtt_capture_stop(void)
+{
+    sigset_t old_mask;
+
+    mqtt_sigio_block(&old_mask);
+    if (gs_capture_fd >= 0)
+    {
+        close(gs_capture_fd);
+        gs_capture_fd = -1;
+    }
+    mqtt_sigio_restore(&old_mask);
+}
+
+
+/**
+ * @brief 释放发布句柄
+ * 
+ * @param handle 发布句柄
+ */
+void mqtt_release_publish(MqttPublishHandle *handle)
+{
+    if (handle == NULL)
+    {
+        return;
+    }
+
+    mqtt_pool_free(handle->packet);
+    mqtt_pool_free(handle);
+}
+
+/**
+ * @brief MQTT订阅主题
+ * 
+ * @param topic 主题
+ * @param qos QoS
+ * @return 0: 失败; 其他: SUBSCRIBE报文标识符, 与SUBACK回调中的报文标识符对应
+ */
+uint16_t mqtt_subscribe(const char *topic, uint8_t qos)
+{
+    uint16_t message_id = 0;
+    uint8_t *packet = NULL;
+    uint32_t packet_offset = 0;
+    uint32_t topic_length = strlen(topic);
+    uint32_t remain_length = 0;
+
+    if (mqtt_topic_filter_check(topic, topic_length) < 0)
+    {
+        PRINT_LOG("mqtt subscribe topic filter invalid");
+        return 0;
+    }
+
+    remain_length = 2 + 2 + topic_length + 1;                       //剩余长度=(可变报头)报文标示符长度2+主题长度位占用2字节+主题长度+qos标识
+    packet = (uint8_t *)mqtt_pool_alloc(MQTT_FIXED_HEADER_MAX_LEN + remain_length);
+    if (packet == NULL)
+    {
+        return 0;
+    }
+
+    /* 固定报头 */
+    packet[packet_offset++] = MQTT_MSG_SUBSCRIBE;                   //报文类型为subscribe
+    packet_offset += mqtt_remain_length_encode(packet + packet_offset, remain_length);
+
+    /* 可变报头 */
+    message_id = gs_subscribe_identifier++;
+    if (gs_subscribe_identifier == 0)
+    {
+        gs_subscribe_identifier = 1;                                //报文标识符不能为0
+    }
+    packet[packet_offset++] = (uint8_t)((message_id >> 8) & 0xFF);  //标识符
+    packet[packet_offset++] = (uint8_t)(message_id & 0xFF);
+
+    /* 有效载荷 */
+    packet[packet_offset++] = (uint8_t)((topic_length >> 8) & 0xFF);
+    packet[packet_offset++] = (uint8_t)(topic_length & 0xFF);
+    memcpy(packet + packet_offset, topic, topic_length);
+    packet_offset += topic_length;
+    packet[packet_offset++] = qos;
+
+    /* 发送SUBSCRIBE报文数据包给服务器, 并等待服务器的SUBACK响应(异步通知) */
+    if (socket_send_data(g_sockfd, packet, packet_offset) < 0)
+    {
+        PRINT_LOG("mqtt send SUBSCRIBE packet error");
+        mqtt_pool_free(packet);
+        return 0;
+    }
+    mqtt_subscribe_record(topic, qos);
+
+    mqtt_pool_free(packet);
+
+    return message_id;
+}
+
+/**
+ * @brief MQTT共享订阅, 同一组内的订阅者由服务端负载均衡, 每条消息只投递给组内一个成员
+ * 
+ * @param group 共享组名, 不能包含'/'和通配符
+ * @param filter 主题过滤器
+ * @param qos QoS
+ * @return 0: 失败; 其他: SUBSCRIBE报文标识符
+ */
+uint16_t mqtt_subscribe_shared(const char *group, const char *filter, uint8_t qos)
+{
+    uint16_t message_id = 0;
+    char *topic = NULL;
+    uint32_t topic_size = sizeof(MQTT_TOPIC_SHARE_PREFIX) + strlen(group) + 1 + strlen(filter);
+
+    /* 主题过滤器格式: $share/<组名>/<主题过滤器>, 由mqtt_subscribe统一校验 */
+    topic = (char *)mqtt_pool_alloc(topic_size);
+    if (topic == NULL)
+    {
+        return 0;
+    }
+    snprintf(topic, topic_size, "%s%s/%s", MQTT_TOPIC_SHARE_PREFIX, group, filter);
+
+    message_id = mqtt_subscribe(topic, qos);
+    mqtt_pool_free(topic);
+
+    return message_id;
+}
+
+/**
+ * @brief MQTT取消订阅主题
+ * 
+ * @param topic 主题
+ */
+void mqtt_unsubscribe(const char *topic)
+{
+    uint16_t message_id = 0;
+    uint8_t *packet = NULL;
+    uint32_t packet_offset = 0;
+    uint32_t topic_length = strlen(topic);
+    uint32_t remain_length = 0;
+
+    if (mqtt_topic_filter_check(topic, topic_length) < 0)
+    {
+        PRINT_LOG("mqtt unsubscribe topic filter invalid");
+        return;
+    }
+
+    remain_length = 2 + 2 + topic_length;                           //剩余长度=(可变报头)报文标示符长度2+主题长度位占用2字节+主题长度
+    packet = (uint8_t *)mqtt_pool_alloc(MQTT_FIXED_HEADER_MAX_LEN + remain_length);
+    if (packet == NULL)
+    {
+        return;
+    }
+
+    /* 固定报头 */
+    packet[packet_offset++] = MQTT_MSG_UNSUBSCRIBE;                 //报文类型为unsubscribe
+    packet_offset += mqtt_remain_length_encode(packet + packet_offset, remain_length);
+
+    /* 可变报头 */
+    message_id = gs_unsubscribe_identifier++;
+    if (gs_unsubscribe_identifier == 0)
+    {
+        gs_unsubscribe_identifier = 1;                              //报文标识符不能为0
+    }
+    packet[packet_offset++] = (uint8_t)((message_id >> 8) & 0xFF);  //标识符
+    packet[packet_offset++] = (uint8_t)(message_id & 0xFF);
+
+    /* 有效载荷 */
+    packet[packet_offset++] = (uint8_t)((topic_length >> 8) & 0xFF);
+    packet[packet_offset++] = (uint8_t)(topic_length & 0xFF);
+    memcpy(packet + packet_offset, topic, topic_length);
+    packet_offset += topic_length;
+
+    /* 发送UNSUBSCRIBE报文数据包给服务器, 并等待服务器的UNSUBACK响应(异步通知) */
+    if (socket_send_data(g_sockfd, packet, packet_offset) < 0)
+    {
+        PRINT_LOG("mqtt send UNSUBSCRIBE packet error");
+        mqtt_pool_free(packet);
+        return;
+    }
+    mqtt_subscribe_remove(topic);
+
+    mqtt_pool_free(packet);
+}
+
+/**
+ * @brief MQTT心跳请求
+ * 
+ */
+void mqtt_pingreq(void)
+{
+    uint8_t packet[2] = {0};
+
+    /* 报文数据包: 只包含固定报头 */
+    packet[0] = MQTT_MSG_PINGREQ;
+    packet[1] = 0x00;
+
+    /* 发送PINGREQ报文数据包给服务器, 并等待服务器的PINGRESP响应(异步通知) */
+    if (socket_send_data(g_sockfd, packet, sizeof(packet)) < 0)
+    {
+        PRINT_LOG("mqtt send PINGREQ packet error");
+        return;
+    }
+}
+
+/**
+ * @brief 异步通知回调函数
+ * 
+ * @param signal 
+ */
+static void mqtt_fasync_callback_function(int signal)
+{
+    (void)signal;
+
+    /* socket可写时同样会产生SIGIO, 先继续发送缓冲区中的数据 */
+    if ((gs_tx_tail > gs_tx_head) && (socket_tx_flush(g_sockfd, 0) < 0))
+    {
+        PRINT_LOG("mqtt flush tx buffer error");
+    }
+
+    mqtt_receive_process();
+}
+
+/**
+ * @brief 读取socket中的全部数据并按剩余长度切分成完整报文处理. 一次读取可能包含多个报文,
+ *        也可能只有报文的一部分, 不完整的报文留在接收缓冲区中等待后续数据. 调用前需屏蔽SIGIO
+ * 
+ */
+static void mqtt_receive_process(void)
+{
+    ssize_t read_len = 0;
+
+    /* 发送缓冲区腾出空间后, 先处理因放不下确认报文而留在接收缓冲区中的报文 */
+    if (gs_rx_stalled)
+    {
+        if (MQTT_TX_BUFFER_MAX_LEN - (gs_tx_tail - gs_tx_head) < MQTT_ACK_PACKET_LEN)
+        {
+            return;
+        }
+        gs_rx_stalled = 0;
+        mqtt_receive_buffer_process();
+    }
+
+    /* 接收暂停时不读socket, 由TCP流量控制让服务端减慢发送 */
+    while ((gs_inbound_paused == 0) && (gs_rx_stalled == 0) && gs_connected)
+    {
+        read_len = read(g_sockfd, gs_mqtt_rx_buffer + gs_rx_length, MQTT_RX_BUFFER_MAX_LEN - gs_rx_length);
+        if (read_len < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN)
+            {
+                PRINT_LOG("read mqtt ack eeror");
+            }
+            break;
+        }
+        if (read_len == 0)
+        {
+            /* 服务端关闭了连接, 由应用调用mqtt_reconnect重连 */
+            PRINT_LOG("mqtt connection closed by server");
+            gs_connected = 0;
+            break;
+        }
+        gs_rx_length += read_len;
+        mqtt_receive_buffer_process();
+        if (gs_connected == 0)
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief 从接收缓冲区中切分出完整报文并处理, 接收暂停或接收队列放不下时剩余数据留在缓冲区中
+ * 
+ */
+static void mqtt_receive_buffer_process(void)
+{
+    uint32_t offset = 0;
+    int frame_len = 0;
+
+    while ((offset < gs_rx_length) && (gs_inbound_paused == 0) && (gs_rx_stalled == 0))
+    {
+        frame_len = mqtt_frame_length(gs_mqtt_rx_buffer + offset, gs_rx_length - offset);
+        if (frame_len < 0)
+        {
+            /* 剩余长度编码错误, 无法再找到后续报文的边界 */
+            PRINT_LOG("mqtt receive remain length invalid");
+            mqtt_connection_abort();
+            gs_rx_length = 0;
+            return;
+        }
+        if (frame_len == 0)
+        {
+            break;
+        }
+        /* 接收缓冲区放不下的报文无法完整接收, 丢弃而不确认会让服务端一直重发QoS1/2消息, 关闭网络连接 */
+        if (frame_len > MQTT_RX_BUFFER_MAX_LEN)
+        {
+            PRINT_LOG("mqtt receive packet too long, close connection");
+            mqtt_connection_abort();
+            gs_rx_length = 0;
+            return;
+        }
+        if ((uint32_t)frame_len > gs_rx_length - offset)
+        {
+            break;
+        }
+        if (gs_inbound_enable && ((gs_mqtt_rx_buffer[offset] & 0xF0) == MQTT_MSG_PUBLISH) &&
+            (mqtt_inbound_space_check(frame_len) == 0))
+        {
+            gs_inbound_paused = 1;
+            break;
+        }
+        /* 确认报文只追加到发送缓冲区, 放不下时报文留在接收缓冲区, 由TCP流量控制让服务端减慢发送 */
+        if (mqtt_ack_required(gs_mqtt_rx_buffer[offset]) &&
+            (MQTT_TX_BUFFER_MAX_LEN - (gs_tx_tail - gs_tx_head) < MQTT_ACK_PACKET_LEN))
+        {
+            gs_rx_stalled = 1;
+            break;
+        }
+
+        if (gs_capture_fd >= 0)
+        {
+            struct iovec iov = {gs_mqtt_rx_buffer + offset, (size_t)frame_len};
+            mqtt_capture_write(MQTT_CAPTURE_INBOUND, &iov, 1);
+        }
+        mqtt_receive_frame_process(gs_mqtt_rx_buffer + offset, frame_len);
+        offset += frame_len;
+        if (gs_connected == 0)
+        {
+            gs_rx_length = 0;
+            return;
+        }
+    }
+
+    if (offset > 0)
+    {
+        memmove(gs_mqtt_rx_buffer, gs_mqtt_rx_buffer + offset, gs_rx_length - offset);
+        gs_rx_length -= offset;
+    }
+}
+
+/**
+ * @brief 处理一个完整的接收报文: 回复确认报文, PUBLISH交给应用回调
+ * 
+ * @param frame 报文
+ * @param frame_len 报文长度
+ */
+static void mqtt_receive_frame_process(uint8_t *frame, uint32_t frame_len)
+{
+    MqttPacketStruct packet;
+
+    /* 丢弃而不确认会让服务端一直重发, 收到格式错误的报文(如主题名非法)时必须关闭网络连接(MQTT-4.8.0-1) */
+    if (mqtt_packet_decode(frame, frame_len, &packet) < 0)
+    {
+        PRINT_LOG("mqtt receive packet invalid, close connection");
+        mqtt_connection_abort();
+        return;
+    }
+
+    switch (packet.fixed_header)
+    {
+        case MQTT_MSG_CONNACK:
+            PRINT_LOG("receive mqtt CONNACK ack");
+            gs_session_present = packet.payload[0] & MQTT_SESSION_PRESENT;
+            mqtt_receive_ack_code(MQTT_MSG_CONNACK, packet.payload[1]);
+            if (packet.payload[1] == 0x00)
+            {
+                mqtt_inflight_resume();
+            }
+            if (gs_ack_callback != NULL)
+            {
+                gs_ack_callback(MQTT_MSG_CONNACK, 0, packet.payload[1]);
+            }
+            break;
+
+        case MQTT_MSG_PUBACK:
+            PRINT_LOG("receive mqtt PUBACK ack");
+            mqtt_inflight_update(packet.packet_identifier, MQTT_MSG_PUBACK);
+            if (gs_ack_callback != NULL)
+            {
+                gs_ack_callback(MQTT_MSG_PUBACK, packet.packet_identifier, 0);
+            }
+            break;
+
+        case MQTT_MSG_PUBREC:
+            PRINT_LOG("receive mqtt PUBREC ack");
+            /* QoS2发布的第二步: 回复PUBREL, 服务端收到后回复PUBCOMP */
+            mqtt_inflight_update(packet.packet_identifier, MQTT_MSG_PUBREC);
+            mqtt_ack_send(MQTT_MSG_PUBREL | 0x02, packet.packet_identifier);
+            break;
+
+        case (MQTT_MSG_PUBREL | 0x02):
+            PRINT_LOG("receive mqtt PUBREL ack");
+            /* 服务端下发的QoS2消息: 收到PUBREL后回复PUBCOMP, 完成交付 */
+            mqtt_ack_send(MQTT_MSG_PUBCOMP, packet.packet_identifier);
+            break;
+
+        case MQTT_MSG_PUBCOMP:
+            PRINT_LOG("receive mqtt PUBCOMP ack");
+            mqtt_inflight_update(packet.packet_identifier, MQTT_MSG_PUBCOMP);
+            if (gs_ack_callback != NULL)
+            {
+                gs_ack_callback(MQTT_MSG_PUBCOMP, packet.packet_identifier, 0);
+            }
+            break;
+
+        case MQTT_MSG_SUBACK:
+            PRINT_LOG("receive mqtt SUBACK ack");
+            /* 若同时订阅多个主题, 响应码会一起返回, 目前只判断第一个主题的返回码 */
+            if (packet.payload_length > 0)
+            {
+                mqtt_receive_ack_code(MQTT_MSG_SUBACK, packet.payload[0]);
+            }
+            if (gs_ack_callback != NULL)
+            {
+                gs_ack_callback(MQTT_MSG_SUBACK, packet.packet_identifier, (packet.payload_length > 0) ? packet.payload[0] : 0x80);
+            }
+            break;
+
+        case MQTT_MSG_UNSUBACK:
+            PRINT_LOG("receive mqtt UNSUBACK ack");
+            if (gs_ack_callback != NULL)
+            {
+                gs_ack_callback(MQTT_MSG_UNSUBACK, packet.packet_identifier, 0);
+            }
+            break;
+
+        case MQTT_MSG_PINGRESP:
+            PRINT_LOG("receive mqtt PINGRESP ack");
+            break;
+
+        default :
+            if ((packet.fixed_header & 0xF0) != MQTT_MSG_PUBLISH)
+            {
+                break;
+            }
+
+            /* 启用接收流量控制时消息进入接收队列, 应用处理完成后才回复确认报文 */
+            if (gs_inbound_enable)
+            {
+                mqtt_inbound_enqueue(&packet);
+                gs_inbound_paused = mqtt_inbound_over_limit();
+                break;
+            }
+
+            if (gsst_mqtt_param_data.mqtt_callback_function != NULL)
+            {
+                /* 消息直接指向接收缓冲区, 临时在末尾写入结束符, 回调返回后恢复后面报文的数据 */
+                uint8_t *payload_end = packet.payload + packet.payload_length;
+                uint8_t saved = *payload_end;
+
+                *payload_end = '\0';
+                gsst_mqtt_param_data.mqtt_callback_function(packet.payload, packet.payload_length);
+                *payload_end = saved;
+            }
+            if (gs_message_callback != NULL)
+            {
+                gs_message_callback(&packet);
+            }
+
+            /* QoS1回复PUBACK, QoS2回复PUBREC. 持久会话下未确认的消息会在重连后被服务端重发 */
+            if (packet.qos == QOS_VALUE1)
+            {
+                mqtt_ack_send(MQTT_MSG_PUBACK, packet.packet_identifier);
+            }
+            else if (packet.qos == QOS_VALUE2)
+            {
+                mqtt_ack_send(MQTT_MSG_PUBREC, packet.packet_identifier);
+            }
+            break;
+    }
+}
+/**
+ * @brief 关闭网络连接, 之后由应用调用mqtt_reconnect重连. 这里只shutdown,
+ *        socket在重连时关闭, 避免异步通知中关闭的文件描述符被其他代码复用
+ * 
+ */
+static void mqtt_connection_abort(void)
+{
+    shutdown(g_sockfd, SHUT_RDWR);
+    gs_connected = 0;
+}
+
+/**
+ * @brief 判断接收队列能否放下一条消息(队列空闲位置和数据区连续空间)
+ * 
+ * @param length 消息长度上限, 使用报文长度即可
+ * @return 1: 能放下; 0: 放不下
+ */
+static uint8_t mqtt_inbound_space_check(uint32_t length)
+{
+    if (gs_inbound_head - gs_inbound_tail >= MQTT_INBOUND_SLOT_MAX)
+    {
+        return 0;
+    }
+    if (gs_inbound_head == gs_inbound_tail)
+    {
+        return 1;
+    }
+
+    /* 未回绕时先用尾部空间, 不够再回绕到头部; 回绕后head不能追上tail */
+    if (gs_inbound_arena_head >= gs_inbound_arena_tail)
+    {
+        return (MQTT_INBOUND_ARENA_SIZE - gs_inbound_arena_head >= length) || (gs_inbound_arena_tail > length);
+    }
+
+    return gs_inbound_arena_tail - gs_inbound_arena_head > length;
+}
+
+/**
+ * @brief 把PUBLISH的主题和数据拷贝到接收队列, 调用前需用mqtt_inbound_space_check确认能放下
+ * 
+ * @param packet 解码后的PUBLISH报文
+ */
+static void mqtt_inbound_enqueue(const MqttPacketStruct *packet)
+{
+    MqttInboundSlotStruct *slot = NULL;
+    uint32_t length = packet->topic_length + packet->payload_length;
+    uint32_t offset = 0;
+
+    if (gs_inbound_head == gs_inbound_tail)
+    {
+        gs_inbound_arena_head = 0;
+        gs_inbound_arena_tail = 0;
+    }
+    if ((gs_inbound_arena_head >= gs_inbound_arena_tail) && (MQTT_INBOUND_ARENA_SIZE - gs_inbound_arena_head < length))
+    {
+        gs_inbound_arena_head = 0;
+    }
+    offset = gs_inbound_arena_head;
+
+    memcpy(gs_inbound_arena + offset, packet->topic, packet->topic_length);
+    memcpy(gs_inbound_arena + offset + packet->topic_length, packet->payload, packet->payload_length);
+    gs_inbound_arena_head += length;
+
+    slot = &gsst_inbound_slot[gs_inbound_head & (MQTT_INBOUND_SLOT_MAX - 1)];
+    slot->offset = offset;
+    slot->length = length;
+    slot->sequence = gs_inbound_head;
+    slot->topic_length = packet->topic_length;
+    slot->packet_identifier = packet->packet_identifier;
+    slot->qos = packet->qos;
+    slot->state = MQTT_INBOUND_SLOT_QUEUED;
+    gs_inbound_head++;
+
+    gs_inbound_bytes += length;
+    if (packet->qos != QOS_VALUE0)
+    {
+        gs_inbound_unacked++;
+    }
+}
+
+/**
+ * @brief 判断接收队列是否达到上限
+ * 
+ * @return 1: 达到上限; 0: 未达到
+ */
+static uint8_t mqtt_inbound_over_limit(void)
+{
+    return (gs_inbound_head - gs_inbound_deliver >= gsst_inbound_limit.max_messages) ||
+           (gs_inbound_bytes >= gsst_inbound_limit.max_bytes) ||
+           (gs_inbound_unacked >= gsst_inbound_limit.max_unacked);
+}
+
+/**
+ * @brief 接收已暂停且全部降到低水位以下时恢复接收: 先处理接收缓冲区中剩余的报文, 再继续读socket.
+ *        暂停期间到达的数据产生的SIGIO已被忽略, 这里必须主动读取. 调用前需屏蔽SIGIO
+ * 
+ */
+static void mqtt_inbound_resume(void)
+{
+    uint32_t percent = gsst_inbound_limit.low_watermark;
+
+    if (gs_inbound_paused == 0)
+    {
+        return;
+    }
+    if (((gs_inbound_head - gs_inbound_deliver) * 100 >= gsst_inbound_limit.max_messages * percent) ||
+        (gs_inbound_bytes * 100ULL >= (uint64_t)gsst_inbound_limit.max_bytes * percent) ||
+        (gs_inbound_unacked * 100 >= gsst_inbound_limit.max_unacked * percent))
+    {
+        return;
+    }
+
+    gs_inbound_paused = 0;
+    mqtt_receive_buffer_process();
+    if ((gs_inbound_paused == 0) && (g_sockfd >= 0) && gs_connected)
+    {
+        mqtt_receive_process();
+    }
+}
+
+
+/**
+ * @brief 持久会话下保存发出的QoS1/2 PUBLISH报文, 重连且服务端保留会话时重发. 调用前需屏蔽SIGIO
+ * 
+ * @param iov 报文数据块
+ * @param iovcnt 数据块个数
+ * @param packet_identifier 报文标识符
+ * @param nonblock 1: 非阻塞发布; 0: 阻塞发布
+ * @return -1: 失败; 0: 成功; MQTT_ERR_WOULDBLOCK: 未完成的报文已满(非阻塞发布)
+ */
+static int mqtt_inflight_record(const struct iovec *iov, int iovcnt, uint16_t packet_identifier, uint8_t nonblock)
+{
+    MqttInflightSlotStruct *slot = NULL;
+    uint32_t length = 0;
+    uint32_t offset = 0;
+    uint8_t full = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        length += iov[i].iov_len;
+    }
+
+    /* 重发时整个报文要放入发送缓冲区 */
+    if (length > MQTT_TX_BUFFER_MAX_LEN)
+    {
+        PRINT_LOG("mqtt packet too large to resend after reconnect");
+        return -1;
+    }
+    if (gsst_inflight_slot == NULL)
+    {
+        gsst_inflight_slot = (MqttInflightSlotStruct *)mqtt_pool_alloc(MQTT_INFLIGHT_SLOT_MAX * sizeof(MqttInflightSlotStruct));
+    }
+    if (gs_inflight_arena == NULL)
+    {
+        gs_inflight_arena = (uint8_t *)mqtt_pool_alloc(MQTT_INFLIGHT_ARENA_SIZE);
+    }
+    if ((gsst_inflight_slot == NULL) || (gs_inflight_arena == NULL))
+    {
+        PRINT_LOG("mqtt inflight queue alloc error");
+        return -1;
+    }
+
+    /* 数据区的使用方式与接收队列相同: 未回绕时先用尾部空间, 不够再回绕到头部 */
+    if (gs_inflight_head == gs_inflight_tail)
+    {
+        gs_inflight_arena_head = 0;
+        gs_inflight_arena_tail = 0;
+    }
+    else if (gs_inflight_head - gs_inflight_tail >= MQTT_INFLIGHT_SLOT_MAX)
+    {
+        full = 1;
+    }
+    else if (gs_inflight_arena_head >= gs_inflight_arena_tail)
+    {
+        if (MQTT_INFLIGHT_ARENA_SIZE - gs_inflight_arena_head < length)
+        {
+            full = (gs_inflight_arena_tail <= length);
+            gs_inflight_arena_head = full ? gs_inflight_arena_head : 0;
+        }
+    }
+    else
+    {
+        full = (gs_inflight_arena_tail - gs_inflight_arena_head <= length);
+    }
+    if (full)
+    {
+        if (nonblock)
+        {
+            gs_tx_blocked = 1;
+            return MQTT_ERR_WOULDBLOCK;
+        }
+        PRINT_LOG("mqtt too many inflight packets");
+        return -1;
+    }
+
+    offset = gs_inflight_arena_head;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(gs_inflight_arena + gs_inflight_arena_head, iov[i].iov_base, iov[i].iov_len);
+        gs_inflight_arena_head += iov[i].iov_len;
+    }
+
+    slot = &gsst_inflight_slot[gs_inflight_head & (MQTT_INFLIGHT_SLOT_MAX - 1)];
+    slot->offset = offset;
+    slot->length = length;
+    slot->packet_identifier = packet_identifier;
+    slot->state = MQTT_INFLIGHT_SLOT_PUBLISH;
+    gs_inflight_head++;
+
+    return 0;
+}
+
+/**
+ * @brief 删除最后保存的报文(发送失败时使用). 调用前需屏蔽SIGIO
+ * 
+ */
+static void mqtt_inflight_unrecord(void)
+{
+    gs_inflight_head--;
+    gs_inflight_arena_head = gsst_inflight_slot[gs_inflight_head & (MQTT_INFLIGHT_SLOT_MAX - 1)].offset;
+}
+
+/**
+ * @brief 收到PUBACK/PUBREC/PUBCOMP时更新报文状态, PUBACK/PUBCOMP后释放报文. 确认报文一般按发送顺序到达,
+ *        从最早的报文开始查找
+ * 
+ * @param packet_identifier 报文标识符
+ * @param ack_type MQTT_MSG_PUBACK / MQTT_MSG_PUBREC / MQTT_MSG_PUBCOMP
+ */
+static void mqtt_inflight_update(uint16_t packet_identifier, uint8_t ack_type)
+{
+    MqttInflightSlotStruct *slot = NULL;
+    uint8_t state = (ack_type == MQTT_MSG_PUBCOMP) ? MQTT_INFLIGHT_SLOT_PUBREL : MQTT_INFLIGHT_SLOT_PUBLISH;
+    uint32_t sequence = gs_inflight_tail;
+
+    if (gsst_inflight_slot == NULL)
+    {
+        return;
+    }
+    for (; sequence != gs_inflight_head; sequence++)
+    {
+        slot = &gsst_inflight_slot[sequence & (MQTT_INFLIGHT_SLOT_MAX - 1)];
+        if ((slot->state == state) && (slot->packet_identifier == packet_identifier))
+        {
+            break;
+        }
+    }
+    if (sequence == gs_inflight_head)
+    {
+        return;
+    }
+    if (ack_type == MQTT_MSG_PUBREC)
+    {
+        slot->state = MQTT_INFLIGHT_SLOT_PUBREL;
+        return;
+    }
+    slot->state = MQTT_INFLIGHT_SLOT_COMPLETED;
+
+    while (gs_inflight_tail != gs_inflight_head)
+    {
+        slot = &gsst_inflight_slot[gs_inflight_tail & (MQTT_INFLIGHT_SLOT_MAX - 1)];
+        if (slot->state != MQTT_INFLIGHT_SLOT_COMPLETED)
+        {
+            break;
+        }
+        gs_inflight_tail++;
+    }
+    if (gs_inflight_tail != gs_inflight_head)
+    {
+        gs_inflight_arena_tail = gsst_inflight_slot[gs_inflight_tail & (MQTT_INFLIGHT_SLOT_MAX - 1)].offset;
+    }
+
+    /* 非阻塞发布可能因未完成的报文已满被拒绝过 */
+    socket_tx_writable_check();
+}
+
+/**
+ * @brief CONNACK接受连接后处理未完成的报文: 服务端保留了会话时按原顺序重发(MQTT 3.1.1 4.4节),
+ *        否则服务端已没有这些报文的状态, 全部丢弃. 调用前需屏蔽SIGIO
+ * 
+ */
+static void mqtt_inflight_resume(void)
+{
+    if ((gsst_inflight_slot == NULL) || (gs_inflight_head == gs_inflight_tail))
+    {
+        return;
+    }
+
+    if (gs_clean_session || (gs_session_present == 0))
+    {
+        PRINT_LOG("mqtt session not present, %u inflight packets dropped", gs_inflight_head - gs_inflight_tail);
+        gs_inflight_tail = gs_inflight_head;
+        gs_inflight_resend = gs_inflight_head;
+        gs_inflight_resend_end = gs_inflight_head;
+        socket_tx_writable_check();
+        return;
+    }
+
+    gs_inflight_resend = gs_inflight_tail;
+    gs_inflight_resend_end = gs_inflight_head;
+    if ((g_sockfd >= 0) && (socket_tx_flush(g_sockfd, 0) < 0))
+    {
+        PRINT_LOG("mqtt resend inflight packets error");
+    }
+}
+
+/**
+ * @brief 把待重发的报文按顺序追加到发送缓冲区, 直到全部追加完或缓冲区放不下:
+ *        PUBLISH置DUP标志重发, 已收到PUBREC的重发PUBREL. 调用前需屏蔽SIGIO
+ * 
+ */
+static void mqtt_inflight_resend_fill(void)
+{
+    MqttInflightSlotStruct *slot = NULL;
+    uint8_t *buffer = NULL;
+    uint32_t length = 0;
+
+    /* 重发期间已确认并释放的报文不再重发 */
+    if ((int32_t)(gs_inflight_resend - gs_inflight_tail) < 0)
+    {
+        gs_inflight_resend = gs_inflight_tail;
+    }
+    while ((int32_t)(gs_inflight_resend_end - gs_inflight_resend) > 0)
+    {
+        slot = &gsst_inflight_slot[gs_inflight_resend & (MQTT_INFLIGHT_SLOT_MAX - 1)];
+        if (slot->state != MQTT_INFLIGHT_SLOT_COMPLETED)
+        {
+            length = (slot->state == MQTT_INFLIGHT_SLOT_PUBLISH) ? slot->length : MQTT_ACK_PACKET_LEN;
+            buffer = socket_tx_reserve(length);
+            if (buffer == NULL)
+            {
+                return;
+            }
+            if (slot->state == MQTT_INFLIGHT_SLOT_PUBLISH)
+            {
+                gs_inflight_arena[slot->offset] |= MQTT_DUP_FLAG;
+                memcpy(buffer, gs_inflight_arena + slot->offset, length);
+            }
+            else
+            {
+                buffer[0] = MQTT_MSG_PUBREL | 0x02;
+                buffer[1] = 0x02;
+                buffer[2] = (uint8_t)((slot->packet_identifier >> 8) & 0xFF);
+                buffer[3] = (uint8_t)(slot->packet_identifier & 0xFF);
+            }
+            if (gs_capture_fd >= 0)
+            {
+                struct iovec iov = {buffer, length};
+                mqtt_capture_write(MQTT_CAPTURE_OUTBOUND, &iov, 1);
+            }
+            gs_tx_tail += length;
+        }
+        gs_inflight_resend++;
+    }
+}
+
+/**
+ * @brief 根据固定报头计算完整报文的长度, 用于从字节流中切分报文
+ * 
+ * @param data 报文起始数据
+ * @param len 已接收的数据长度
+ * @return -1: 剩余长度编码错误; 0: 数据不足, 无法确定报文长度; 其他: 报文长度(固定报头 + 剩余长度)
+ */
+int mqtt_frame_length(const uint8_t *data, uint32_t len)
+{
+    uint32_t remain_length = 0;
+    uint32_t multiplier = 1;
+
+    /* 剩余长度最多4字节, 每字节低7位为数据, 最高位为1表示后面还有字节 */
+    for (uint8_t i = 1; i < MQTT_FIXED_HEADER_MAX_LEN; i++)
+    {
+        if (i >= len)
+        {
+            return 0;
+        }
+        remain_length += (data[i] & 127) * multiplier;
+        if ((data[i] & 128) == 0)
+        {
+            return 1 + i + remain_length;
+        }
+        multiplier *= 128;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief 解码一个完整的报文, 不修改报文也没有其他副作用, 接收处理和抓包回放共用
+ * 
+ * @param frame 报文
+ * @param frame_len 报文长度, 必须等于mqtt_frame_length的返回值
+ * @param packet 解码结果, 指针指向frame内部
+ * @return -1: 报文格式错误; 0: 成功
+ */
+int mqtt_packet_decode(uint8_t *frame, uint32_t frame_len, MqttPacketStruct *packet)
+{
+    uint32_t offset = 0;
+
+    /* 报文类型 + 剩于长度(1-4, 可变) + 可变报头 + 有效载荷. 长度不足2字节时mqtt_frame_length返回0 */
+    if ((frame_len < 2) || (frame_len > INT32_MAX) || (mqtt_frame_length(frame, frame_len) != (int)frame_len))
+    {
+        return -1;
+    }
+    offset = 2;
+    while (frame[offset - 1] & 0x80)
+    {
+        offset++;
+    }
+
+    memset(packet, 0, sizeof(MqttPacketStruct));
+    packet->fixed_header = frame[0];
+
+    switch (frame[0] & 0xF0)
+    {
+        case MQTT_MSG_PUBLISH:
+            /* 主题长度位(2) + 主题名数据 + 报文标识符(2, QoS=0时无) + 消息数据 */
+            if (offset + 2 > frame_len)
+            {
+                return -1;
+            }
+            packet->topic_length = (frame[offset] << 8) | frame[offset + 1];
+            offset += 2;
+            if (offset + packet->topic_length > frame_len)
+            {
+                return -1;
+            }
+
+            /* 服务端下发的主题名同样必须是合法的UTF-8编码, 且不能包含通配符 */
+            packet->topic = (const char *)(frame + offset);
+            if (mqtt_topic_name_check(packet->topic, packet->topic_length) < 0)
+            {
+                return -1;
+            }
+            offset += packet->topic_length;
+
+            packet->qos = (frame[0] & 0x06) >> 1;
+            if (packet->qos > QOS_VALUE2)
+            {
+                return -1;
+            }
+            if (packet->qos != QOS_VALUE0)
+            {
+                if (offset + 2 > frame_len)
+                {
+                    return -1;
+                }
+                packet->packet_identifier = (frame[offset] << 8) | frame[offset + 1];
+                offset += 2;
+            }
+            break;
+
+        case MQTT_MSG_CONNACK:
+            /* 连接确认标志 + 连接返回码, 作为payload返回, 剩余长度固定为2 */
+            if (offset + 2 != frame_len)
+            {
+                return -1;
+            }
+            break;
+
+        case MQTT_MSG_PUBACK:
+        case MQTT_MSG_PUBREC:
+        case MQTT_MSG_PUBREL:
+        case MQTT_MSG_PUBCOMP:
+        case MQTT_MSG_SUBACK:
+        case MQTT_MSG_UNSUBACK:
+            if (offset + 2 > frame_len)
+            {
+                return -1;
+            }
+            packet->packet_identifier = (frame[offset] << 8) | frame[offset + 1];
+            offset += 2;
+            break;
+
+        default :
+            break;
+    }
+
+    packet->payload = frame + offset;
+    packet->payload_length = frame_len - offset;
+
+    return 0;
+}
+
+/**
+ * @brief MQTT接收响应返回码
+ * 
+ * @param ack_type 响应类型
+ * @param ack_code 返回码
+ */
+static void mqtt_receive_ack_code(uint8_t ack_type, uint8_t ack_code)
+{
+    if (ack_type == MQTT_MSG_CONNACK)
+    {
+        switch (ack_code)
+        {
+            case 0x00:
+                PRINT_LOG("The connection has been accepted by the server");
+                break;
+
+            case 0x01:
+                PRINT_LOG("The server does not support the MQTT protocol level requested by the client");
+                break;
+
+            case 0x02:
+                PRINT_LOG("The client identifier is the correct UTF-8 encoding, but is not allowed on the server");
+                break;
+
+            case 0x03:
+                PRINT_LOG("Network connection established, but MQTT service unavailable");
+                break;
+
+            case 0x04:
+                PRINT_LOG("The data format of the user name or password is invalid");
+                break;
+
+            case 0x05:
+                PRINT_LOG("The client is not authorized to connect to this server, and check that the password and so on are correct");
+                break;
+
+            default :
+                break;
+        }
+    }
+    else if (ack_type == MQTT_MSG_SUBACK)
+    {
+        switch (ack_code)
+        {
+            case 0x00:
+                PRINT_LOG("The maximum QoS 0");
+                break;
+
+            case 0x01:
+                PRINT_LOG("The maximum QoS 1");
+                break;
+
+            case 0x02:
+                PRINT_LOG("The maximum QoS 2");
+                break;
+
+            case 0x80:
+                PRINT_LOG("mqtt SUBACK error");
+                break;
+            
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * @brief 检查收到的CONNACK, 记录服务端是否保留了会话
+ * 
+ * @param connack CONNACK报文(4字节)
+ * @return -1: 报文错误或服务端拒绝连接; 0: 连接已被接受
+ */
+static int mqtt_connack_check(const uint8_t *connack)
+{
+    if (gs_capture_fd >= 0)
+    {
+        struct iovec iov = {(void *)connack, 4};
+        mqtt_capture_write(MQTT_CAPTURE_INBOUND, &iov, 1);
+    }
+
+    /* CONNACK: 报文类型(0x20) + 剩余长度(0x02) + 连接确认标志 + 连接返回码 */
+    if ((connack[0] != MQTT_MSG_CONNACK) || (connack[1] != 0x02))
+    {
+        PRINT_LOG("mqtt CONNACK invalid");
+        return -1;
+    }
+    mqtt_receive_ack_code(MQTT_MSG_CONNACK, connack[3]);
+    if (connack[3] != 0x00)
+    {
+        return -1;
+    }
+    gs_session_present = connack[2] & MQTT_SESSION_PRESENT;
+
+    return 0;
+}
+
+/**
+ * @brief 记录已订阅的主题, 重连后服务端未保留会话时用于恢复订阅
+ * 
+ * @param topic 主题
+ * @param qos QoS
+ */
+static void mqtt_subscribe_record(const char *topic, uint8_t qos)
+{
+    int free_index = -1;
+
+    if (strlen(topic) >= MQTT_SUBSCRIBE_TOPIC_MAX_LEN)
+    {
+        PRINT_LOG("mqtt subscribe topic too long to restore after reconnect");
+        return;
+    }
+
+    for (int i = 0; i < MQTT_SUBSCRIBE_MAX_NUM; i++)
+    {
+        if (gsst_mqtt_subscribe[i].used == 0)
+        {
+            if (free_index < 0)
+            {
+                free_index = i;
+            }
+        }
+        else if (strcmp(gsst_mqtt_subscribe[i].topic, topic) == 0)
+        {
+            gsst_mqtt_subscribe[i].qos = qos;
+            return;
+        }
+    }
+
+    if (free_index < 0)
+    {
+        PRINT_LOG("mqtt subscribe table full, topic will not be restored after reconnect");
+        return;
+    }
+    memset(gsst_mqtt_subscribe[free_index].topic, 0, MQTT_SUBSCRIBE_TOPIC_MAX_LEN);
+    memcpy(gsst_mqtt_subscribe[free_index].topic, topic, strlen(topic));
+    gsst_mqtt_subscribe[free_index].qos = qos;
+    gsst_mqtt_subscribe[free_index].used = 1;
+}
+
+/**
+ * @brief 删除已订阅主题的记录
+ * 
+ * @param topic 主题
+ */
+static void mqtt_subscribe_remove(const char *topic)
+{
+    for (int i = 0; i < MQTT_SUBSCRIBE_MAX_NUM; i++)
+    {
+        if (gsst_mqtt_subscribe[i].used && (strcmp(gsst_mqtt_subscribe[i].topic, topic) == 0))
+        {
+            gsst_mqtt_subscribe[i].used = 0;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief 重新订阅所有已记录的主题
+ * 
+ */
+static void mqtt_subscribe_restore(void)
+{
+    for (int i = 0; i < MQTT_SUBSCRIBE_MAX_NUM; i++)
+    {
+        if (gsst_mqtt_subscribe[i].used)
+        {
+            mqtt_subscribe(gsst_mqtt_subscribe[i].topic, gsst_mqtt_subscribe[i].qos);
+        }
+    }
+}
+
+/**
+ * @brief 判断收到的报文是否需要回复确认报文
+ * 
+ * @param fixed_header 报文的固定报头第一个字节
+ * @return 1: 需要; 0: 不需要
+ */
+static uint8_t mqtt_ack_required(uint8_t fixed_header)
+{
+    /* 启用接收流量控制时, PUBLISH的确认报文由mqtt_message_complete发送 */
+    if ((fixed_header & 0xF0) == MQTT_MSG_PUBLISH)
+    {
+        return (gs_inbound_enable == 0) && ((fixed_header & 0x06) != 0);
+    }
+
+    return (fixed_header == MQTT_MSG_PUBREC) || (fixed_header == (MQTT_MSG_PUBREL | 0x02));
+}
+
+/**
+ * @brief 发送只包含报文标识符的确认报文(PUBACK/PUBREC/PUBREL/PUBCOMP). 追加到发送缓冲区后只尝试一次
+ *        非阻塞发送, 不等待socket可写, 可在异步通知中调用. 调用前需屏蔽SIGIO
+ * 
+ * @param ack_type 报文类型
+ * @param packet_identifier 报文标识符
+ * @return 0: 成功; MQTT_ERR_WOULDBLOCK: 发送缓冲区已满, 未发送
+ */
+static int mqtt_ack_send(uint8_t ack_type, uint16_t packet_identifier)
+{
+    uint8_t *packet = NULL;
+
+    /* 断线期间(如非阻塞重连时)确认报文不能留在发送缓冲区, 否则会在新连接的CONNECT之前发出.
+       持久会话下服务端会在重连后重发未确认的消息 */
+    if (gs_connected == 0)
+    {
+        return 0;
+    }
+
+    packet = socket_tx_reserve(MQTT_ACK_PACKET_LEN);
+    if (packet == NULL)
+    {
+        return MQTT_ERR_WOULDBLOCK;
+    }
+
+    packet[0] = ack_type;
+    packet[1] = 0x02;
+    packet[2] = (uint8_t)((packet_identifier >> 8) & 0xFF);
+    packet[3] = (uint8_t)(packet_identifier & 0xFF);
+    if (gs_capture_fd >= 0)
+    {
+        struct iovec iov = {packet, MQTT_ACK_PACKET_LEN};
+        mqtt_capture_write(MQTT_CAPTURE_OUTBOUND, &iov, 1);
+    }
+    gs_tx_tail += MQTT_ACK_PACKET_LEN;
+
+    /* 写不完的部分由下一次socket可写时的异步通知或mqtt_poll继续发送 */
+    if ((g_sockfd >= 0) && gs_connected && (socket_tx_flush(g_sockfd, 0) < 0))
+    {
+        PRINT_LOG("mqtt send ack 0x%x packet error", ack_type);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 旧连接已失效, 关闭socket并清空收发状态, 准备建立新连接
+ * 
+ */
+static void mqtt_reconnect_reset(void)
+{
+    /* 不能在原socket上再次connect, 关闭后重新创建 */
+    if (g_sockfd >= 0)
+    {
+        socket_deinit(g_sockfd);
+        g_sockfd = -1;
+    }
+    gs_connected = 0;
+
+    /* 发送缓冲区中是旧连接未发完的数据, 新连接上不能接着发送. 未完成的QoS1/2报文在CONNACK之后才能重发 */
+    gs_tx_head = 0;
+    gs_tx_tail = 0;
+    gs_inflight_resend = gs_inflight_resend_end;
+    gs_rx_length = 0;
+    gs_rx_stalled = 0;
+
+    /* 同步重连会打断进行中的非阻塞重连 */
+    if (gs_reconnect_addr_list != NULL)
+    {
+        freeaddrinfo(gs_reconnect_addr_list);
+        gs_reconnect_addr_list = NULL;
+        gs_reconnect_addr = NULL;
+    }
+    gs_reconnect_state = MQTT_RECONNECT_IDLE;
+}
+
+/**
+ * @brief 收到CONNACK后恢复会话: 重发未完成的QoS1/2报文, 处理已到达的消息, 必要时重新订阅
+ * 
+ */
+static void mqtt_reconnect_complete(void)
+{
+    sigset_t old_mask;
+
+    PRINT_LOG("mqtt socket reconnect server ok, session present %d", gs_session_present);
+    gs_reconnect_attempt = 0;
+
+    /* 服务端可能紧跟CONNACK重发持久会话中的消息, 这些数据在使能异步通知前已到达, 不会再产生SIGIO */
+    mqtt_sigio_block(&old_mask);
+    mqtt_inflight_resume();
+    mqtt_fasync_enable();
+    mqtt_receive_process();
+    mqtt_sigio_restore(&old_mask);
+    if (gs_tx_blocked)
+    {
+        gs_tx_blocked = 0;
+        gs_writable_pending = 1;
+    }
+    mqtt_writable_dispatch();
+
+    /* 服务端保留了会话时, 订阅关系仍然有效, 无需重新订阅 */
+    if (gs_session_present == 0)
+    {
+        mqtt_subscribe_restore();
+    }
+}
+
+/**
+ * @brief 非阻塞重连本轮失败, 关闭socket, 下一次调用先退避再开始新一轮
+ * 
+ */
+static void mqtt_reconnect_fail(void)
+{
+    if (g_sockfd >= 0)
+    {
+        socket_deinit(g_sockfd);
+        g_sockfd = -1;
+    }
+    if (gs_reconnect_addr_list != NULL)
+    {
+        freeaddrinfo(gs_reconnect_addr_list);
+        gs_reconnect_addr_list = NULL;
+        gs_reconnect_addr = NULL;
+    }
+    gs_reconnect_state = MQTT_RECONNECT_IDLE;
+}
+
+/**
+ * @brief 非阻塞重连中等待socket事件或退避结束, 每次调用mqtt_reconnect_poll最多等待一次,
+ *        等待时间不超过调用者给出的时间和当前步骤的截止时间
+ * 
+ * @param fd 等待的socket, -1时只等待截止时间
+ * @param events 等待的事件
+ * @param timeout_ms 调用者剩余的等待时间, 返回时置0
+ * @return -1: 已到截止时间或出错; 0: 未就绪, 等待时间已用完; 1: 事件已就绪
+ */
+static int mqtt_reconnect_wait(int fd, short events, int *timeout_ms)
+{
+    uint64_t now = mqtt_now_ms();
+    int remain_ms = (gs_reconnect_deadline > now) ? (int)(gs_reconnect_deadline - now) : 0;
+    struct pollfd pfd = {fd, events, 0};
+    int ret = 0;
+
+    ret = poll(&pfd, 1, ((*timeout_ms >= 0) && (*timeout_ms < remain_ms)) ? *timeout_ms : remain_ms);
+    *timeout_ms = 0;
+    if (ret > 0)
+    {
+        return 1;
+    }
+    if ((ret < 0) && (errno != EINTR))
+    {
+        return -1;
+    }
+
+    return (mqtt_now_ms() >= gs_reconnect_deadline) ? -1 : 0;
+}
+
+/**
+ * @brief 计算重连退避等待时间, 在[base/2, base]之间随机, 避免大量客户端同时重连
+ * 
+ * @return 等待时间(毫秒)
+ */
+static uint32_t mqtt_reconnect_backoff(void)
+{
+    static uint32_t seed = 0;
+    uint32_t base = gs_reconnect_backoff_min;
+    uint32_t delay = 0;
+
+    if (seed == 0)
+    {
+        seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    }
+    for (uint32_t i = 1; (i < gs_reconnect_attempt) && (base < gs_reconnect_backoff_max); i++)
+    {
+        base *= 2;
+    }
+    if (base > gs_reconnect_backoff_max)
+    {
+        base = gs_reconnect_backoff_max;
+    }
+
+    delay = base / 2 + rand_r(&seed) % (base - base / 2 + 1);
+
+    return delay;
+}
+
+/**
+ * @brief 编码剩余长度字段(变长编码, 每字节低7位为数据, 最高位为延续位)
+ * 
+ * @param buffer 编码输出, 至少4字节
+ * @param remain_length 剩余长度
+ * @return 剩余长度字段占用的字节数
+ */
+static uint8_t mqtt_remain_length_encode(uint8_t *buffer, uint32_t remain_length)
+{
+    uint8_t bytes = 0;
+
+    do
+    {
+        buffer[bytes] = remain_length % 128;
+        remain_length /= 128;
+        if (remain_length > 0)
+        {
+            buffer[bytes] |= 0x80;
+        }
+        bytes++;
+    } while ((remain_length > 0) && (bytes < 4));
+
+    return bytes;
+}
+
+/**
+ * @brief 获取下一个PUBLISH报文标识符, 标识符不能为0
+ * 
+ * @return 报文标识符
+ */
+static uint16_t mqtt_publish_identifier_get(void)
+{
+    gs_publish_identifier++;
+    if (gs_publish_identifier == 0)
+    {
+        gs_publish_identifier = 1;
+    }
+
+    return gs_publish_identifier;
+}
+
+/**
+ * @brief socket初始化, 从上一次连接成功的地址开始依次尝试所有服务器地址
+ * 
+ * @return -1: 失败； 0: 成功 
+ */
+static int socket_init(void)
+{
+    uint8_t endpoint_total = gs_endpoint_num + 1;
+
+    for (uint8_t i = 0; i < endpoint_total; i++)
+    {
+        uint8_t index = (gs_endpoint_index + i) % endpoint_total;
+        uint16_t port = 0;
+        const char *host = socket_endpoint_get(index, &port);
+
+        if (host[0] == '\0')
+        {
+            continue;
+        }
+
+        g_sockfd = socket_connect(host, port);
+        if (g_sockfd >= 0)
+        {
+            gs_endpoint_index = index;
+            gs_connected = 1;
+            return 0;
+        }
+        PRINT_LOG("socket connect server %s:%d error", host, port);
+    }
+
+    return -1;
+}
+
+/**
+ * @brief 解析服务器地址并非阻塞连接, 超时时间为MQTT_CONNECT_TIMEOUT_MS
+ * 
+ * @param host 服务器域名或IP地址
+ * @param port 端口
+ * @return -1: 失败； 其他: 已连接的非阻塞socket
+ */
+static int socket_connect(const char *host, uint16_t port)
+{
+    int fd = -1;
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    char service[8] = {0};
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    struct addrinfo *rp = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host, service, &hints, &result) != 0)
+    {
+        PRINT_LOG("getaddrinfo %s error", host);
+        return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next)
+    {
+        if ((fd = socket_connect_start(rp)) < 0)
+        {
+            continue;
+        }
+
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        if ((poll(&pfd, 1, MQTT_CONNECT_TIMEOUT_MS) == 1) &&
+            (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0) && (error == 0))
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    return fd;
+}
+
+/**
+ * @brief 创建非阻塞socket并发起连接, 不等待连接完成
+ * 
+ * @param rp 服务器地址解析结果
+ * @return -1: 失败; 其他: 已连接或正在连接的非阻塞socket
+ */
+static int socket_connect_start(const struct addrinfo *rp)
+{
+    int fd = -1;
+    int optval = 1;
+    uint64_t ioctl_arg = 1;
+
+    /* 创建socket */
+    if ((fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) < 0)
+    {
+        PRINT_LOG("create socket error");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int));
+
+    /* 设置成非阻塞后再连接, 服务器不可达时不会阻塞到系统超时 */
+    ioctl(fd, FIONBIO, &ioctl_arg);
+    if ((connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) || (errno == EINPROGRESS))
+    {
+        return fd;
+    }
+    close(fd);
+
+    return -1;
+}
+
+/**
+ * @brief 非阻塞重连时对下一个地址发起连接, 从上一次连接成功的服务器开始依次尝试所有服务器的所有解析结果
+ * 
+ * @return -1: 本轮所有地址都已尝试; 其他: 正在连接的非阻塞socket
+ */
+static int socket_connect_next(void)
+{
+    uint8_t endpoint_total = gs_endpoint_num + 1;
+    char service[8] = {0};
+    struct addrinfo hints;
+
+    while (1)
+    {
+        while (gs_reconnect_addr != NULL)
+        {
+            const struct addrinfo *rp = gs_reconnect_addr;
+            int fd = -1;
+
+            gs_reconnect_addr = rp->ai_next;
+            if ((fd = socket_connect_start(rp)) >= 0)
+            {
+                return fd;
+            }
+        }
+        if (gs_reconnect_addr_list != NULL)
+        {
+            freeaddrinfo(gs_reconnect_addr_list);
+            gs_reconnect_addr_list = NULL;
+        }
+        if (gs_reconnect_tried >= endpoint_total)
+        {
+            return -1;
+        }
 
-    /* 报文数据包: 只包含固定报头 */
-    packet[0] = MQTT_MSG_PINGREQ;
-    packet[1] = 0x00;
+        uint16_t port = 0;
+        uint8_t index = (gs_endpoint_index + gs_reconnect_tried++) % endpoint_total;
+        const char *host = socket_endpoint_get(index, &port);
 
-    /* 发送PINGREQ报文数据包给服务器, 并等待服务器的PINGRESP响应(异步通知) */
-    if (socket_send_data(g_sockfd, packet, sizeof(packet)) < 0)
-    {
-        PRINT_LOG("mqtt send PINGREQ packet error");
-        return;
+        if (host[0] == '\0')
+        {
+            continue;
+        }
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(service, sizeof(service), "%u", port);
+        if (getaddrinfo(host, service, &hints, &gs_reconnect_addr_list) != 0)
+        {
+            PRINT_LOG("getaddrinfo %s error", host);
+            gs_reconnect_addr_list = NULL;
+            continue;
+        }
+        gs_reconnect_index = index;
+        gs_reconnect_addr = gs_reconnect_addr_list;
     }
 }
 
 /**
- * @brief 异步通知回调函数
+ * @brief 获取服务器地址, 索引0为MqttParamStruct中的地址, 其余为mqtt_add_endpoint添加的备用地址
  * 
- * @param signal 
+ * @param index 地址索引
+ * @param port 端口
+ * @return 服务器域名或IP地址
  */
-static void mqtt_fasync_callback_function(int signal)
+static const char *socket_endpoint_get(uint8_t index, uint16_t *port)
 {
-    (void)signal;
-    uint16_t msg_len = 0;
-    uint8_t temp_data[MQTT_RX_BUFFER_MAX_LEN] = {0};
-    
-    memset(gs_mqtt_rx_buffer, 0, MQTT_RX_BUFFER_MAX_LEN);
-
-    if (read(g_sockfd, gs_mqtt_rx_buffer, MQTT_RX_BUFFER_MAX_LEN) < 0)
+    if (index > 0)
     {
-        PRINT_LOG("read mqtt ack eeror");
+        *port = gsst_mqtt_endpoint[index - 1].port;
+        return gsst_mqtt_endpoint[index - 1].host;
     }
-    else 
-    {
-        switch (gs_mqtt_rx_buffer[0])
-        {
-            case MQTT_MSG_CONNACK:
-                PRINT_LOG("receive mqtt CONNACK ack");
-                mqtt_receive_ack_code(MQTT_MSG_CONNACK, gs_mqtt_rx_buffer[3]);
-                break;
-
-            case MQTT_MSG_PUBACK:
-                PRINT_LOG("receive mqtt PUBACK ack");
-                break;
+    *port = gsst_mqtt_param_data.port;
 
-            case MQTT_MSG_PUBREC:
-                PRINT_LOG("receive mqtt PUBREC ack");
-                break;
+    return gsst_mqtt_param_data.ipaddr;
+}
 
-            case MQTT_MSG_SUBACK:
-                PRINT_LOG("receive mqtt SUBACK ack");
-                /* 若同时订阅多个主题, 响应码会一起返回, 目前只判断第一个主题的返回码 */
-                mqtt_receive_ack_code(MQTT_MSG_SUBACK, gs_mqtt_rx_buffer[4]);
-                break;
+/**
+ * @brief 关闭socket连接
+ * 
+ */
+static int socket_deinit(int fd)
+{
+    return close(fd);
+}
 
-            case MQTT_MSG_UNSUBACK:
-                PRINT_LOG("receive mqtt UNSUBACK ack");
-                break;
+/**
+ * @brief socket发送数据
+ * 
+ * @param fd 文件描述符
+ * @param buffer 待发送的数据缓冲区
+ * @param len 待发送的数据缓冲区的长度
+ * @return -1: 失败； 其他: 成功
+ */
+static int socket_send_data(int fd, void *buffer, uint64_t len)
+{
+    struct iovec iov;
 
-            case MQTT_MSG_PINGRESP:
-                PRINT_LOG("receive mqtt PINGRESP ack");
-                break;
+    iov.iov_base = buffer;
+    iov.iov_len = len;
 
-            default :
-                msg_len = mqtt_receive_data_parse(gs_mqtt_rx_buffer, temp_data);
-                gsst_mqtt_param_data.mqtt_callback_function(temp_data, msg_len);
-                break;
-        }
-    }
+    return socket_send_iov(fd, &iov, 1);
 }
 
 /**
- * @brief 对接收到已订阅主题的报文数据进行解析(报文非JSON数据)
+ * @brief socket分散发送数据(writev), 报文各部分无需拷贝到同一缓冲区.
+ *        先发送完发送缓冲区中的数据以保证报文顺序, socket不可写时等待可写而不是空转.
+ *        发送期间屏蔽SIGIO, 避免异步通知中回复的确认报文插入到未发送完的报文中间.
+ *        报文只发送了一部分时出错或等待超时, 之后的报文无法再对齐, 关闭网络连接
  * 
- * @param src_data 原始报文数据
- * @param msg_data 解析后的消息数据
- * @return 消息数据的长度
+ * @param fd 文件描述符
+ * @param iov 待发送的数据块
+ * @param iovcnt 数据块个数
+ * @return -1: 失败, mqtt_is_connected返回1时报文未发送任何数据; 其他: 成功
  */
-static uint16_t mqtt_receive_data_parse(uint8_t *src_data, uint8_t *msg_data)
+static int socket_send_iov(int fd, struct iovec *iov, int iovcnt)
 {
-    uint8_t digit = 0;
-    uint16_t value = 0;
-    uint16_t multiplier = 1;
-    uint16_t msg_length = 0;
-    uint8_t remain_bytes = 1;
-    uint8_t src_data_offset = 0;
-    uint8_t *temp_data = (uint8_t *)src_data;
+    ssize_t nwritten = 0;
+    uint64_t len = 0;
+    uint64_t sent = 0;
+    sigset_t old_mask;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
 
-    /* 报文类型 + 剩于长度(1-4, 可变) + 主题长度位(2) + 主题名数据 + QoS标识位(2, 可变, QoS=0时无) + 消息数据 */
+    mqtt_sigio_block(&old_mask);
+
+    if (socket_tx_flush(fd, MQTT_SEND_TIMEOUT_MS) < 0)
+    {
+        mqtt_sigio_restore(&old_mask);
+        return -1;
+    }
+    if (gs_capture_fd >= 0)
+    {
+        mqtt_capture_write(MQTT_CAPTURE_OUTBOUND, iov, iovcnt);
+    }
 
-    if ((*temp_data & 0xF0) == MQTT_MSG_PUBLISH)
+    while (iovcnt > 0)
     {
-        /* 剩于长度字节数 */
-        if ((*(temp_data + 1) & 0x80) == 0x80)
+        if ((nwritten = writev(fd, iov, iovcnt)) <= 0)
         {
-            remain_bytes++;
-            if ((*(temp_data + 2) & 0x80) == 0x80)
+            if (errno == EINTR)
+            {
+                nwritten = 0;
+            }
+            else if ((errno == EAGAIN) && (socket_wait_writable(fd, MQTT_SEND_TIMEOUT_MS) == 0))
+            {
+                nwritten = 0;
+            }
+            else
             {
-                remain_bytes++;
-                if ((*(temp_data + 3) & 0x80) == 0x80)
+                /* 还未发送任何数据的等待超时不影响连接, 其他情况下连接已不可用 */
+                PRINT_LOG("mqtt send error: %s", strerror(errno));
+                if ((sent > 0) || (errno != ETIMEDOUT))
                 {
-                    remain_bytes++;
+                    mqtt_connection_abort();
                 }
+                mqtt_sigio_restore(&old_mask);
+                return -1;
             }
         }
+        sent += nwritten;
 
-        /* 主题名长度(2字节) */
-        src_data_offset = (*(temp_data + 1 + remain_bytes)) << 8;
-        src_data_offset |= *(temp_data + 1 + remain_bytes + 1);
-
-        /* 固定报头+主题长度位(2) */
-        src_data_offset += (1 + remain_bytes + 2);
-
-        /* 判断QoS标识位 */
-        if ((*temp_data & 0x06) >> 1)
+        /* 跳过已发送完的数据块, 部分发送的数据块调整起始位置 */
+        while ((iovcnt > 0) && ((size_t)nwritten >= iov->iov_len))
         {
-            src_data_offset += 2;
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
-
-        /* 消息数据长度 = 剩于长度 - 可变报头 (偏移 - 固定报头) */
-        temp_data++;
-        do 
+        if (iovcnt > 0)
         {
-            digit = *temp_data;
-            value += (digit & 127) * multiplier;
-            multiplier *= 128;
-            temp_data++;
-        } while ((digit & 128) != 0);
-        msg_length = value - (src_data_offset - (remain_bytes + 1));
-
-        memcpy(msg_data, (src_data + src_data_offset), msg_length);
+            iov->iov_base = (uint8_t *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
     }
 
-    return msg_length;
+    mqtt_sigio_restore(&old_mask);
+
+    return len;
 }
 
 /**
- * @brief MQTT接收响应返回码
+ * @brief socket非阻塞分散发送数据, 写不完的部分追加到发送缓冲区
  * 
- * @param ack_type 响应类型
- * @param ack_code 返回码
+ * @param fd 文件描述符
+ * @param iov 待发送的数据块
+ * @param iovcnt 数据块个数
+ * @return -1: 失败; 0: 成功; MQTT_ERR_WOULDBLOCK: 待发送数据超过高水位或缓冲区放不下, 未发送任何数据
  */
-static void mqtt_receive_ack_code(uint8_t ack_type, uint8_t ack_code)
+static int socket_send_iov_nonblock(int fd, struct iovec *iov, int iovcnt)
 {
-    if (ack_type == MQTT_MSG_CONNACK)
+    ssize_t nwritten = 0;
+    uint32_t len = 0;
+    uint32_t pending = 0;
+    sigset_t old_mask;
+
+    for (int i = 0; i < iovcnt; i++)
     {
-        switch (ack_code)
-        {
-            case 0x00:
-                PRINT_LOG("The connection has been accepted by the server");
-                break;
+        len += iov[i].iov_len;
+    }
+    if (len > MQTT_TX_BUFFER_MAX_LEN)
+    {
+        PRINT_LOG("mqtt packet too large for tx buffer");
+        return -1;
+    }
 
-            case 0x01:
-                PRINT_LOG("The server does not support the MQTT protocol level requested by the client");
-                break;
+    mqtt_sigio_block(&old_mask);
 
-            case 0x02:
-                PRINT_LOG("The client identifier is the correct UTF-8 encoding, but is not allowed on the server");
-                break;
+    if (socket_tx_flush(fd, 0) < 0)
+    {
+        mqtt_sigio_restore(&old_mask);
+        return -1;
+    }
+    /* 重连后待重发的报文全部进入发送缓冲区之前, 新报文不能插到它们前面 */
+    pending = gs_tx_tail - gs_tx_head;
+    if ((pending >= gs_tx_high_watermark) || (pending + len > MQTT_TX_BUFFER_MAX_LEN) ||
+        ((int32_t)(gs_inflight_resend_end - gs_inflight_resend) > 0))
+    {
+        gs_tx_blocked = 1;
+        mqtt_sigio_restore(&old_mask);
+        return MQTT_ERR_WOULDBLOCK;
+    }
+    if (gs_capture_fd >= 0)
+    {
+        mqtt_capture_write(MQTT_CAPTURE_OUTBOUND, iov, iovcnt);
+    }
 
-            case 0x03:
-                PRINT_LOG("Network connection established, but MQTT service unavailable");
-                break;
+    /* 缓冲区为空时直接写socket, 否则为保证顺序只能追加到缓冲区 */
+    if (pending == 0)
+    {
+        nwritten = writev(fd, iov, iovcnt);
+        if (nwritten < 0)
+        {
+            if ((errno != EAGAIN) && (errno != EINTR))
+            {
+                PRINT_LOG("%s", strerror(errno));
+                gs_connected = 0;
+                mqtt_sigio_restore(&old_mask);
+                return -1;
+            }
+            nwritten = 0;
+        }
+    }
+    if ((uint32_t)nwritten == len)
+    {
+        mqtt_sigio_restore(&old_mask);
+        return 0;
+    }
 
-            case 0x04:
-                PRINT_LOG("The data format of the user name or password is invalid");
-                break;
+    socket_tx_reserve(len - nwritten);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if ((size_t)nwritten >= iov[i].iov_len)
+        {
+            nwritten -= iov[i].iov_len;
+            continue;
+        }
+        memcpy(gs_mqtt_tx_buffer + gs_tx_tail, (uint8_t *)iov[i].iov_base + nwritten, iov[i].iov_len - nwritten);
+        gs_tx_tail += iov[i].iov_len - nwritten;
+        nwritten = 0;
+    }
 
-            case 0x05:
-                PRINT_LOG("The client is not authorized to connect to this server, and check that the password and so on are correct");
-                break;
+    mqtt_sigio_restore(&old_mask);
 
-            default :
+    return 0;
+}
+
+/**
+ * @brief 发送缓冲区中的数据, 调用前需屏蔽SIGIO
+ * 
+ * @param fd 文件描述符
+ * @param timeout_ms 0: socket不可写时立即返回; 其他: 等待socket可写的超时时间
+ * @return -1: 失败; 0: 已全部发送; 1: 仍有数据待发送
+ */
+static int socket_tx_flush(int fd, int timeout_ms)
+{
+    ssize_t nwritten = 0;
+
+    mqtt_inflight_resend_fill();
+    while (gs_tx_head < gs_tx_tail)
+    {
+        nwritten = write(fd, gs_mqtt_tx_buffer + gs_tx_head, gs_tx_tail - gs_tx_head);
+        if (nwritten > 0)
+        {
+            gs_tx_head += nwritten;
+            mqtt_inflight_resend_fill();
+            continue;
+        }
+        if ((nwritten < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        if ((nwritten < 0) && (errno == EAGAIN))
+        {
+            if (timeout_ms == 0)
+            {
                 break;
+            }
+            if (socket_wait_writable(fd, timeout_ms) == 0)
+            {
+                continue;
+            }
         }
+
+        PRINT_LOG("mqtt tx flush error: %s", strerror(errno));
+        gs_connected = 0;
+        return -1;
     }
-    else if (ack_type == MQTT_MSG_SUBACK)
+
+    if (gs_tx_head == gs_tx_tail)
     {
-        switch (ack_code)
-        {
-            case 0x00:
-                PRINT_LOG("The maximum QoS 0");
-                break;
+        gs_tx_head = 0;
+        gs_tx_tail = 0;
+    }
 
-            case 0x01:
-                PRINT_LOG("The maximum QoS 1");
-                break;
+    socket_tx_writable_check();
 
-            case 0x02:
-                PRINT_LOG("The maximum QoS 2");
-                break;
+    return (gs_tx_tail > gs_tx_head) ? 1 : 0;
+}
 
-            case 0x80:
-                PRINT_LOG("mqtt SUBACK error");
-                break;
-            
-            default:
-                break;
-        }
+/**
+ * @brief 待发送数据降到低水位以下且重发已完成时, 记录需要通知之前被拒绝的发布者可以继续发送. 调用前需屏蔽SIGIO
+ * 
+ */
+static void socket_tx_writable_check(void)
+{
+    if (gs_tx_blocked && (gs_tx_tail - gs_tx_head <= gs_tx_low_watermark) &&
+        ((int32_t)(gs_inflight_resend_end - gs_inflight_resend) <= 0))
+    {
+        gs_tx_blocked = 0;
+        gs_writable_pending = 1;
     }
 }
 
 /**
- * @brief socket初始化, 连接服务器
+ * @brief 调用异步通知或mqtt_poll中记录的可写回调. 回调是应用代码, 不能在信号处理函数中执行
  * 
- * @return -1: 失败； 0: 成功 
  */
-static int socket_init(void)
+static void mqtt_writable_dispatch(void)
 {
-    int optval = 1;
+    if (gs_writable_pending == 0)
+    {
+        return;
+    }
 
-    /* 创建socket */
-    if ((g_sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    gs_writable_pending = 0;
+    if (gs_writable_callback != NULL)
     {
-        PRINT_LOG("create socket error");
-        return -1;
+        gs_writable_callback();
+    }
+}
+
+/**
+ * @brief 保证发送缓冲区尾部有len字节连续空间, 尾部空间不足时把待发送数据移到头部. 调用前需屏蔽SIGIO
+ * 
+ * @param len 需要的字节数
+ * @return NULL: 缓冲区剩余空间不足; 其他: 写入位置, 写入后由调用者增加gs_tx_tail
+ */
+static uint8_t *socket_tx_reserve(uint32_t len)
+{
+    uint32_t pending = gs_tx_tail - gs_tx_head;
+
+    if (pending + len > MQTT_TX_BUFFER_MAX_LEN)
+    {
+        return NULL;
     }
-    if (setsockopt(g_sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int)) < 0)
+    if (gs_tx_tail + len > MQTT_TX_BUFFER_MAX_LEN)
     {
-        PRINT_LOG("setsockopt error");
-        return -1;
+        memmove(gs_mqtt_tx_buffer, gs_mqtt_tx_buffer + gs_tx_head, pending);
+        gs_tx_head = 0;
+        gs_tx_tail = pending;
     }
 
-    /* 连接服务器 */
-    uint64_t ioctl_arg = 1;
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(gsst_mqtt_param_data.port);
-    server_addr.sin_addr.s_addr = inet_addr(gsst_mqtt_param_data.ipaddr);
+    return gs_mqtt_tx_buffer + gs_tx_tail;
+}
+
+/**
+ * @brief 等待socket可写
+ * 
+ * @param fd 文件描述符
+ * @param timeout_ms 超时时间
+ * @return -1: 超时或出错; 0: 可写
+ */
+static int socket_wait_writable(int fd, int timeout_ms)
+{
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int ret = 0;
+
+    do
+    {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while ((ret < 0) && (errno == EINTR));
 
-    int ret = connect(g_sockfd, (struct sockaddr*)&server_addr, sizeof(struct sockaddr));
-    if (ret < 0)
+    if (ret <= 0)
     {
-        PRINT_LOG("socket connect server error");
+        errno = (ret == 0) ? ETIMEDOUT : errno;
+        return -1;
+    }
+    if (pfd.revents & (POLLERR | POLLHUP))
+    {
+        errno = EPIPE;
         return -1;
     }
-
-    /* 设置成非阻塞 */
-    ioctl(g_sockfd, FIONBIO, &ioctl_arg);
 
     return 0;
 }
 
 /**
- * @brief 关闭socket连接
+ * @brief 屏蔽SIGIO, 只对调用线程有效. SIGIO只发给连接线程, 所以接口必须在连接线程中调用
  * 
+ * @param old_mask 保存原信号屏蔽字
  */
-static int socket_deinit(int fd)
+static void mqtt_sigio_block(sigset_t *old_mask)
 {
-    return close(fd);
+    sigset_t sigio_mask;
+
+    sigemptyset(&sigio_mask);
+    sigaddset(&sigio_mask, SIGIO);
+    pthread_sigmask(SIG_BLOCK, &sigio_mask, old_mask);
 }
 
 /**
- * @brief socket发送数据
+ * @brief 恢复信号屏蔽字
  * 
- * @param fd 文件描述符
- * @param buffer 待发送的数据缓冲区
- * @param len 待发送的数据缓冲区的长度
- * @return -1: 失败； 其他: 成功
+ * @param old_mask mqtt_sigio_block保存的原信号屏蔽字
  */
-static int socket_send_data(int fd, void *buffer, uint64_t len)
+static void mqtt_sigio_restore(sigset_t *old_mask)
+{
+    pthread_sigmask(SIG_SETMASK, old_mask, NULL);
+}
+
+/**
+ * @brief 写一条抓包记录, 记录头和报文各部分用一次writev写入. 只使用异步信号安全的函数,
+ *        可在异步通知中调用, 调用前需屏蔽SIGIO
+ * 
+ * @param direction MQTT_CAPTURE_INBOUND / MQTT_CAPTURE_OUTBOUND
+ * @param iov 报文数据块
+ * @param iovcnt 数据块个数
+ */
+static void mqtt_capture_write(uint8_t direction, const struct iovec *iov, int iovcnt)
 {
-    int nwritten = 0;
-    uint64_t nleft = len;
-    uint8_t *bufp = (uint8_t *)buffer;
+    MqttCaptureRecordStruct record;
+    struct iovec capture_iov[MQTT_CAPTURE_IOV_MAX];
+    struct timespec now;
+    ssize_t total = sizeof(record);
 
-    while (nleft > 0) 
+    if (iovcnt >= MQTT_CAPTURE_IOV_MAX)
     {
-        if ((nwritten = write(fd, bufp, nleft)) <= 0) 
-        {
-            if (errno == EINTR || errno == EAGAIN)
-            {
-                nwritten = 0;
-            }
-            else 
-            {
-                PRINT_LOG("%s", strerror(errno));
-                return -1;
-            }
-        }
-        nleft -= nwritten;
-        bufp += nwritten;
+        return;
     }
 
-    return len;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record.length = 0;
+    record.direction = direction;
+
+    capture_iov[0].iov_base = &record;
+    capture_iov[0].iov_len = sizeof(record);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        capture_iov[i + 1] = iov[i];
+        record.length += iov[i].iov_len;
+    }
+    total += record.length;
+
+    /* 写失败(如磁盘已满)时停止抓包, 不影响正常收发 */
+    if (writev(gs_capture_fd, capture_iov, iovcnt + 1) != total)
+    {
+        PRINT_LOG("write mqtt capture file error, capture stopped");
+        close(gs_capture_fd);
+        gs_capture_fd = -1;
+    }
+}
+
+/**
+ * @brief 获取单调时钟时间
+ * 
+ * @return 毫秒
+ */
+static uint64_t mqtt_now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
 }
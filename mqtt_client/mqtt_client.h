@@ -42,9 +42,19 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include "mqtt_topic.h"
+#include "mqtt_pool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /********************************** Typedef *********************************/
+/* msg_data指向接收缓冲区, msg_data[msg_len]为'\0', 只在回调期间有效 */
 typedef void (*callback_function)(uint8_t *msg_data, uint16_t msg_len);
+typedef void (*writable_callback_function)(void);
+typedef void (*ack_callback_function)(uint8_t ack_type, uint16_t packet_identifier, uint8_t ack_code);
 
 #pragma pack(1)
 typedef struct 
@@ -59,7 +69,73 @@ typedef struct
 } MqttParamStruct;
 #pragma pack()
 
+/* 预编码的PUBLISH句柄, 由mqtt_prepare_publish创建, 固定主题的高频发布无需重复编码主题 */
+typedef struct
+{
+    uint8_t fixed_header;       //报文类型 + DUP/QoS/RETAIN标志
+    uint8_t qos_size;           //报文标识符长度, QoS=0时为0
+    uint16_t topic_length;
+    uint8_t *packet;            //预留固定报头(5字节) + 主题长度位(2) + 主题名 + 报文标识符(2)
+} MqttPublishHandle;
+
+/* 解码后的报文, 主题和数据指针指向报文内部, 不拷贝 */
+typedef struct
+{
+    uint8_t fixed_header;       //报文类型 + 标志位
+    uint8_t qos;                //仅PUBLISH有效
+    uint16_t packet_identifier; //无报文标识符的报文为0
+    uint16_t topic_length;
+    uint32_t payload_length;
+    const char *topic;          //仅PUBLISH有效
+    uint8_t *payload;           //PUBLISH: 消息数据; CONNACK: 确认标志 + 返回码; SUBACK: 返回码
+} MqttPacketStruct;
+
+typedef void (*message_callback_function)(const MqttPacketStruct *packet);
+
+/* 接收流量控制: 任一项达到上限时暂停读socket, 由TCP流量控制让服务端减慢发送, 全部降到低水位以下时恢复 */
+typedef struct
+{
+    uint32_t max_messages;          //未被应用取走的消息数上限, 0: MQTT_INBOUND_SLOT_MAX
+    uint32_t max_bytes;             //未处理完成的消息(主题 + 数据)总字节数上限, 0: MQTT_INBOUND_ARENA_SIZE
+    uint32_t max_unacked;           //未确认的QoS1/2消息数上限, 0: MQTT_INBOUND_SLOT_MAX
+    uint8_t low_watermark;          //低水位, 上限的百分比, 0: MQTT_INBOUND_LOW_WATERMARK
+} MqttInboundLimitStruct;
+
+/* 由mqtt_message_get取出的消息, 主题和数据指向接收队列, mqtt_message_complete之前有效 */
+typedef struct
+{
+    const char *topic;
+    uint8_t *payload;
+    uint32_t payload_length;
+    uint32_t sequence;              //接收队列中的序号, mqtt_message_complete使用
+    uint16_t topic_length;
+    uint16_t packet_identifier;
+    uint8_t qos;
+} MqttMessageStruct;
+
+/* 抓包文件格式: 文件头 + 若干条记录, 每条记录为记录头 + 完整的MQTT报文, 字段均为主机字节序 */
+#pragma pack(1)
+typedef struct
+{
+    char magic[4];              //"MQCP"
+    uint16_t version;
+    uint16_t reserved;
+} MqttCaptureFileStruct;
+
+typedef struct
+{
+    uint64_t timestamp_ns;      //CLOCK_REALTIME时间戳
+    uint32_t length;            //报文长度
+    uint8_t direction;          //MQTT_CAPTURE_INBOUND / MQTT_CAPTURE_OUTBOUND
+} MqttCaptureRecordStruct;
+#pragma pack()
+
 /*********************************** Macro **********************************/
+/* 日志输出, 可在编译时用-DPRINT_LOG(...)=...替换为应用自己的日志函数 */
+#ifndef PRINT_LOG
+#define PRINT_LOG(...)                  (printf(__VA_ARGS__), printf("\n"))
+#endif
+
 /* QoS消息服务质量 */
 #define QOS_VALUE0                      0
 #define QOS_VALUE1                      1
@@ -94,18 +170,91 @@ typedef struct
 #define MQTT_QOS2_FLAG                  (2 << 1)
 #define MQTT_RETAIN_FLAG                1
 
-#define MQTT_RX_BUFFER_MAX_LEN          1024
+/* CONNACK连接确认标志 */
+#define MQTT_SESSION_PRESENT            0x01        //服务端保留了上次的会话状态
+
+/* 接收缓冲区: 不完整的报文在此拼接, 长度即能接收的最大报文长度(含固定报头), 收到更长的报文时关闭网络连接.
+   启用接收流量控制时不能超过MQTT_INBOUND_ARENA_SIZE */
+#define MQTT_RX_BUFFER_MAX_LEN          65536
+#define MQTT_FIXED_HEADER_MAX_LEN       5           //报文类型(1) + 剩余长度(最多4字节)
+
+/* 重连相关 */
+#define MQTT_ENDPOINT_MAX_NUM           4           //备用服务器地址最大个数(不含MqttParamStruct中的地址)
+#define MQTT_HOST_MAX_LEN               128
+#define MQTT_SUBSCRIBE_MAX_NUM          16          //重连后需要恢复的订阅最大个数
+#define MQTT_SUBSCRIBE_TOPIC_MAX_LEN    128
+#define MQTT_CONNECT_TIMEOUT_MS         3000        //TCP连接和等待CONNACK的超时时间
+#define MQTT_RECONNECT_BACKOFF_MIN_MS   100
+#define MQTT_RECONNECT_BACKOFF_MAX_MS   30000
+
+/* 持久会话下未完成的QoS1/2发布: 发送时保存报文, PUBACK/PUBCOMP后释放, 重连且服务端保留会话时按原顺序置DUP重发.
+   任一项已满时非阻塞发布返回MQTT_ERR_WOULDBLOCK, 阻塞发布返回-1 */
+#define MQTT_INFLIGHT_SLOT_MAX          1024        //最多未完成的报文数, 必须是2的幂
+#define MQTT_INFLIGHT_ARENA_SIZE        (256 * 1024)
+
+/* 发送缓冲区: 非阻塞发布时socket写不完的数据暂存于此 */
+#define MQTT_TX_BUFFER_MAX_LEN          65536
+#define MQTT_TX_HIGH_WATERMARK          49152       //待发送数据超过高水位时非阻塞发布返回MQTT_ERR_WOULDBLOCK
+#define MQTT_TX_LOW_WATERMARK           16384       //待发送数据降到低水位以下时调用可写回调
+#define MQTT_SEND_TIMEOUT_MS            10000       //阻塞发送等待socket可写的超时时间
+
+/* 接收队列: 启用接收流量控制后, 消息先拷贝到预先申请的队列中, 异步通知中不申请内存 */
+#define MQTT_INBOUND_SLOT_MAX           1024        //队列中最多的消息数, 必须是2的幂
+#define MQTT_INBOUND_ARENA_SIZE         (256 * 1024)
+#define MQTT_INBOUND_LOW_WATERMARK      50          //默认低水位, 上限的百分比
+
+/* 抓包 */
+#define MQTT_CAPTURE_MAGIC              "MQCP"
+#define MQTT_CAPTURE_VERSION            1
+#define MQTT_CAPTURE_INBOUND            0
+#define MQTT_CAPTURE_OUTBOUND           1
+#define MQTT_CAPTURE_IOV_MAX            8           //一条抓包记录最多的数据块个数(含记录头)
+
+/* 错误码 */
+#define MQTT_ERR_WOULDBLOCK             (-2)
 
 /********************************** Function ********************************/
 int mqtt_init(MqttParamStruct param_data);
 
 void mqtt_connect(void);
-int mqtt_reconnect(void);
+int mqtt_reconnect(void);                           //阻塞, 事件循环中使用mqtt_reconnect_poll
+int mqtt_reconnect_poll(int timeout_ms);
+void mqtt_set_clean_session(uint8_t clean_session);
+int mqtt_add_endpoint(const char *host, uint16_t port);
+void mqtt_set_reconnect_backoff(uint32_t min_ms, uint32_t max_ms);
+uint8_t mqtt_session_present(void);
+uint8_t mqtt_is_connected(void);
 void mqtt_disconnect(void);
-void mqtt_subscribe(char *topic, uint8_t qos);
-void mqtt_unsubscribe(char *topic);
+uint16_t mqtt_subscribe(const char *topic, uint8_t qos);
+uint16_t mqtt_subscribe_shared(const char *group, const char *filter, uint8_t qos);
+void mqtt_unsubscribe(const char *topic);
 void mqtt_pingreq(void);
 int mqtt_publish(const char *topic, const char *msg, uint16_t msg_len, uint8_t retain, uint8_t qos);
+MqttPublishHandle *mqtt_prepare_publish(const char *topic, uint8_t qos, uint8_t retain);
+int mqtt_publish_prepared(MqttPublishHandle *handle, const char *msg, uint16_t msg_len);
+void mqtt_release_publish(MqttPublishHandle *handle);
+int mqtt_publish_nonblock(const char *topic, const char *msg, uint16_t msg_len, uint8_t retain, uint8_t qos, uint16_t *packet_id);
+int mqtt_publish_prepared_nonblock(MqttPublishHandle *handle, const char *msg, uint16_t msg_len, uint16_t *packet_id);
+void mqtt_set_writable_callback(writable_callback_function callback);
+void mqtt_set_tx_watermark(uint32_t high, uint32_t low);
+uint32_t mqtt_tx_pending(void);
+void mqtt_set_fasync(uint8_t enable);
+int mqtt_fd(void);
+int mqtt_poll(int timeout_ms);
+void mqtt_set_ack_callback(ack_callback_function callback);
+void mqtt_set_message_callback(message_callback_function callback);
+int mqtt_set_inbound_limit(const MqttInboundLimitStruct *limit);
+int mqtt_message_get(MqttMessageStruct *message);
+int mqtt_message_complete(const MqttMessageStruct *message);
+uint32_t mqtt_inbound_pending(void);
+uint8_t mqtt_inbound_paused(void);
+int mqtt_capture_start(const char *path);
+void mqtt_capture_stop(void);
+int mqtt_frame_length(const uint8_t *data, uint32_t len);
+int mqtt_packet_decode(uint8_t *frame, uint32_t frame_len, MqttPacketStruct *packet);
 
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* MQTT_CLIENT_H_ */
\ No newline at end of file
@@ -0,0 +1,795 @@
+/**
+ * @file mqtt_client.hpp
+ * @version V1.0.0
+ * @date 2022-05-10
+ * @brief MQTT客户端C++20协程接口, 只有头文件. 客户端工作在事件循环模式(mqtt_set_fasync(0)),
+ *        由Client::run在一个线程中驱动, 未完成的QoS1/2发布和订阅只占用一个协程帧, 不占用线程
+ *
+ *        mqtt::Task<> session(mqtt::Client &client)
+ *        {
+ *            co_await client.connect();
+ *            co_await client.subscribe("a/b", QOS_VALUE1);                 //SUBACK后返回, 结果为返回码
+ *            co_await client.publish("x/y", "hello", QOS_VALUE1);          //PUBACK后返回, 0: 成功
+ *            while (true)
+ *            {
+ *                while (auto message = co_await client.next_message())        //连接断开后返回std::nullopt
+ *                {
+ *                    ...
+ *                    message->ack();                                       //处理完成后回复PUBACK/PUBREC
+ *                }
+ *                co_await client.reconnect();                                  //由事件循环非阻塞重连
+ *            }
+ *        }
+ *
+ *        mqtt::Client client(param);
+ *        client.init();
+ *        client.spawn(session(client));
+ *        client.run();
+ *
+ * @copyright 2018-2022 (C) Cooley Chan (https://github.com/Coooooley/mqtt)
+ *
+ * @par 版本记录
+ *
+ * 修改日期 | 版本 | 修改人 | 修改内容
+ * -|-|-|-
+ * 2022-05-10 | V1.0.0 | Cooley Chan | First edition
+ *
+ */
+
+#ifndef MQTT_CLIENT_HPP_
+#define MQTT_CLIENT_HPP_
+
+#include <coroutine>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "mqtt_client.h"
+
+namespace mqtt
+{
+
+/*********************************** Macro **********************************/
+#define MQTT_RUN_POLL_MAX_MS            1000        //事件循环单次等待的最长时间
+
+/********************************** Typedef *********************************/
+class Client;
+
+/* 收到的消息, 主题和数据从接收队列中拷贝. 消息在ack()或析构时才完成(回复PUBACK/PUBREC并释放接收队列空间),
+   处理完成前程序退出时服务端会重发QoS1/2消息. 未完成的消息计入接收队列的上限, 只能移动不能复制 */
+struct Message
+{
+    std::string topic;
+    std::string payload;
+    uint8_t qos = 0;
+    uint16_t packet_identifier = 0;
+
+    Message() = default;
+    Message(Message &&other) noexcept
+        : topic(std::move(other.topic)), payload(std::move(other.payload)), qos(other.qos),
+          packet_identifier(other.packet_identifier), inbound_(other.inbound_), pending_(std::exchange(other.pending_, false))
+    {
+    }
+    Message(const Message &) = delete;
+    Message &operator=(const Message &) = delete;
+
+    Message &operator=(Message &&other) noexcept
+    {
+        if (this != &other)
+        {
+            ack();
+            topic = std::move(other.topic);
+            payload = std::move(other.payload);
+            qos = other.qos;
+            packet_identifier = other.packet_identifier;
+            inbound_ = other.inbound_;
+            pending_ = std::exchange(other.pending_, false);
+        }
+        return *this;
+    }
+
+    ~Message() { ack(); }
+
+    /* 消息处理完成, 只有第一次调用有效. 发送缓冲区放不下确认报文时由事件循环按顺序重试 */
+    void ack();
+
+private:
+    friend class Client;
+    MqttMessageStruct inbound_ = {};
+    bool pending_ = false;                      //还未完成
+};
+
+namespace detail
+{
+
+/* 协程结束时恢复等待该协程的协程(对称转移, 不增加栈深度) */
+struct FinalAwaiter
+{
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+    {
+        std::coroutine_handle<> continuation = handle.promise().continuation;
+
+        return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+};
+
+struct PromiseBase
+{
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase
+{
+    std::optional<T> value;
+
+    template <typename U>
+    void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+
+    T result()
+    {
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+        return std::move(*value);
+    }
+};
+
+template <>
+struct Promise<void> : PromiseBase
+{
+    void return_void() {}
+
+    void result()
+    {
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+/* 被挂起的操作: 等待确认报文或发送缓冲区可写, 完成后由事件循环恢复 */
+struct Operation
+{
+    std::coroutine_handle<> handle;
+    int result = 0;
+};
+
+} // namespace detail
+
+/**
+ * @brief 协程任务, 惰性启动: 被co_await或Client::spawn时才开始执行
+ *
+ * @tparam T 返回值类型
+ */
+template <typename T = void>
+class Task
+{
+public:
+    struct promise_type : detail::Promise<T>
+    {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    Task &operator=(Task &&) = delete;
+
+    ~Task()
+    {
+        if (handle_)
+        {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+
+    T await_resume() { return handle_.promise().result(); }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail
+{
+
+/* Client::spawn启动的协程, 立即执行, 结束后自动释放 */
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+inline Detached detach(Task<> task)
+{
+    co_await std::move(task);
+}
+
+} // namespace detail
+
+/**
+ * @brief MQTT客户端. C客户端只有一个全局连接, 同一进程中只能创建一个Client
+ *
+ */
+class Client
+{
+public:
+    /* co_await client.connect(): CONNACK后返回连接返回码, -1: 连接失败 */
+    class ConnectAwaiter : private detail::Operation
+    {
+    public:
+        explicit ConnectAwaiter(Client &client) : client_(client) {}
+
+        bool await_ready()
+        {
+            mqtt_connect();
+            if (mqtt_is_connected() == 0)
+            {
+                result = -1;
+                return true;
+            }
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            handle = awaiting;
+            client_.connect_waiters_.push_back(this);
+        }
+
+        int await_resume() const noexcept { return result; }
+
+    private:
+        friend class Client;
+        Client &client_;
+    };
+
+    /* co_await client.publish(): QoS0发送后返回, QoS1在PUBACK后返回, QoS2在PUBCOMP后返回. 0: 成功; -1: 失败 */
+    class PublishAwaiter : private detail::Operation
+    {
+    public:
+        PublishAwaiter(Client &client, std::string topic, std::string_view payload, uint8_t qos, uint8_t retain)
+            : client_(client), topic_(std::move(topic)), payload_(payload), qos_(qos), retain_(retain)
+        {
+        }
+
+        bool await_ready() { return send(); }
+
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            handle = awaiting;
+            wait();
+        }
+
+        int await_resume() const noexcept { return result; }
+
+    private:
+        friend class Client;
+
+        /* 发送报文, 返回true表示操作已完成(QoS0已发送或出错) */
+        bool send()
+        {
+            int ret = mqtt_publish_nonblock(topic_.c_str(), payload_.data(), (uint16_t)payload_.size(),
+                                            retain_, qos_, &packet_identifier_);
+
+            blocked_ = (ret == MQTT_ERR_WOULDBLOCK);
+            if (blocked_)
+            {
+                return false;
+            }
+            result = (ret < 0) ? -1 : 0;
+            return (ret < 0) || (qos_ == QOS_VALUE0);
+        }
+
+        /* 发送缓冲区已满时等待可写, 否则等待确认报文 */
+        void wait()
+        {
+            if (blocked_)
+            {
+                client_.writable_waiters_.push_back(this);
+            }
+            else
+            {
+                client_.publish_pending_[packet_identifier_] = this;
+            }
+        }
+
+        Client &client_;
+        std::string topic_;
+        std::string_view payload_;                  //co_await完成前必须有效
+        uint8_t qos_;
+        uint8_t retain_;
+        uint8_t blocked_ = 0;
+        uint16_t packet_identifier_ = 0;
+    };
+
+    /* co_await client.subscribe(): SUBACK后返回SUBACK返回码(0-2: 最大QoS; 0x80: 失败), -1: 发送失败 */
+    class SubscribeAwaiter : private detail::Operation
+    {
+    public:
+        SubscribeAwaiter(Client &client, std::string filter, uint8_t qos)
+            : client_(client), filter_(std::move(filter)), qos_(qos)
+        {
+        }
+
+        bool await_ready()
+        {
+            packet_identifier_ = mqtt_subscribe(filter_.c_str(), qos_);
+            if (packet_identifier_ == 0)
+            {
+                result = -1;
+                return true;
+            }
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            handle = awaiting;
+            client_.subscribe_pending_[packet_identifier_] = this;
+        }
+
+        int await_resume() const noexcept { return result; }
+
+    private:
+        friend class Client;
+        Client &client_;
+        std::string filter_;
+        uint8_t qos_;
+        uint16_t packet_identifier_ = 0;
+    };
+
+    /* co_await client.reconnect(): 断线后由事件循环非阻塞重连, 成功后返回0, stop()时返回-1 */
+    class ReconnectAwaiter : private detail::Operation
+    {
+    public:
+        explicit ReconnectAwaiter(Client &client) : client_(client) {}
+
+        bool await_ready() const noexcept { return mqtt_is_connected() != 0; }
+
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            handle = awaiting;
+            client_.reconnect_waiters_.push_back(this);
+        }
+
+        int await_resume() const noexcept { return result; }
+
+    private:
+        friend class Client;
+        Client &client_;
+    };
+
+    /* co_await client.next_message(): 有消息时返回消息, 连接断开或stop后返回std::nullopt.
+       取出的消息在Message::ack()或析构时才完成, 取走但未完成的消息和未取走的消息一起受接收队列的上限限制 */
+    class MessageAwaiter
+    {
+    public:
+        explicit MessageAwaiter(Client &client) : client_(client) {}
+
+        bool await_ready() { return client_.take_message(message_) || client_.closed_; }
+
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            handle_ = awaiting;
+            client_.message_waiters_.push_back(this);
+        }
+
+        std::optional<Message> await_resume() { return std::move(message_); }
+
+    private:
+        friend class Client;
+        Client &client_;
+        std::coroutine_handle<> handle_;
+        std::optional<Message> message_;
+    };
+
+    explicit Client(const MqttParamStruct &param) : param_(param)
+    {
+        instance_ = this;
+        param_.mqtt_callback_function = nullptr;
+    }
+
+    Client(const Client &) = delete;
+    Client &operator=(const Client &) = delete;
+
+    ~Client()
+    {
+        mqtt_set_ack_callback(nullptr);
+        mqtt_set_writable_callback(nullptr);
+        instance_ = nullptr;
+    }
+
+    /**
+     * @brief 初始化并建立TCP连接, 使用事件循环模式. 收到的消息进入接收队列, 达到上限时暂停读socket
+     *
+     * @param limit 接收队列上限, nullptr时使用默认上限
+     * @return 0: 成功; -1: 失败
+     */
+    int init(const MqttInboundLimitStruct *limit = nullptr)
+    {
+        MqttInboundLimitStruct default_limit = {};
+
+        mqtt_set_fasync(0);
+        mqtt_set_ack_callback(&Client::ack_trampoline);
+        mqtt_set_writable_callback(&Client::writable_trampoline);
+        closed_ = false;
+        if (mqtt_set_inbound_limit((limit != nullptr) ? limit : &default_limit) < 0)
+        {
+            return -1;
+        }
+
+        return mqtt_init(param_);
+    }
+
+    ConnectAwaiter connect() { return ConnectAwaiter(*this); }
+
+    ReconnectAwaiter reconnect() { return ReconnectAwaiter(*this); }
+
+    PublishAwaiter publish(std::string topic, std::string_view payload, uint8_t qos, uint8_t retain = 0)
+    {
+        return PublishAwaiter(*this, std::move(topic), payload, qos, retain);
+    }
+
+    SubscribeAwaiter subscribe(std::string filter, uint8_t qos) { return SubscribeAwaiter(*this, std::move(filter), qos); }
+
+    MessageAwaiter next_message() { return MessageAwaiter(*this); }
+
+    /**
+     * @brief 启动一个协程, 运行到第一次挂起时返回, 协程结束后自动释放. 协程中的异常需自行处理
+     *
+     * @param task 协程任务
+     */
+    void spawn(Task<> task) { detail::detach(std::move(task)); }
+
+    /**
+     * @brief 事件循环: 处理socket收发, 恢复已完成的操作, 按keep_alive发送PINGREQ.
+     *        连接断开时未完成的操作以-1返回, 有协程等待重连时继续循环, 每次循环推进一步非阻塞重连
+     *
+     * @return 0: stop()退出; -1: 连接断开且没有协程等待重连
+     */
+    int run()
+    {
+        running_ = true;
+        last_ping_ = std::chrono::steady_clock::now();
+
+        while (running_)
+        {
+            resume_ready();
+            if (!running_)
+            {
+                break;
+            }
+
+            if (!reconnect_waiters_.empty())
+            {
+                if (mqtt_reconnect_poll(ready_.empty() ? MQTT_RUN_POLL_MAX_MS : 0) == 0)
+                {
+                    reconnected();
+                }
+                continue;
+            }
+
+            if (mqtt_poll(ready_.empty() ? poll_timeout() : 0) < 0)
+            {
+                fail_all();
+                resume_ready();
+                if (reconnect_waiters_.empty())
+                {
+                    running_ = false;
+                    return -1;
+                }
+                continue;
+            }
+            deliver_messages();
+            keep_alive();
+        }
+
+        return 0;
+    }
+
+    /**
+     * @brief 退出事件循环, 等待消息的协程以std::nullopt返回, 等待重连的协程以-1返回
+     *
+     */
+    void stop()
+    {
+        running_ = false;
+        closed_ = true;
+        for (ReconnectAwaiter *waiter : reconnect_waiters_)
+        {
+            complete(waiter, -1);
+        }
+        reconnect_waiters_.clear();
+        wake_message_waiters();
+        resume_ready();
+    }
+
+    size_t pending() const noexcept
+    {
+        return publish_pending_.size() + subscribe_pending_.size() + writable_waiters_.size() + reconnect_waiters_.size();
+    }
+
+private:
+    static void ack_trampoline(uint8_t ack_type, uint16_t packet_identifier, uint8_t ack_code)
+    {
+        if (instance_ != nullptr)
+        {
+            instance_->on_ack(ack_type, packet_identifier, ack_code);
+        }
+    }
+
+    static void writable_trampoline(void)
+    {
+        if (instance_ != nullptr)
+        {
+            instance_->on_writable();
+        }
+    }
+
+    /* 回调在mqtt_poll中调用, 只记录要恢复的协程, 由事件循环在mqtt_poll返回后恢复 */
+    void complete(detail::Operation *operation, int result)
+    {
+        operation->result = result;
+        ready_.push_back(operation->handle);
+    }
+
+    void on_ack(uint8_t ack_type, uint16_t packet_identifier, uint8_t ack_code)
+    {
+        std::unordered_map<uint16_t, detail::Operation *> *pending = &publish_pending_;
+
+        switch (ack_type)
+        {
+            case MQTT_MSG_CONNACK:
+                for (ConnectAwaiter *waiter : connect_waiters_)
+                {
+                    complete(waiter, ack_code);
+                }
+                connect_waiters_.clear();
+                return;
+
+            case MQTT_MSG_PUBACK:
+            case MQTT_MSG_PUBCOMP:
+                break;
+
+            case MQTT_MSG_SUBACK:
+                pending = &subscribe_pending_;
+                break;
+
+            default :
+                return;
+        }
+
+        auto it = pending->find(packet_identifier);
+        if (it != pending->end())
+        {
+            complete(it->second, (ack_type == MQTT_MSG_SUBACK) ? ack_code : 0);
+            pending->erase(it);
+        }
+    }
+
+    /* 从接收队列中取出一条消息并拷贝, 由Message::ack()完成 */
+    bool take_message(std::optional<Message> &message)
+    {
+        MqttMessageStruct inbound;
+
+        if (mqtt_message_get(&inbound) < 0)
+        {
+            return false;
+        }
+        message.emplace();
+        message->topic.assign(inbound.topic, inbound.topic_length);
+        message->payload.assign((const char *)inbound.payload, inbound.payload_length);
+        message->qos = inbound.qos;
+        message->packet_identifier = inbound.packet_identifier;
+        message->inbound_ = inbound;
+        message->pending_ = true;
+        return true;
+    }
+
+    /* 完成一条消息, 发送缓冲区放不下确认报文时稍后按顺序重试 */
+    void complete_message(const MqttMessageStruct &inbound)
+    {
+        if (!incomplete_.empty() || (mqtt_message_complete(&inbound) == MQTT_ERR_WOULDBLOCK))
+        {
+            incomplete_.push_back(inbound);
+        }
+    }
+
+    void complete_messages()
+    {
+        while (!incomplete_.empty() && (mqtt_message_complete(&incomplete_.front()) != MQTT_ERR_WOULDBLOCK))
+        {
+            incomplete_.pop_front();
+        }
+    }
+
+    /* mqtt_poll后按等待顺序把接收队列中的消息交给等待的协程 */
+    void deliver_messages()
+    {
+        complete_messages();
+        while (!message_waiters_.empty() && take_message(message_waiters_.front()->message_))
+        {
+            ready_.push_back(message_waiters_.front()->handle_);
+            message_waiters_.pop_front();
+        }
+    }
+
+    /* 重连成功, 恢复等待重连的协程. 重连时已处理的消息交给等待的协程 */
+    void reconnected()
+    {
+        closed_ = false;
+        last_ping_ = std::chrono::steady_clock::now();
+        for (ReconnectAwaiter *waiter : reconnect_waiters_)
+        {
+            complete(waiter, 0);
+        }
+        reconnect_waiters_.clear();
+        deliver_messages();
+    }
+
+    /* 发送缓冲区降到低水位以下, 按顺序重试被阻塞的发布 */
+    void on_writable()
+    {
+        std::vector<PublishAwaiter *> waiters;
+
+        complete_messages();
+        waiters.swap(writable_waiters_);
+        for (size_t i = 0; i < waiters.size(); i++)
+        {
+            if (waiters[i]->send())
+            {
+                complete(waiters[i], waiters[i]->result);
+            }
+            else if (waiters[i]->blocked_)
+            {
+                /* 再次被阻塞, 剩下的也放回去, 保持顺序 */
+                writable_waiters_.insert(writable_waiters_.end(), waiters.begin() + i, waiters.end());
+                return;
+            }
+            else
+            {
+                waiters[i]->wait();
+            }
+        }
+    }
+
+    void wake_message_waiters()
+    {
+        while (!message_waiters_.empty())
+        {
+            ready_.push_back(message_waiters_.front()->handle_);
+            message_waiters_.pop_front();
+        }
+    }
+
+    /* 连接断开, 未完成的操作都以-1返回 */
+    void fail_all()
+    {
+        for (auto &item : publish_pending_)
+        {
+            complete(item.second, -1);
+        }
+        for (auto &item : subscribe_pending_)
+        {
+            complete(item.second, -1);
+        }
+        for (PublishAwaiter *waiter : writable_waiters_)
+        {
+            complete(waiter, -1);
+        }
+        for (ConnectAwaiter *waiter : connect_waiters_)
+        {
+            complete(waiter, -1);
+        }
+        publish_pending_.clear();
+        subscribe_pending_.clear();
+        writable_waiters_.clear();
+        connect_waiters_.clear();
+        closed_ = true;
+        wake_message_waiters();
+    }
+
+    /* 被恢复的协程可能发起新的操作并立即完成, 直到没有可恢复的协程为止 */
+    void resume_ready()
+    {
+        while (!ready_.empty())
+        {
+            std::coroutine_handle<> handle = ready_.front();
+            ready_.pop_front();
+            handle.resume();
+        }
+    }
+
+    int poll_timeout() const
+    {
+        if (param_.keep_alive == 0)
+        {
+            return MQTT_RUN_POLL_MAX_MS;
+        }
+
+        auto interval = std::chrono::milliseconds(param_.keep_alive * 1000 / 2);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_ping_);
+        auto remain = (elapsed < interval) ? (interval - elapsed).count() : 0;
+
+        return (remain < MQTT_RUN_POLL_MAX_MS) ? (int)remain : MQTT_RUN_POLL_MAX_MS;
+    }
+
+    /* 每隔keep_alive的一半发送一次PINGREQ */
+    void keep_alive()
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        if ((param_.keep_alive != 0) && (now - last_ping_ >= std::chrono::milliseconds(param_.keep_alive * 1000 / 2)))
+        {
+            mqtt_pingreq();
+            last_ping_ = now;
+        }
+    }
+
+    friend struct Message;
+
+    inline static Client *instance_ = nullptr;
+
+    MqttParamStruct param_;
+    bool running_ = false;
+    bool closed_ = false;
+    std::chrono::steady_clock::time_point last_ping_;
+    std::deque<std::coroutine_handle<>> ready_;
+    std::unordered_map<uint16_t, detail::Operation *> publish_pending_;
+    std::unordered_map<uint16_t, detail::Operation *> subscribe_pending_;
+    std::vector<PublishAwaiter *> writable_waiters_;
+    std::vector<ConnectAwaiter *> connect_waiters_;
+    std::vector<ReconnectAwaiter *> reconnect_waiters_;
+    std::deque<MessageAwaiter *> message_waiters_;
+    std::deque<MqttMessageStruct> incomplete_;      //已完成但确认报文未能发送的消息
+};
+
+inline void Message::ack()
+{
+    if (pending_)
+    {
+        pending_ = false;
+        if (Client::instance_ != nullptr)
+        {
+            Client::instance_->complete_message(inbound_);
+        }
+    }
+}
+
+} // namespace mqtt
+
+#endif /* MQTT_CLIENT_HPP_ */
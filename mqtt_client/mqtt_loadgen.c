@@ -0,0 +1,1407 @@
+/**
+ * @file mqtt_loadgen.c
+ * @version V1.0.0
+ * @date 2022-05-10
+ * @brief MQTT压力测试工具: 一个进程在少量epoll线程上模拟大量轻量客户端会话, 按设定速率建立连接,
+ *        按客户端类别的配置订阅和发布, 输出连接速率、消息速率和端到端时延分位数.
+ *        只允许连接本机回环地址上的服务端
+ *
+ *        用法: mqtt_loadgen [-h host] [-p port] [-c clients] [-r rate] [-t threads] [-d seconds]
+ *                           [-k keep_alive] [-f profile] [-b source_base] [-n source_num]
+ *        -c: 客户端总数, 默认1000
+ *        -r: 每秒建立的连接数, 默认1000
+ *        -t: epoll线程数, 默认1
+ *        -k: 保活时间(秒), 默认0不保活, 大于0时每个会话每隔保活时间发送一次PINGREQ
+ *        -d: 从开始建立连接起的测试时长(秒), 默认30
+ *        -f: 客户端类别配置文件, 默认所有客户端订阅并发布自己的主题
+ *        -b/-n: 依次绑定source_base开始的n个源地址(如127.0.0.1开始的127.0.0.x),
+ *               每个源地址的临时端口约2.8万个, 超过时需要多个源地址
+ *
+ *        配置文件每行一个客户端类别, '#'开头为注释, 主题中的{id}替换为客户端序号:
+ *        名称 权重 订阅主题 订阅QoS 发布主题 发布QoS 发布间隔(ms) 消息长度
+ *        sensor  9  -              0  lg/{id}/up  0  1000  64
+ *        monitor 1  lg/+/up        0  -           0  0     0
+ *        订阅/发布主题为'-'表示不订阅/不发布, 消息前8字节为发送时间, 用于计算时延
+ *
+ * @copyright 2018-2022 (C) Cooley Chan (https://github.com/Coooooley/mqtt)
+ *
+ * @par 版本记录
+ *
+ * 修改日期 | 版本 | 修改人 | 修改内容
+ * -|-|-|-
+ * 2022-05-10 | V1.0.0 | Cooley Chan | First edition
+ *
+ */
+
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include "mqtt_client.h"
+
+/*********************************** Macro **********************************/
+#define LOADGEN_CLASS_MAX_NUM           16
+#define LOADGEN_TOPIC_MAX_LEN           128
+#define LOADGEN_TOPIC_EXPAND_LEN        (LOADGEN_TOPIC_MAX_LEN * 3)  //{id}(4字节)最多替换为10位数字
+#define LOADGEN_PAYLOAD_MAX_LEN         2048
+#define LOADGEN_PAYLOAD_MIN_LEN         8           //发送时间戳
+#define LOADGEN_RX_BUFFER_LEN           4096
+#define LOADGEN_TX_BUFFER_LEN           4096
+#define LOADGEN_SOURCE_MAX_NUM          64
+#define LOADGEN_THREAD_MAX_NUM          64
+#define LOADGEN_EPOLL_EVENT_NUM         256
+#define LOADGEN_LOOP_MAX_MS             10          //epoll_wait最长等待时间, 保证建立连接的节奏
+#define LOADGEN_HIST_SUB_BITS           4           //时延直方图: 每个2的幂区间再分16个桶, 误差约6%
+#define LOADGEN_HIST_BUCKET_NUM         (64 << LOADGEN_HIST_SUB_BITS)
+
+/* 会话状态 */
+#define LOADGEN_STATE_IDLE              0
+#define LOADGEN_STATE_CONNECTING        1           //TCP连接中
+#define LOADGEN_STATE_CONNACK_WAIT      2
+#define LOADGEN_STATE_SUBACK_WAIT       3
+#define LOADGEN_STATE_RUNNING           4
+#define LOADGEN_STATE_CLOSED            5
+
+/* 定时器类型 */
+#define LOADGEN_TIMER_PUBLISH           0
+#define LOADGEN_TIMER_PING              1
+
+/********************************** Typedef *********************************/
+typedef struct
+{
+    char name[32];
+    uint32_t weight;
+    char subscribe_topic[LOADGEN_TOPIC_MAX_LEN];    //空字符串表示不订阅
+    uint8_t subscribe_qos;
+    char publish_topic[LOADGEN_TOPIC_MAX_LEN];      //空字符串表示不发布
+    uint8_t publish_qos;
+    uint32_t publish_interval_ms;
+    uint32_t payload_length;
+} LoadgenClassStruct;
+
+typedef struct
+{
+    int fd;
+    uint32_t id;                                    //全局客户端序号
+    uint8_t state;
+    uint8_t class_index;
+    uint16_t packet_identifier;
+    uint32_t rx_length;
+    uint32_t tx_length;
+    uint64_t connect_ns;
+    uint8_t *rx_buffer;
+    uint8_t *tx_buffer;
+} LoadgenSessionStruct;
+
+typedef struct
+{
+    uint64_t deadline_ns;
+    uint32_t session_index;
+    uint8_t type;
+} LoadgenTimerStruct;
+
+/* 统计: 由所属线程更新, 报告线程按relaxed原子读取 */
+typedef struct
+{
+    uint64_t connect_started;
+    uint64_t connected;
+    uint64_t connect_failed;
+    uint64_t closed;
+    uint64_t published;
+    uint64_t puback;
+    uint64_t received;
+    uint64_t tx_dropped;
+    uint64_t pingreq;
+    uint64_t pingresp;
+    uint64_t last_connected_ns;                     //最后一个连接建立的时间, 用于计算建立连接的速率
+    uint64_t latency_hist[LOADGEN_HIST_BUCKET_NUM];
+    uint64_t connect_hist[LOADGEN_HIST_BUCKET_NUM];
+} LoadgenStatsStruct;
+
+typedef struct
+{
+    pthread_t thread;
+    uint32_t thread_index;
+    int epoll_fd;
+    uint32_t session_num;
+    uint32_t session_started;
+    LoadgenSessionStruct *sessions;
+    LoadgenTimerStruct *timers;                     //按到期时间排序的最小堆
+    uint32_t timer_num;
+    uint32_t random_state;
+    LoadgenStatsStruct stats;
+} LoadgenThreadStruct;
+
+/****************************** Global Variable *****************************/
+static struct sockaddr_storage gsst_server_addr;
+static socklen_t gs_server_addr_len = 0;
+static struct in_addr gsst_source_addr[LOADGEN_SOURCE_MAX_NUM];
+static uint32_t gs_source_num = 0;
+static LoadgenClassStruct gsst_class[LOADGEN_CLASS_MAX_NUM];
+static uint32_t gs_class_num = 0;
+static uint32_t gs_class_weight_total = 0;
+static uint32_t gs_client_num = 1000;
+static uint32_t gs_connect_rate = 1000;
+static uint32_t gs_thread_num = 1;
+static uint32_t gs_duration_s = 30;
+static uint16_t gs_keep_alive = 0;
+static uint64_t gs_start_ns = 0;
+static volatile uint8_t gs_running = 1;
+static LoadgenThreadStruct *gsst_thread = NULL;
+
+/********************************** Function ********************************/
+static uint64_t loadgen_now_ns(void);
+static int loadgen_server_resolve(const char *host, uint16_t port);
+static int loadgen_profile_load(const char *path);
+static void loadgen_class_default(void);
+static uint8_t loadgen_class_select(uint32_t id);
+static uint32_t loadgen_topic_expand(char *buffer, const char *format, uint32_t id);
+static void *loadgen_thread_function(void *arg);
+static void loadgen_session_start(LoadgenThreadStruct *loop, uint32_t session_index);
+static void loadgen_session_event(LoadgenThreadStruct *loop, uint32_t session_index, uint32_t events);
+static void loadgen_session_receive(LoadgenThreadStruct *loop, LoadgenSessionStruct *session);
+static void loadgen_session_frame(LoadgenThreadStruct *loop, LoadgenSessionStruct *session, uint8_t *frame, uint32_t frame_len);
+static void loadgen_session_publish(LoadgenThreadStruct *loop, uint32_t session_index);
+static void loadgen_session_ping(LoadgenThreadStruct *loop, uint32_t session_index);
+static int loadgen_session_send(LoadgenThreadStruct *loop, LoadgenSessionStruct *session, const uint8_t *data, uint32_t len);
+static void loadgen_session_close(LoadgenThreadStruct *loop, LoadgenSessionStruct *session);
+static void loadgen_connect_send(LoadgenThreadStruct *loop, LoadgenSessionStruct *session);
+static void loadgen_subscribe_send(LoadgenThreadStruct *loop, LoadgenSessionStruct *session);
+static void loadgen_timer_push(LoadgenThreadStruct *loop, uint64_t deadline_ns, uint32_t session_index, uint8_t type);
+static void loadgen_timer_pop(LoadgenThreadStruct *loop);
+static void loadgen_hist_record(uint64_t *hist, uint64_t value);
+static uint64_t loadgen_hist_percentile(const uint64_t *hist, double percentile);
+static uint64_t loadgen_stat_sum(size_t field_offset);
+static void loadgen_stat_add(uint64_t *field, uint64_t value);
+static void loadgen_report(uint8_t final);
+
+
+/**
+ * @brief main function
+ *
+ * @return 0: 成功; 1: 失败
+ */
+int main(int argc, char *argv[])
+{
+    int opt = 0;
+    const char *host = "127.0.0.1";
+    const char *profile = NULL;
+    const char *source_base = NULL;
+    uint16_t port = 1883;
+    struct rlimit file_limit;
+
+    while ((opt = getopt(argc, argv, "h:p:c:r:t:d:k:f:b:n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'h':
+                host = optarg;
+                break;
+
+            case 'p':
+                port = (uint16_t)strtoul(optarg, NULL, 10);
+                break;
+
+            case 'c':
+                gs_client_num = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':
+                gs_connect_rate = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            case 't':
+                gs_thread_num = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            case 'd':
+                gs_duration_s = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            case 'k':
+                gs_keep_alive = (uint16_t)strtoul(optarg, NULL, 10);
+                break;
+
+            case 'f':
+                profile = optarg;
+                break;
+
+            case 'b':
+                source_base = optarg;
+                break;
+
+            case 'n':
+                gs_source_num = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+
+            default :
+                fprintf(stderr, "usage: %s [-h host] [-p port] [-c clients] [-r rate] [-t threads] [-d seconds] "
+                        "[-k keep_alive] [-f profile] [-b source_base] [-n source_num]\n", argv[0]);
+                return 1;
+        }
+    }
+    if ((gs_client_num == 0) || (gs_connect_rate == 0) || (gs_thread_num == 0) || (gs_thread_num > LOADGEN_THREAD_MAX_NUM))
+    {
+        fprintf(stderr, "invalid clients, rate or threads\n");
+        return 1;
+    }
+
+    if (loadgen_server_resolve(host, port) < 0)
+    {
+        return 1;
+    }
+    if (source_base != NULL)
+    {
+        struct in_addr base;
+
+        gs_source_num = (gs_source_num == 0) ? 1 : gs_source_num;
+        if ((gs_source_num > LOADGEN_SOURCE_MAX_NUM) || (inet_pton(AF_INET, source_base, &base) != 1) ||
+            (gsst_server_addr.ss_family != AF_INET))
+        {
+            fprintf(stderr, "invalid source address %s\n", source_base);
+            return 1;
+        }
+        for (uint32_t i = 0; i < gs_source_num; i++)
+        {
+            gsst_source_addr[i].s_addr = htonl(ntohl(base.s_addr) + i);
+        }
+    }
+    else
+    {
+        gs_source_num = 0;
+    }
+
+    if (profile != NULL)
+    {
+        if (loadgen_profile_load(profile) < 0)
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        loadgen_class_default();
+    }
+
+    /* 每个连接一个文件描述符 */
+    if (getrlimit(RLIMIT_NOFILE, &file_limit) == 0)
+    {
+        file_limit.rlim_cur = file_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &file_limit);
+        if (file_limit.rlim_cur < gs_client_num + 64)
+        {
+            fprintf(stderr, "warning: open file limit %lu is lower than clients %u\n",
+                    (unsigned long)file_limit.rlim_cur, gs_client_num);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    gsst_thread = (LoadgenThreadStruct *)calloc(gs_thread_num, sizeof(LoadgenThreadStruct));
+    if (gsst_thread == NULL)
+    {
+        return 1;
+    }
+    gs_start_ns = loadgen_now_ns();
+    for (uint32_t i = 0; i < gs_thread_num; i++)
+    {
+        LoadgenThreadStruct *loop = &gsst_thread[i];
+
+        /* 客户端i由线程i % 线程数负责 */
+        loop->thread_index = i;
+        loop->session_num = gs_client_num / gs_thread_num + ((i < gs_client_num % gs_thread_num) ? 1 : 0);
+        loop->sessions = (LoadgenSessionStruct *)calloc(loop->session_num, sizeof(LoadgenSessionStruct));
+        loop->timers = (LoadgenTimerStruct *)calloc(loop->session_num * 2 + 1, sizeof(LoadgenTimerStruct));
+        loop->random_state = 0x9E3779B9u * (i + 1);
+        loop->epoll_fd = epoll_create1(0);
+        if ((loop->sessions == NULL) || (loop->timers == NULL) || (loop->epoll_fd < 0))
+        {
+            fprintf(stderr, "thread %u init error\n", i);
+            return 1;
+        }
+        for (uint32_t j = 0; j < loop->session_num; j++)
+        {
+            loop->sessions[j].fd = -1;
+            loop->sessions[j].id = j * gs_thread_num + i;
+        }
+        if (pthread_create(&loop->thread, NULL, loadgen_thread_function, loop) != 0)
+        {
+            fprintf(stderr, "create thread %u error\n", i);
+            return 1;
+        }
+    }
+
+    printf("mqtt loadgen: %u clients, %u connects/s, %u threads, %u s, %u classes, %u source addresses\n",
+           gs_client_num, gs_connect_rate, gs_thread_num, gs_duration_s, gs_class_num, gs_source_num);
+    for (uint32_t second = 0; second < gs_duration_s; second++)
+    {
+        sleep(1);
+        loadgen_report(0);
+    }
+    gs_running = 0;
+    for (uint32_t i = 0; i < gs_thread_num; i++)
+    {
+        pthread_join(gsst_thread[i].thread, NULL);
+    }
+    loadgen_report(1);
+
+    return 0;
+}
+
+/**
+ * @brief 获取单调时钟时间
+ *
+ * @return 纳秒
+ */
+static uint64_t loadgen_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief 解析服务端地址, 只允许回环地址
+ *
+ * @param host 服务端地址
+ * @param port 端口
+ * @return -1: 失败; 0: 成功
+ */
+static int loadgen_server_resolve(const char *host, uint16_t port)
+{
+    char service[8] = {0};
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    uint8_t loopback = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if ((getaddrinfo(host, service, &hints, &result) != 0) || (result == NULL))
+    {
+        fprintf(stderr, "getaddrinfo %s error\n", host);
+        return -1;
+    }
+
+    if (result->ai_family == AF_INET)
+    {
+        loopback = (ntohl(((struct sockaddr_in *)result->ai_addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    else if (result->ai_family == AF_INET6)
+    {
+        loopback = IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6 *)result->ai_addr)->sin6_addr);
+    }
+    if (loopback == 0)
+    {
+        fprintf(stderr, "%s is not a loopback address, mqtt loadgen only runs against a local broker\n", host);
+        freeaddrinfo(result);
+        return -1;
+    }
+
+    memcpy(&gsst_server_addr, result->ai_addr, result->ai_addrlen);
+    gs_server_addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    return 0;
+}
+
+/**
+ * @brief 读取客户端类别配置文件
+ *
+ * @param path 配置文件路径
+ * @return -1: 失败; 0: 成功
+ */
+static int loadgen_profile_load(const char *path)
+{
+    char line[512];
+    uint32_t line_num = 0;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "open profile %s error: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        LoadgenClassStruct *class_data = &gsst_class[gs_class_num];
+        char subscribe_topic[LOADGEN_TOPIC_MAX_LEN] = {0};
+        char publish_topic[LOADGEN_TOPIC_MAX_LEN] = {0};
+        unsigned int subscribe_qos = 0;
+        unsigned int publish_qos = 0;
+        char *start = line;
+
+        line_num++;
+        while ((*start == ' ') || (*start == '\t'))
+        {
+            start++;
+        }
+        if ((*start == '#') || (*start == '\n') || (*start == '\r') || (*start == '\0'))
+        {
+            continue;
+        }
+        if (gs_class_num >= LOADGEN_CLASS_MAX_NUM)
+        {
+            fprintf(stderr, "%s:%u: too many classes\n", path, line_num);
+            fclose(file);
+            return -1;
+        }
+
+        memset(class_data, 0, sizeof(LoadgenClassStruct));
+        if ((sscanf(start, "%31s %u %127s %u %127s %u %u %u", class_data->name, &class_data->weight,
+                    subscribe_topic, &subscribe_qos, publish_topic, &publish_qos,
+                    &class_data->publish_interval_ms, &class_data->payload_length) != 8) ||
+            (class_data->weight == 0) || (subscribe_qos > QOS_VALUE1) || (publish_qos > QOS_VALUE1) ||
+            (class_data->payload_length > LOADGEN_PAYLOAD_MAX_LEN))
+        {
+            /* 只支持QoS0/1, QoS2的四次握手不影响容量评估 */
+            fprintf(stderr, "%s:%u: invalid class, expect: name weight sub_topic sub_qos(0-1) pub_topic pub_qos(0-1) "
+                    "interval_ms payload_len(<=%u)\n", path, line_num, LOADGEN_PAYLOAD_MAX_LEN);
+            fclose(file);
+            return -1;
+        }
+        if (strcmp(subscribe_topic, "-") != 0)
+        {
+            memcpy(class_data->subscribe_topic, subscribe_topic, sizeof(subscribe_topic));
+        }
+        if (strcmp(publish_topic, "-") != 0)
+        {
+            memcpy(class_data->publish_topic, publish_topic, sizeof(publish_topic));
+        }
+        class_data->subscribe_qos = subscribe_qos;
+        class_data->publish_qos = publish_qos;
+        if (class_data->payload_length < LOADGEN_PAYLOAD_MIN_LEN)
+        {
+            class_data->payload_length = LOADGEN_PAYLOAD_MIN_LEN;
+        }
+
+        gs_class_weight_total += class_data->weight;
+        gs_class_num++;
+    }
+    fclose(file);
+
+    if (gs_class_num == 0)
+    {
+        fprintf(stderr, "%s: no client class\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 默认客户端类别: 订阅自己的主题, 每秒向该主题发布一条64字节的消息, 经过服务端回到自己
+ *
+ */
+static void loadgen_class_default(void)
+{
+    LoadgenClassStruct *class_data = &gsst_class[0];
+
+    memset(class_data, 0, sizeof(LoadgenClassStruct));
+    snprintf(class_data->name, sizeof(class_data->name), "default");
+    snprintf(class_data->subscribe_topic, sizeof(class_data->subscribe_topic), "lg/{id}/echo");
+    snprintf(class_data->publish_topic, sizeof(class_data->publish_topic), "lg/{id}/echo");
+    class_data->weight = 1;
+    class_data->publish_interval_ms = 1000;
+    class_data->payload_length = 64;
+    gs_class_weight_total = 1;
+    gs_class_num = 1;
+}
+
+/**
+ * @brief 按权重为客户端选择类别, 同一序号总是同一类别
+ *
+ * @param id 客户端序号
+ * @return 类别索引
+ */
+static uint8_t loadgen_class_select(uint32_t id)
+{
+    uint32_t value = id % gs_class_weight_total;
+
+    for (uint8_t i = 0; i < gs_class_num; i++)
+    {
+        if (value < gsst_class[i].weight)
+        {
+            return i;
+        }
+        value -= gsst_class[i].weight;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 把主题中的{id}替换为客户端序号
+ *
+ * @param buffer 输出缓冲区, 至少LOADGEN_TOPIC_EXPAND_LEN字节
+ * @param format 主题模板
+ * @param id 客户端序号
+ * @return 主题长度
+ */
+static uint32_t loadgen_topic_expand(char *buffer, const char *format, uint32_t id)
+{
+    uint32_t length = 0;
+
+    while (*format != '\0')
+    {
+        if (strncmp(format, "{id}", 4) == 0)
+        {
+            length += sprintf(buffer + length, "%u", id);
+            format += 4;
+        }
+        else
+        {
+            buffer[length++] = *format++;
+        }
+    }
+    buffer[length] = '\0';
+
+    return length;
+}
+
+/**
+ * @brief epoll线程: 按速率建立连接, 处理socket事件和发布定时器
+ *
+ * @param arg LoadgenThreadStruct
+ * @return NULL
+ */
+static void *loadgen_thread_function(void *arg)
+{
+    LoadgenThreadStruct *loop = (LoadgenThreadStruct *)arg;
+    struct epoll_event events[LOADGEN_EPOLL_EVENT_NUM];
+    double rate = (double)gs_connect_rate / gs_thread_num;
+    uint64_t now = 0;
+    int timeout_ms = 0;
+    int event_num = 0;
+
+    while (gs_running)
+    {
+        now = loadgen_now_ns();
+
+        /* 建立连接: 到目前为止应建立的连接数 = 已过时间 * 每个线程的速率 */
+        uint64_t target = (uint64_t)((now - gs_start_ns) / 1e9 * rate) + 1;
+        while ((loop->session_started < loop->session_num) && (loop->session_started < target))
+        {
+            loadgen_session_start(loop, loop->session_started);
+            loop->session_started++;
+        }
+
+        /* 到期的发布和保活定时器 */
+        while ((loop->timer_num > 0) && (loop->timers[0].deadline_ns <= now))
+        {
+            uint32_t session_index = loop->timers[0].session_index;
+            uint8_t type = loop->timers[0].type;
+
+            loadgen_timer_pop(loop);
+            if (type == LOADGEN_TIMER_PING)
+            {
+                loadgen_session_ping(loop, session_index);
+            }
+            else
+            {
+                loadgen_session_publish(loop, session_index);
+            }
+        }
+
+        timeout_ms = LOADGEN_LOOP_MAX_MS;
+        if ((loop->timer_num > 0) && (loop->timers[0].deadline_ns < now + LOADGEN_LOOP_MAX_MS * 1000000ULL))
+        {
+            timeout_ms = (int)((loop->timers[0].deadline_ns - now) / 1000000ULL);
+        }
+
+        event_num = epoll_wait(loop->epoll_fd, events, LOADGEN_EPOLL_EVENT_NUM, timeout_ms);
+        for (int i = 0; i < event_num; i++)
+        {
+            loadgen_session_event(loop, events[i].data.u32, events[i].events);
+        }
+    }
+
+    for (uint32_t i = 0; i < loop->session_num; i++)
+    {
+        if (loop->sessions[i].fd >= 0)
+        {
+            loadgen_session_close(loop, &loop->sessions[i]);
+        }
+    }
+    close(loop->epoll_fd);
+
+    return NULL;
+}
+
+/**
+ * @brief 开始一个会话: 非阻塞连接服务端, 配置了源地址时依次绑定
+ *
+ * @param loop 所属线程
+ * @param session_index 会话在线程中的索引
+ */
+static void loadgen_session_start(LoadgenThreadStruct *loop, uint32_t session_index)
+{
+    LoadgenSessionStruct *session = &loop->sessions[session_index];
+    struct epoll_event event;
+    int optval = 1;
+
+    session->class_index = loadgen_class_select(session->id);
+    session->connect_ns = loadgen_now_ns();
+    loadgen_stat_add(&loop->stats.connect_started, 1);
+
+    session->fd = socket(gsst_server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (session->fd < 0)
+    {
+        loadgen_stat_add(&loop->stats.connect_failed, 1);
+        session->state = LOADGEN_STATE_CLOSED;
+        return;
+    }
+    setsockopt(session->fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    if (gs_source_num > 0)
+    {
+        struct sockaddr_in source;
+
+        /* 绑定时不分配端口, connect时再按四元组分配, 每个源地址都能使用全部临时端口 */
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        setsockopt(session->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &optval, sizeof(optval));
+#endif
+        memset(&source, 0, sizeof(source));
+        source.sin_family = AF_INET;
+        source.sin_addr = gsst_source_addr[session->id % gs_source_num];
+        if (bind(session->fd, (struct sockaddr *)&source, sizeof(source)) < 0)
+        {
+            loadgen_stat_add(&loop->stats.connect_failed, 1);
+            loadgen_session_close(loop, session);
+            return;
+        }
+    }
+
+    if ((connect(session->fd, (struct sockaddr *)&gsst_server_addr, gs_server_addr_len) < 0) && (errno != EINPROGRESS))
+    {
+        loadgen_stat_add(&loop->stats.connect_failed, 1);
+        loadgen_session_close(loop, session);
+        return;
+    }
+
+    session->state = LOADGEN_STATE_CONNECTING;
+    event.events = EPOLLOUT;
+    event.data.u32 = session_index;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, session->fd, &event);
+}
+
+/**
+ * @brief 处理会话的socket事件
+ *
+ * @param loop 所属线程
+ * @param session_index 会话在线程中的索引
+ * @param events epoll事件
+ */
+static void loadgen_session_event(LoadgenThreadStruct *loop, uint32_t session_index, uint32_t events)
+{
+    LoadgenSessionStruct *session = &loop->sessions[session_index];
+    struct epoll_event event;
+    ssize_t nwritten = 0;
+
+    if (session->fd < 0)
+    {
+        return;
+    }
+
+    if (session->state == LOADGEN_STATE_CONNECTING)
+    {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+
+        if ((getsockopt(session->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0) || (error != 0))
+        {
+            loadgen_stat_add(&loop->stats.connect_failed, 1);
+            loadgen_session_close(loop, session);
+            return;
+        }
+
+        /* 收发缓冲区从缓冲区池中申请, 使用线程本地缓存 */
+        session->rx_buffer = (uint8_t *)mqtt_pool_alloc(LOADGEN_RX_BUFFER_LEN);
+        session->tx_buffer = (uint8_t *)mqtt_pool_alloc(LOADGEN_TX_BUFFER_LEN);
+        if ((session->rx_buffer == NULL) || (session->tx_buffer == NULL))
+        {
+            loadgen_stat_add(&loop->stats.connect_failed, 1);
+            loadgen_session_close(loop, session);
+            return;
+        }
+
+        event.events = EPOLLIN;
+        event.data.u32 = session_index;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+        session->state = LOADGEN_STATE_CONNACK_WAIT;
+        loadgen_connect_send(loop, session);
+        return;
+    }
+
+    if ((events & EPOLLOUT) && (session->tx_length > 0))
+    {
+        nwritten = write(session->fd, session->tx_buffer, session->tx_length);
+        if ((nwritten < 0) && (errno != EAGAIN))
+        {
+            loadgen_session_close(loop, session);
+            return;
+        }
+        if (nwritten > 0)
+        {
+            memmove(session->tx_buffer, session->tx_buffer + nwritten, session->tx_length - nwritten);
+            session->tx_length -= nwritten;
+        }
+        if (session->tx_length == 0)
+        {
+            event.events = EPOLLIN;
+            event.data.u32 = session_index;
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    {
+        loadgen_session_receive(loop, session);
+    }
+}
+
+/**
+ * @brief 读取会话socket中的数据, 按剩余长度切分报文
+ *
+ * @param loop 所属线程
+ * @param session 会话
+ */
+static void loadgen_session_receive(LoadgenThreadStruct *loop, LoadgenSessionStruct *session)
+{
+    ssize_t nread = 0;
+    uint32_t offset = 0;
+    int frame_len = 0;
+
+    while (session->fd >= 0)
+    {
+        nread = read(session->fd, session->rx_buffer + session->rx_length, LOADGEN_RX_BUFFER_LEN - session->rx_length);
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN)
+            {
+                loadgen_session_close(loop, session);
+            }
+            return;
+        }
+        if (nread == 0)
+        {
+            loadgen_session_close(loop, session);
+            return;
+        }
+        session->rx_length += nread;
+
+        offset = 0;
+        while ((session->fd >= 0) && (offset < session->rx_length))
+        {
+            frame_len = mqtt_frame_length(session->rx_buffer + offset, session->rx_length - offset);
+            if ((frame_len < 0) || (frame_len > LOADGEN_RX_BUFFER_LEN))
+            {
+                loadgen_session_close(loop, session);
+                return;
+            }
+            if ((frame_len == 0) || ((uint32_t)frame_len > session->rx_length - offset))
+            {
+                break;
+            }
+            loadgen_session_frame(loop, session, session->rx_buffer + offset, frame_len);
+            offset += frame_len;
+        }
+        if (session->fd < 0)
+        {
+            return;
+        }
+        if (offset > 0)
+        {
+            memmove(session->rx_buffer, session->rx_buffer + offset, session->rx_length - offset);
+            session->rx_length -= offset;
+        }
+    }
+}
+
+/**
+ * @brief 处理会话收到的一个报文, 推进会话状态
+ *
+ * @param loop 所属线程
+ * @param session 会话
+ * @param frame 报文
+ * @param frame_len 报文长度
+ */
+static void loadgen_session_frame(LoadgenThreadStruct *loop, LoadgenSessionStruct *session, uint8_t *frame, uint32_t frame_len)
+{
+    LoadgenClassStruct *class_data = &gsst_class[session->class_index];
+    uint32_t session_index = session - loop->sessions;
+    MqttPacketStruct packet;
+    uint64_t now = 0;
+    uint64_t sent_ns = 0;
+    uint8_t ack[4] = {0};
+
+    if (mqtt_packet_decode(frame, frame_len, &packet) < 0)
+    {
+        loadgen_session_close(loop, session);
+        return;
+    }
+
+    switch (packet.fixed_header & 0xF0)
+    {
+        case MQTT_MSG_CONNACK:
+            if ((session->state != LOADGEN_STATE_CONNACK_WAIT) || (packet.payload[1] != 0x00))
+            {
+                loadgen_stat_add(&loop->stats.connect_failed, 1);
+                loadgen_session_close(loop, session);
+                return;
+            }
+            loadgen_stat_add(&loop->stats.connected, 1);
+            __atomic_store_n(&loop->stats.last_connected_ns, loadgen_now_ns(), __ATOMIC_RELAXED);
+            loadgen_hist_record(loop->stats.connect_hist, loadgen_now_ns() - session->connect_ns);
+
+            if (class_data->subscribe_topic[0] != '\0')
+            {
+                session->state = LOADGEN_STATE_SUBACK_WAIT;
+                loadgen_subscribe_send(loop, session);
+                break;
+            }
+            /* fall through */
+
+        case MQTT_MSG_SUBACK:
+            if ((session->state != LOADGEN_STATE_CONNACK_WAIT) && (session->state != LOADGEN_STATE_SUBACK_WAIT))
+            {
+                break;
+            }
+            session->state = LOADGEN_STATE_RUNNING;
+
+            /* 第一次发布在一个发布间隔内随机分布, 避免所有客户端同时发布 */
+            if ((class_data->publish_topic[0] != '\0') && (class_data->publish_interval_ms > 0))
+            {
+                loop->random_state = loop->random_state * 1103515245u + 12345u;
+                loadgen_timer_push(loop, loadgen_now_ns() + (uint64_t)(loop->random_state >> 8) %
+                                   (class_data->publish_interval_ms * 1000000ULL), session_index, LOADGEN_TIMER_PUBLISH);
+            }
+
+            /* 保活: 第一次PINGREQ同样在一个保活周期内随机分布 */
+            if (gs_keep_alive > 0)
+            {
+                loop->random_state = loop->random_state * 1103515245u + 12345u;
+                loadgen_timer_push(loop, loadgen_now_ns() + (uint64_t)(loop->random_state >> 8) %
+                                   (gs_keep_alive * 1000000000ULL), session_index, LOADGEN_TIMER_PING);
+            }
+            break;
+
+        case MQTT_MSG_PUBLISH:
+            now = loadgen_now_ns();
+            loadgen_stat_add(&loop->stats.received, 1);
+            if (packet.payload_length >= LOADGEN_PAYLOAD_MIN_LEN)
+            {
+                memcpy(&sent_ns, packet.payload, sizeof(sent_ns));
+                if ((sent_ns >= gs_start_ns) && (sent_ns <= now))
+                {
+                    loadgen_hist_record(loop->stats.latency_hist, now - sent_ns);
+                }
+            }
+            if (packet.qos == QOS_VALUE1)
+            {
+                ack[0] = MQTT_MSG_PUBACK;
+                ack[1] = 0x02;
+                ack[2] = (uint8_t)(packet.packet_identifier >> 8);
+                ack[3] = (uint8_t)(packet.packet_identifier & 0xFF);
+                loadgen_session_send(loop, session, ack, sizeof(ack));
+            }
+            break;
+
+        case MQTT_MSG_PUBACK:
+            loadgen_stat_add(&loop->stats.puback, 1);
+            break;
+
+        case MQTT_MSG_PINGRESP:
+            loadgen_stat_add(&loop->stats.pingresp, 1);
+            break;
+
+        default :
+            break;
+    }
+}
+
+/**
+ * @brief 发布定时器到期: 发布一条消息并设置下一次发布
+ *
+ * @param loop 所属线程
+ * @param session_index 会话在线程中的索引
+ */
+static void loadgen_session_publish(LoadgenThreadStruct *loop, uint32_t session_index)
+{
+    LoadgenSessionStruct *session = &loop->sessions[session_index];
+    LoadgenClassStruct *class_data = &gsst_class[session->class_index];
+    uint8_t packet[MQTT_FIXED_HEADER_MAX_LEN + 2 + LOADGEN_TOPIC_EXPAND_LEN + 2 + LOADGEN_PAYLOAD_MAX_LEN];
+    char topic[LOADGEN_TOPIC_EXPAND_LEN];
+    uint32_t topic_length = 0;
+    uint32_t remain_length = 0;
+    uint32_t offset = 0;
+    uint64_t now = 0;
+
+    if (session->state != LOADGEN_STATE_RUNNING)
+    {
+        return;
+    }
+
+    topic_length = loadgen_topic_expand(topic, class_data->publish_topic, session->id);
+    remain_length = 2 + topic_length + ((class_data->publish_qos > 0) ? 2 : 0) + class_data->payload_length;
+
+    /* 固定报头 */
+    packet[offset++] = MQTT_MSG_PUBLISH | (class_data->publish_qos << 1);
+    do
+    {
+        packet[offset] = remain_length % 128;
+        remain_length /= 128;
+        if (remain_length > 0)
+        {
+            packet[offset] |= 0x80;
+        }
+        offset++;
+    } while (remain_length > 0);
+
+    /* 可变报头 */
+    packet[offset++] = (uint8_t)(topic_length >> 8);
+    packet[offset++] = (uint8_t)(topic_length & 0xFF);
+    memcpy(packet + offset, topic, topic_length);
+    offset += topic_length;
+    if (class_data->publish_qos > 0)
+    {
+        session->packet_identifier = (session->packet_identifier == 0xFFFF) ? 1 : session->packet_identifier + 1;
+        packet[offset++] = (uint8_t)(session->packet_identifier >> 8);
+        packet[offset++] = (uint8_t)(session->packet_identifier & 0xFF);
+    }
+
+    /* 有效载荷: 发送时间 + 填充 */
+    now = loadgen_now_ns();
+    memcpy(packet + offset, &now, sizeof(now));
+    memset(packet + offset + sizeof(now), 'x', class_data->payload_length - sizeof(now));
+    offset += class_data->payload_length;
+
+    if (loadgen_session_send(loop, session, packet, offset) == 0)
+    {
+        loadgen_stat_add(&loop->stats.published, 1);
+    }
+    if (session->fd >= 0)
+    {
+        loadgen_timer_push(loop, now + class_data->publish_interval_ms * 1000000ULL, session_index, LOADGEN_TIMER_PUBLISH);
+    }
+}
+
+/**
+ * @brief 保活定时器到期: 发送PINGREQ并设置下一次保活
+ *
+ * @param loop 所属线程
+ * @param session_index 会话在线程中的索引
+ */
+static void loadgen_session_ping(LoadgenThreadStruct *loop, uint32_t session_index)
+{
+    LoadgenSessionStruct *session = &loop->sessions[session_index];
+    const uint8_t packet[2] = {MQTT_MSG_PINGREQ, 0x00};
+
+    if (session->state != LOADGEN_STATE_RUNNING)
+    {
+        return;
+    }
+
+    if (loadgen_session_send(loop, session, packet, sizeof(packet)) == 0)
+    {
+        loadgen_stat_add(&loop->stats.pingreq, 1);
+    }
+    if (session->fd >= 0)
+    {
+        loadgen_timer_push(loop, loadgen_now_ns() + gs_keep_alive * 1000000000ULL, session_index, LOADGEN_TIMER_PING);
+    }
+}
+
+/**
+ * @brief 会话发送数据, socket写不完的部分放入会话的发送缓冲区, 缓冲区放不下时丢弃整个报文
+ *
+ * @param loop 所属线程
+ * @param session 会话
+ * @param data 数据
+ * @param len 数据长度
+ * @return -1: 丢弃或连接已关闭; 0: 成功
+ */
+static int loadgen_session_send(LoadgenThreadStruct *loop, LoadgenSessionStruct *session, const uint8_t *data, uint32_t len)
+{
+    struct epoll_event event;
+    ssize_t nwritten = 0;
+
+    if (session->tx_length > 0)
+    {
+        if (session->tx_length + len > LOADGEN_TX_BUFFER_LEN)
+        {
+            loadgen_stat_add(&loop->stats.tx_dropped, 1);
+            return -1;
+        }
+        memcpy(session->tx_buffer + session->tx_length, data, len);
+        session->tx_length += len;
+        return 0;
+    }
+
+    nwritten = write(session->fd, data, len);
+    if (nwritten < 0)
+    {
+        if (errno != EAGAIN)
+        {
+            loadgen_session_close(loop, session);
+            return -1;
+        }
+        nwritten = 0;
+    }
+    if ((uint32_t)nwritten == len)
+    {
+        return 0;
+    }
+
+    memcpy(session->tx_buffer, data + nwritten, len - nwritten);
+    session->tx_length = len - nwritten;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.u32 = session - loop->sessions;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+
+    return 0;
+}
+
+/**
+ * @brief 关闭会话, 不重连
+ *
+ * @param loop 所属线程
+ * @param session 会话
+ */
+static void loadgen_session_close(LoadgenThreadStruct *loop, LoadgenSessionStruct *session)
+{
+    if (session->fd >= 0)
+    {
+        close(session->fd);
+        session->fd = -1;
+    }
+    /* 测试结束时主动关闭的连接不计入 */
+    if (gs_running && ((session->state == LOADGEN_STATE_SUBACK_WAIT) || (session->state == LOADGEN_STATE_RUNNING)))
+    {
+        loadgen_stat_add(&loop->stats.closed, 1);
+    }
+    session->state = LOADGEN_STATE_CLOSED;
+    if (session->rx_buffer != NULL)
+    {
+        mqtt_pool_free(session->rx_buffer);
+        session->rx_buffer = NULL;
+    }
+    if (session->tx_buffer != NULL)
+    {
+        mqtt_pool_free(session->tx_buffer);
+        session->tx_buffer = NULL;
+    }
+    session->rx_length = 0;
+    session->tx_length = 0;
+}
+
+/**
+ * @brief 发送CONNECT报文, 客户端标识符为lg-<序号>, 清理会话
+ *
+ * @param loop 所属线程
+ * @param session 会话
+ */
+static void loadgen_connect_send(LoadgenThreadStruct *loop, LoadgenSessionStruct *session)
+{
+    uint8_t packet[64];
+    char client_id[24];
+    uint32_t client_id_length = snprintf(client_id, sizeof(client_id), "lg-%u", session->id);
+    uint32_t offset = 0;
+
+    /* 固定报头 + 可变报头(协议名 + 协议级别 + 连接标志 + 保持连接) + 客户端标识符 */
+    packet[offset++] = MQTT_MSG_CONNECT;
+    packet[offset++] = 10 + 2 + client_id_length;
+    packet[offset++] = 0x00;
+    packet[offset++] = 0x04;
+    memcpy(packet + offset, "MQTT", 4);
+    offset += 4;
+    packet[offset++] = 0x04;
+    packet[offset++] = MQTT_CLEAN_SESSION;
+    packet[offset++] = (uint8_t)(gs_keep_alive >> 8);
+    packet[offset++] = (uint8_t)(gs_keep_alive & 0xFF);
+    packet[offset++] = (uint8_t)(client_id_length >> 8);
+    packet[offset++] = (uint8_t)(client_id_length & 0xFF);
+    memcpy(packet + offset, client_id, client_id_length);
+    offset += client_id_length;
+
+    loadgen_session_send(loop, session, packet, offset);
+}
+
+/**
+ * @brief 发送SUBSCRIBE报文
+ *
+ * @param loop 所属线程
+ * @param session 会话
+ */
+static void loadgen_subscribe_send(LoadgenThreadStruct *loop, LoadgenSessionStruct *session)
+{
+    LoadgenClassStruct *class_data = &gsst_class[session->class_index];
+    uint8_t packet[MQTT_FIXED_HEADER_MAX_LEN + 2 + 2 + LOADGEN_TOPIC_EXPAND_LEN + 1];
+    char topic[LOADGEN_TOPIC_EXPAND_LEN];
+    uint32_t topic_length = loadgen_topic_expand(topic, class_data->subscribe_topic, session->id);
+    uint32_t remain_length = 2 + 2 + topic_length + 1;
+    uint32_t offset = 0;
+
+    packet[offset++] = MQTT_MSG_SUBSCRIBE;
+    if (remain_length > 127)
+    {
+        packet[offset++] = (uint8_t)((remain_length % 128) | 0x80);
+        packet[offset++] = (uint8_t)(remain_length / 128);
+    }
+    else
+    {
+        packet[offset++] = (uint8_t)remain_length;
+    }
+    packet[offset++] = 0x00;
+    packet[offset++] = 0x01;
+    packet[offset++] = (uint8_t)(topic_length >> 8);
+    packet[offset++] = (uint8_t)(topic_length & 0xFF);
+    memcpy(packet + offset, topic, topic_length);
+    offset += topic_length;
+    packet[offset++] = class_data->subscribe_qos;
+
+    loadgen_session_send(loop, session, packet, offset);
+}
+
+/**
+ * @brief 添加定时器
+ *
+ * @param loop 所属线程
+ * @param deadline_ns 到期时间
+ * @param session_index 会话在线程中的索引
+ * @param type 定时器类型: LOADGEN_TIMER_PUBLISH或LOADGEN_TIMER_PING
+ */
+static void loadgen_timer_push(LoadgenThreadStruct *loop, uint64_t deadline_ns, uint32_t session_index, uint8_t type)
+{
+    uint32_t child = loop->timer_num++;
+
+    /* 每个会话最多一个发布定时器和一个保活定时器, 堆的大小不超过会话数的2倍 */
+    while (child > 0)
+    {
+        uint32_t parent = (child - 1) / 2;
+
+        if (loop->timers[parent].deadline_ns <= deadline_ns)
+        {
+            break;
+        }
+        loop->timers[child] = loop->timers[parent];
+        child = parent;
+    }
+    loop->timers[child].deadline_ns = deadline_ns;
+    loop->timers[child].session_index = session_index;
+    loop->timers[child].type = type;
+}
+
+/**
+ * @brief 删除最早到期的定时器
+ *
+ * @param loop 所属线程
+ */
+static void loadgen_timer_pop(LoadgenThreadStruct *loop)
+{
+    LoadgenTimerStruct last = loop->timers[--loop->timer_num];
+    uint32_t parent = 0;
+
+    while (1)
+    {
+        uint32_t child = parent * 2 + 1;
+
+        if (child >= loop->timer_num)
+        {
+            break;
+        }
+        if ((child + 1 < loop->timer_num) && (loop->timers[child + 1].deadline_ns < loop->timers[child].deadline_ns))
+        {
+            child++;
+        }
+        if (last.deadline_ns <= loop->timers[child].deadline_ns)
+        {
+            break;
+        }
+        loop->timers[parent] = loop->timers[child];
+        parent = child;
+    }
+    loop->timers[parent] = last;
+}
+
+/**
+ * @brief 记录一个时延到对数直方图
+ *
+ * @param hist 直方图
+ * @param value 纳秒
+ */
+static void loadgen_hist_record(uint64_t *hist, uint64_t value)
+{
+    uint32_t index = 0;
+
+    /* 小于16的值各占一个桶, 其余按最高位所在的2的幂区间分组, 每组16个桶 */
+    if (value < (1 << LOADGEN_HIST_SUB_BITS))
+    {
+        index = value;
+    }
+    else
+    {
+        uint32_t exponent = 63 - __builtin_clzll(value);
+
+        index = ((exponent - LOADGEN_HIST_SUB_BITS + 1) << LOADGEN_HIST_SUB_BITS) |
+                ((value >> (exponent - LOADGEN_HIST_SUB_BITS)) & ((1 << LOADGEN_HIST_SUB_BITS) - 1));
+    }
+    loadgen_stat_add(&hist[index], 1);
+}
+
+/**
+ * @brief 计算直方图的百分位数
+ *
+ * @param hist 直方图
+ * @param percentile 百分位(0-1)
+ * @return 所在桶的上限(纳秒), 直方图为空时返回0
+ */
+static uint64_t loadgen_hist_percentile(const uint64_t *hist, double percentile)
+{
+    uint64_t total = 0;
+    uint64_t count = 0;
+    uint64_t target = 0;
+
+    for (uint32_t i = 0; i < LOADGEN_HIST_BUCKET_NUM; i++)
+    {
+        total += hist[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    target = (uint64_t)(total * percentile);
+    target = (target >= total) ? (total - 1) : target;
+
+    for (uint32_t i = 0; i < LOADGEN_HIST_BUCKET_NUM; i++)
+    {
+        count += hist[i];
+        if (count > target)
+        {
+            uint32_t group = i >> LOADGEN_HIST_SUB_BITS;
+            uint64_t sub = i & ((1 << LOADGEN_HIST_SUB_BITS) - 1);
+
+            if (group == 0)
+            {
+                return sub;
+            }
+            return ((1ULL << LOADGEN_HIST_SUB_BITS) + sub + 1) << (group - 1);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 统计所有线程的某一项计数
+ *
+ * @param field_offset 计数在LoadgenStatsStruct中的偏移
+ * @return 总数
+ */
+static uint64_t loadgen_stat_sum(size_t field_offset)
+{
+    uint64_t total = 0;
+
+    for (uint32_t i = 0; i < gs_thread_num; i++)
+    {
+        total += __atomic_load_n((uint64_t *)((uint8_t *)&gsst_thread[i].stats + field_offset), __ATOMIC_RELAXED);
+    }
+
+    return total;
+}
+
+/**
+ * @brief 增加计数, 只由所属线程调用
+ *
+ * @param field 计数
+ * @param value 增加的值
+ */
+static void loadgen_stat_add(uint64_t *field, uint64_t value)
+{
+    __atomic_store_n(field, *field + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 输出统计: 每秒输出一次增量速率, 结束时输出总数和时延分位数
+ *
+ * @param final 1: 结束时的报告
+ */
+static void loadgen_report(uint8_t final)
+{
+    static uint64_t last_connected = 0;
+    static uint64_t last_published = 0;
+    static uint64_t last_received = 0;
+    static uint64_t last_ns = 0;
+    uint64_t now = loadgen_now_ns();
+    uint64_t connected = loadgen_stat_sum(offsetof(LoadgenStatsStruct, connected));
+    uint64_t published = loadgen_stat_sum(offsetof(LoadgenStatsStruct, published));
+    uint64_t received = loadgen_stat_sum(offsetof(LoadgenStatsStruct, received));
+    uint64_t failed = loadgen_stat_sum(offsetof(LoadgenStatsStruct, connect_failed));
+    uint64_t closed = loadgen_stat_sum(offsetof(LoadgenStatsStruct, closed));
+    double interval_s = (now - ((last_ns == 0) ? gs_start_ns : last_ns)) / 1e9;
+
+    if (final == 0)
+    {
+        printf("[%6.1fs] connected %" PRIu64 " (+%.0f/s) failed %" PRIu64 " closed %" PRIu64 " | publish %.0f/s receive %.0f/s\n",
+               (now - gs_start_ns) / 1e9, connected - closed, (connected - last_connected) / interval_s, failed, closed,
+               (published - last_published) / interval_s, (received - last_received) / interval_s);
+        fflush(stdout);
+        last_connected = connected;
+        last_published = published;
+        last_received = received;
+        last_ns = now;
+        return;
+    }
+
+    /* 线程已退出, 合并直方图 */
+    uint64_t *latency_hist = (uint64_t *)calloc(2 * LOADGEN_HIST_BUCKET_NUM, sizeof(uint64_t));
+    uint64_t *connect_hist = latency_hist + LOADGEN_HIST_BUCKET_NUM;
+    double elapsed_s = (now - gs_start_ns) / 1e9;
+    uint64_t last_connected_ns = gs_start_ns + 1;
+
+    if (latency_hist == NULL)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < gs_thread_num; i++)
+    {
+        if (gsst_thread[i].stats.last_connected_ns > last_connected_ns)
+        {
+            last_connected_ns = gsst_thread[i].stats.last_connected_ns;
+        }
+        for (uint32_t j = 0; j < LOADGEN_HIST_BUCKET_NUM; j++)
+        {
+            latency_hist[j] += gsst_thread[i].stats.latency_hist[j];
+            connect_hist[j] += gsst_thread[i].stats.connect_hist[j];
+        }
+    }
+
+    printf("---- mqtt loadgen summary (%.1f s) ----\n", elapsed_s);
+    printf("connect      : started %" PRIu64 ", connected %" PRIu64 ", failed %" PRIu64 ", closed by peer %" PRIu64 ", rate %.0f/s\n",
+           loadgen_stat_sum(offsetof(LoadgenStatsStruct, connect_started)), connected, failed, closed,
+           connected / ((last_connected_ns - gs_start_ns) / 1e9));
+    printf("connect time : p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms\n",
+           loadgen_hist_percentile(connect_hist, 0.50) / 1e6, loadgen_hist_percentile(connect_hist, 0.99) / 1e6,
+           loadgen_hist_percentile(connect_hist, 0.999) / 1e6);
+    printf("messages     : published %" PRIu64 " (puback %" PRIu64 ", dropped %" PRIu64 "), received %" PRIu64 ", avg publish %.0f/s receive %.0f/s\n",
+           published, loadgen_stat_sum(offsetof(LoadgenStatsStruct, puback)),
+           loadgen_stat_sum(offsetof(LoadgenStatsStruct, tx_dropped)), received, published / elapsed_s, received / elapsed_s);
+    if (gs_keep_alive > 0)
+    {
+        printf("keep alive   : pingreq %" PRIu64 ", pingresp %" PRIu64 "\n",
+               loadgen_stat_sum(offsetof(LoadgenStatsStruct, pingreq)), loadgen_stat_sum(offsetof(LoadgenStatsStruct, pingresp)));
+    }
+    printf("latency      : p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+           loadgen_hist_percentile(latency_hist, 0.50) / 1e6, loadgen_hist_percentile(latency_hist, 0.90) / 1e6,
+           loadgen_hist_percentile(latency_hist, 0.99) / 1e6, loadgen_hist_percentile(latency_hist, 0.999) / 1e6,
+           loadgen_hist_percentile(latency_hist, 1.0) / 1e6);
+
+    free(latency_hist);
+}
@@ -0,0 +1,428 @@
+/**
+ * @file mqtt_pool.c
+ * @version V1.0.0
+ * @date 2022-05-10
+ * @brief MQTT报文缓冲区池: 按大小分级, 每个线程有本地缓存, 缓存不足时从全局slab中分配,
+ *        slab可选使用大页内存. 分配的内存不清零
+ *
+ * @copyright 2018-2022 (C) Cooley Chan (https://github.com/Coooooley/mqtt)
+ *
+ * @par 版本记录
+ *
+ * 修改日期 | 版本 | 修改人 | 修改内容
+ * -|-|-|-
+ * 2022-05-10 | V1.0.0 | Cooley Chan | First edition
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "mqtt_pool.h"
+
+/********************************** Typedef *********************************/
+/* 每个块前的头部, 保持16字节对齐 */
+typedef struct
+{
+    uint32_t class_index;
+    uint32_t magic;
+    uint64_t reserved;
+} PoolBlockHeadStruct;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    void *free_list;                                //空闲块链表, 块的数据区前8字节保存下一个块
+} PoolClassStruct;
+
+typedef struct PoolCacheStruct
+{
+    void *block[MQTT_POOL_CLASS_NUM][MQTT_POOL_CACHE_MAX];
+    uint16_t count[MQTT_POOL_CLASS_NUM];
+    uint8_t registered;                             //是否已注册线程退出时的回收函数
+    /* 统计计数只由本线程写入, 不使用原子加, 读取时汇总所有线程 */
+    uint64_t cache_hit;
+    uint64_t alloc_count[MQTT_POOL_CLASS_NUM];
+    uint64_t free_count[MQTT_POOL_CLASS_NUM];
+    struct PoolCacheStruct *prev;
+    struct PoolCacheStruct *next;
+} PoolCacheStruct;
+
+/*********************************** Macro **********************************/
+#define POOL_BLOCK_MAGIC                0x4D515450  //"MQTP", 已分配
+#define POOL_BLOCK_FREE                 0x4D515446  //"MQTF", 空闲
+#define POOL_CLASS_LARGE                0xFF
+#define POOL_BATCH_NUM                  (MQTT_POOL_CACHE_MAX / 2)
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB                     0
+#endif
+
+/****************************** Global Variable *****************************/
+static const uint32_t gs_pool_class_size[MQTT_POOL_CLASS_NUM] =
+{
+    64, 128, 256, 512, 1024, 4096, 16384, 65536
+};
+static PoolClassStruct gsst_pool_class[MQTT_POOL_CLASS_NUM] =
+{
+    {PTHREAD_MUTEX_INITIALIZER, NULL}, {PTHREAD_MUTEX_INITIALIZER, NULL},
+    {PTHREAD_MUTEX_INITIALIZER, NULL}, {PTHREAD_MUTEX_INITIALIZER, NULL},
+    {PTHREAD_MUTEX_INITIALIZER, NULL}, {PTHREAD_MUTEX_INITIALIZER, NULL},
+    {PTHREAD_MUTEX_INITIALIZER, NULL}, {PTHREAD_MUTEX_INITIALIZER, NULL},
+};
+static MqttPoolStatsStruct gsst_pool_stats;          //大块分配和slab统计, 以及已退出线程的计数
+static PoolCacheStruct *gsst_pool_cache_list = NULL;
+static pthread_mutex_t gs_pool_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t gs_pool_hugepage = 0;
+static pthread_key_t gs_pool_key;
+static pthread_once_t gs_pool_key_once = PTHREAD_ONCE_INIT;
+static __thread PoolCacheStruct gsst_pool_cache;
+
+/********************************** Function ********************************/
+static int pool_class_get(uint32_t size);
+static int pool_slab_create(int class_index);
+static uint16_t pool_global_get(int class_index, void **block, uint16_t num);
+static void pool_global_put(int class_index, void **block, uint16_t num);
+static void pool_cache_register(void);
+static void pool_cache_release(void *cache);
+static void pool_key_create(void);
+
+
+/**
+ * @brief 分配缓冲区, 内容未初始化
+ *
+ * @param size 需要的字节数
+ * @return NULL: 失败; 其他: 缓冲区地址
+ */
+void *mqtt_pool_alloc(uint32_t size)
+{
+    PoolBlockHeadStruct *head = NULL;
+    PoolCacheStruct *cache = &gsst_pool_cache;
+    int class_index = pool_class_get(size);
+
+    /* 超过最大等级的直接使用malloc */
+    if (class_index < 0)
+    {
+        head = (PoolBlockHeadStruct *)malloc(sizeof(PoolBlockHeadStruct) + size);
+        if (head == NULL)
+        {
+            return NULL;
+        }
+        head->class_index = POOL_CLASS_LARGE;
+        head->magic = POOL_BLOCK_MAGIC;
+        __atomic_add_fetch(&gsst_pool_stats.large_count, 1, __ATOMIC_RELAXED);
+        return head + 1;
+    }
+
+    if (cache->registered == 0)
+    {
+        pool_cache_register();
+    }
+
+    /* 本地缓存为空时从全局批量取一半, 减少加锁次数 */
+    if (cache->count[class_index] == 0)
+    {
+        cache->count[class_index] = pool_global_get(class_index, cache->block[class_index], POOL_BATCH_NUM);
+        if (cache->count[class_index] == 0)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        __atomic_store_n(&cache->cache_hit, cache->cache_hit + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&cache->alloc_count[class_index], cache->alloc_count[class_index] + 1, __ATOMIC_RELAXED);
+
+    head = (PoolBlockHeadStruct *)cache->block[class_index][--cache->count[class_index]] - 1;
+    head->magic = POOL_BLOCK_MAGIC;
+
+    return head + 1;
+}
+
+/**
+ * @brief 释放缓冲区, 可在与分配时不同的线程中释放. 地址不是本池分配的或重复释放时终止进程
+ *
+ * @param ptr mqtt_pool_alloc返回的地址, 可为NULL
+ */
+void mqtt_pool_free(void *ptr)
+{
+    PoolBlockHeadStruct *head = NULL;
+    PoolCacheStruct *cache = &gsst_pool_cache;
+    uint32_t class_index = 0;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    head = (PoolBlockHeadStruct *)ptr - 1;
+    if (head->magic != POOL_BLOCK_MAGIC)
+    {
+        abort();
+    }
+    head->magic = POOL_BLOCK_FREE;
+    class_index = head->class_index;
+    if (class_index == POOL_CLASS_LARGE)
+    {
+        __atomic_add_fetch(&gsst_pool_stats.free_count, 1, __ATOMIC_RELAXED);
+        free(head);
+        return;
+    }
+
+    if (cache->registered == 0)
+    {
+        pool_cache_register();
+    }
+    __atomic_store_n(&cache->free_count[class_index], cache->free_count[class_index] + 1, __ATOMIC_RELAXED);
+
+    /* 本地缓存满时归还一半到全局 */
+    if (cache->count[class_index] == MQTT_POOL_CACHE_MAX)
+    {
+        cache->count[class_index] -= POOL_BATCH_NUM;
+        pool_global_put(class_index, &cache->block[class_index][cache->count[class_index]], POOL_BATCH_NUM);
+    }
+    cache->block[class_index][cache->count[class_index]++] = ptr;
+}
+
+/**
+ * @brief 设置新申请的slab是否使用大页内存(需系统预留大页), 申请失败时自动使用普通内存
+ *
+ * @param enable 1: 使用大页; 0: 不使用
+ */
+void mqtt_pool_hugepage_enable(uint8_t enable)
+{
+    gs_pool_hugepage = enable ? 1 : 0;
+}
+
+/**
+ * @brief 获取缓冲区池统计信息
+ *
+ * @param stats 统计信息
+ */
+void mqtt_pool_stats_get(MqttPoolStatsStruct *stats)
+{
+    pthread_mutex_lock(&gs_pool_cache_lock);
+    stats->large_count = __atomic_load_n(&gsst_pool_stats.large_count, __ATOMIC_RELAXED);
+    stats->alloc_count = stats->large_count + __atomic_load_n(&gsst_pool_stats.alloc_count, __ATOMIC_RELAXED);
+    stats->free_count = __atomic_load_n(&gsst_pool_stats.free_count, __ATOMIC_RELAXED);
+    stats->cache_hit = gsst_pool_stats.cache_hit;
+    stats->slab_count = __atomic_load_n(&gsst_pool_stats.slab_count, __ATOMIC_RELAXED);
+    stats->slab_bytes = __atomic_load_n(&gsst_pool_stats.slab_bytes, __ATOMIC_RELAXED);
+    stats->hugepage_count = __atomic_load_n(&gsst_pool_stats.hugepage_count, __ATOMIC_RELAXED);
+    for (int i = 0; i < MQTT_POOL_CLASS_NUM; i++)
+    {
+        stats->in_use[i] = gsst_pool_stats.in_use[i];
+    }
+
+    /* 汇总各线程的计数, 块可能在其他线程释放, 所以只有汇总后的差值才是正在使用的块数 */
+    for (PoolCacheStruct *cache = gsst_pool_cache_list; cache != NULL; cache = cache->next)
+    {
+        stats->cache_hit += __atomic_load_n(&cache->cache_hit, __ATOMIC_RELAXED);
+        for (int i = 0; i < MQTT_POOL_CLASS_NUM; i++)
+        {
+            uint64_t alloc_count = __atomic_load_n(&cache->alloc_count[i], __ATOMIC_RELAXED);
+            uint64_t free_count = __atomic_load_n(&cache->free_count[i], __ATOMIC_RELAXED);
+
+            stats->alloc_count += alloc_count;
+            stats->free_count += free_count;
+            stats->in_use[i] += alloc_count - free_count;
+        }
+    }
+    pthread_mutex_unlock(&gs_pool_cache_lock);
+}
+
+/**
+ * @brief 根据大小查找等级
+ *
+ * @param size 字节数
+ * @return -1: 超过最大等级; 其他: 等级
+ */
+static int pool_class_get(uint32_t size)
+{
+    for (int i = 0; i < MQTT_POOL_CLASS_NUM; i++)
+    {
+        if (size <= gs_pool_class_size[i])
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief 申请一个slab并切分成块加入全局空闲链表, 调用前需持有该等级的锁
+ *
+ * @param class_index 等级
+ * @return -1: 失败; 0: 成功
+ */
+static int pool_slab_create(int class_index)
+{
+    uint8_t *slab = MAP_FAILED;
+    uint32_t stride = sizeof(PoolBlockHeadStruct) + gs_pool_class_size[class_index];
+    size_t slab_size = MQTT_POOL_SLAB_SIZE;
+    size_t block_num = 0;
+
+    /* 每个slab至少切分出4个块 */
+    if (slab_size < (size_t)stride * 4)
+    {
+        slab_size = (size_t)stride * 4;
+    }
+    if (gs_pool_hugepage && MAP_HUGETLB)
+    {
+        size_t huge_size = (slab_size + MQTT_POOL_HUGEPAGE_SIZE - 1) & ~((size_t)MQTT_POOL_HUGEPAGE_SIZE - 1);
+
+        slab = (uint8_t *)mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED)
+        {
+            slab_size = huge_size;
+            __atomic_add_fetch(&gsst_pool_stats.hugepage_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (slab == MAP_FAILED)
+    {
+        slab = (uint8_t *)mmap(NULL, slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+        {
+            return -1;
+        }
+    }
+
+    block_num = slab_size / stride;
+    for (size_t i = 0; i < block_num; i++)
+    {
+        PoolBlockHeadStruct *head = (PoolBlockHeadStruct *)(slab + i * stride);
+
+        head->class_index = class_index;
+        head->magic = POOL_BLOCK_FREE;
+        *(void **)(head + 1) = gsst_pool_class[class_index].free_list;
+        gsst_pool_class[class_index].free_list = head + 1;
+    }
+    __atomic_add_fetch(&gsst_pool_stats.slab_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&gsst_pool_stats.slab_bytes, slab_size, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/**
+ * @brief 从全局空闲链表取出多个块
+ *
+ * @param class_index 等级
+ * @param block 输出块地址
+ * @param num 需要的块数
+ * @return 实际取出的块数
+ */
+static uint16_t pool_global_get(int class_index, void **block, uint16_t num)
+{
+    uint16_t count = 0;
+    PoolClassStruct *pool_class = &gsst_pool_class[class_index];
+
+    pthread_mutex_lock(&pool_class->lock);
+    while (count < num)
+    {
+        if ((pool_class->free_list == NULL) && (pool_slab_create(class_index) < 0))
+        {
+            break;
+        }
+        block[count++] = pool_class->free_list;
+        pool_class->free_list = *(void **)pool_class->free_list;
+    }
+    pthread_mutex_unlock(&pool_class->lock);
+
+    return count;
+}
+
+/**
+ * @brief 把多个块归还到全局空闲链表
+ *
+ * @param class_index 等级
+ * @param block 块地址
+ * @param num 块数
+ */
+static void pool_global_put(int class_index, void **block, uint16_t num)
+{
+    PoolClassStruct *pool_class = &gsst_pool_class[class_index];
+
+    pthread_mutex_lock(&pool_class->lock);
+    for (uint16_t i = 0; i < num; i++)
+    {
+        *(void **)block[i] = pool_class->free_list;
+        pool_class->free_list = block[i];
+    }
+    pthread_mutex_unlock(&pool_class->lock);
+}
+
+/**
+ * @brief 注册线程退出时归还本地缓存的回调
+ *
+ */
+static void pool_cache_register(void)
+{
+    pthread_once(&gs_pool_key_once, pool_key_create);
+    pthread_setspecific(gs_pool_key, &gsst_pool_cache);
+    gsst_pool_cache.registered = 1;
+
+    pthread_mutex_lock(&gs_pool_cache_lock);
+    gsst_pool_cache.prev = NULL;
+    gsst_pool_cache.next = gsst_pool_cache_list;
+    if (gsst_pool_cache_list != NULL)
+    {
+        gsst_pool_cache_list->prev = &gsst_pool_cache;
+    }
+    gsst_pool_cache_list = &gsst_pool_cache;
+    pthread_mutex_unlock(&gs_pool_cache_lock);
+}
+
+/**
+ * @brief 线程退出时把本地缓存的块全部归还到全局
+ *
+ * @param cache 线程本地缓存
+ */
+static void pool_cache_release(void *cache)
+{
+    PoolCacheStruct *pool_cache = (PoolCacheStruct *)cache;
+
+    for (int i = 0; i < MQTT_POOL_CLASS_NUM; i++)
+    {
+        pool_global_put(i, pool_cache->block[i], pool_cache->count[i]);
+        pool_cache->count[i] = 0;
+    }
+
+    /* 线程的统计计数转入全局后从链表中移除 */
+    pthread_mutex_lock(&gs_pool_cache_lock);
+    gsst_pool_stats.cache_hit += pool_cache->cache_hit;
+    for (int i = 0; i < MQTT_POOL_CLASS_NUM; i++)
+    {
+        gsst_pool_stats.in_use[i] += pool_cache->alloc_count[i] - pool_cache->free_count[i];
+        __atomic_add_fetch(&gsst_pool_stats.alloc_count, pool_cache->alloc_count[i], __ATOMIC_RELAXED);
+        __atomic_add_fetch(&gsst_pool_stats.free_count, pool_cache->free_count[i], __ATOMIC_RELAXED);
+        pool_cache->alloc_count[i] = 0;
+        pool_cache->free_count[i] = 0;
+    }
+    pool_cache->cache_hit = 0;
+    if (pool_cache->prev != NULL)
+    {
+        pool_cache->prev->next = pool_cache->next;
+    }
+    else
+    {
+        gsst_pool_cache_list = pool_cache->next;
+    }
+    if (pool_cache->next != NULL)
+    {
+        pool_cache->next->prev = pool_cache->prev;
+    }
+    pthread_mutex_unlock(&gs_pool_cache_lock);
+    pool_cache->registered = 0;
+}
+
+/**
+ * @brief 创建线程私有数据键
+ *
+ */
+static void pool_key_create(void)
+{
+    pthread_key_create(&gs_pool_key, pool_cache_release);
+}
@@ -0,0 +1,57 @@
+/**
+ * @file mqtt_pool.h
+ * @version V1.0.0
+ * @date 2022-05-10
+ * @brief MQTT报文缓冲区池: 按大小分级, 每个线程有本地缓存, 缓存不足时从全局slab中分配,
+ *        slab可选使用大页内存
+ *
+ * @copyright 2018-2022 (C) Cooley Chan (https://github.com/Coooooley/mqtt)
+ *
+ * @par 版本记录
+ *
+ * 修改日期 | 版本 | 修改人 | 修改内容
+ * -|-|-|-
+ * 2022-05-10 | V1.0.0 | Cooley Chan | First edition
+ *
+ */
+
+#ifndef MQTT_POOL_H_
+#define MQTT_POOL_H_
+
+#include <stdint.h>
+
+/*********************************** Macro **********************************/
+#define MQTT_POOL_CLASS_NUM             8           //大小等级: 64, 128, 256, 512, 1K, 4K, 16K, 64K
+#define MQTT_POOL_CLASS_MIN_SHIFT       6
+#define MQTT_POOL_CACHE_MAX             32          //每个线程每个等级最多缓存的空闲块数
+#define MQTT_POOL_SLAB_SIZE             (256 * 1024)
+#define MQTT_POOL_HUGEPAGE_SIZE         (2 * 1024 * 1024)
+
+/********************************** Typedef *********************************/
+typedef struct
+{
+    uint64_t alloc_count;                           //分配次数
+    uint64_t free_count;                            //释放次数
+    uint64_t cache_hit;                             //从线程本地缓存分配的次数
+    uint64_t large_count;                           //超过最大等级, 直接使用malloc的次数
+    uint64_t slab_count;                            //已申请的slab个数
+    uint64_t slab_bytes;                            //已申请的slab总字节数
+    uint64_t hugepage_count;                        //使用大页内存的slab个数
+    uint64_t in_use[MQTT_POOL_CLASS_NUM];           //各等级正在使用的块数
+} MqttPoolStatsStruct;
+
+/********************************** Function ********************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *mqtt_pool_alloc(uint32_t size);
+void mqtt_pool_free(void *ptr);
+void mqtt_pool_hugepage_enable(uint8_t enable);
+void mqtt_pool_stats_get(MqttPoolStatsStruct *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MQTT_POOL_H_ */
@@ -0,0 +1,469 @@
+/**
+ * @file mqtt_replay.c
+ * @version V1.0.0
+ * @date 2022-05-10
+ * @brief MQTT抓包回放工具: 把mqtt_capture_start抓取的报文重新送入解码流程(报文切分 + 解码 + 主题校验),
+ *        可按最快速度或按抓包时的节奏回放, 输出吞吐量、单报文解码耗时和流量特征
+ *
+ *        用法: mqtt_replay [-p] [-o] [-l loops] capture_file
+ *        -p: 按抓包时的时间间隔回放, 默认按最快速度回放
+ *        -o: 同时解码发送方向的报文, 默认只解码接收方向的报文
+ *        -l: 最快速度回放时的循环次数, 默认1
+ *
+ * @copyright 2018-2022 (C) Cooley Chan (https://github.com/Coooooley/mqtt)
+ *
+ * @par 版本记录
+ *
+ * 修改日期 | 版本 | 修改人 | 修改内容
+ * -|-|-|-
+ * 2022-05-10 | V1.0.0 | Cooley Chan | First edition
+ *
+ */
+
+#include <inttypes.h>
+#include "mqtt_client.h"
+
+/*********************************** Macro **********************************/
+#define MQTT_REPLAY_COST_MAX_NS         10000       //单报文耗时统计的上限, 超过的计入最后一个桶
+#define MQTT_REPLAY_CALIBRATE_NUM       1000
+
+/********************************** Typedef *********************************/
+typedef struct
+{
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t type_count[16];                        //按报文类型(高4位)统计
+    uint64_t publish_count;
+    uint64_t topic_bytes;
+    uint64_t topic_max;
+    uint64_t payload_bytes;
+    uint64_t payload_max;
+    uint64_t cost_total_ns;
+    uint64_t cost_count[MQTT_REPLAY_COST_MAX_NS + 1];
+} MqttReplayStatsStruct;
+
+/****************************** Global Variable *****************************/
+static MqttReplayStatsStruct gsst_replay_stats;
+static uint64_t gs_timer_overhead_ns = 0;
+
+/********************************** Function ********************************/
+static uint64_t replay_now_ns(void);
+static void replay_timer_calibrate(void);
+static uint8_t *replay_file_load(const char *path, uint64_t *len);
+static int replay_record_next(uint8_t *data, uint64_t len, uint64_t *offset, MqttCaptureRecordStruct *record, uint8_t **frame);
+static void replay_frame_decode(uint8_t *frame, uint32_t frame_len, uint8_t collect);
+static void replay_traffic_report(uint8_t *data, uint64_t len, uint8_t outbound);
+static uint64_t replay_cost_percentile(double percentile);
+
+
+/**
+ * @brief main function
+ *
+ * @return 0: 成功; 1: 失败
+ */
+int main(int argc, char *argv[])
+{
+    int opt = 0;
+    uint8_t paced = 0;
+    uint8_t outbound = 0;
+    uint32_t loops = 1;
+    uint64_t len = 0;
+    uint64_t offset = 0;
+    uint64_t start_ns = 0;
+    uint64_t elapsed_ns = 0;
+    uint64_t first_timestamp = 0;
+    uint8_t *data = NULL;
+    uint8_t *frame = NULL;
+    MqttCaptureRecordStruct record;
+
+    while ((opt = getopt(argc, argv, "pol:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                paced = 1;
+                break;
+
+            case 'o':
+                outbound = 1;
+                break;
+
+            case 'l':
+                loops = (uint32_t)strtoul(optarg, NULL, 10);
+                loops = (loops == 0) ? 1 : loops;
+                break;
+
+            default :
+                fprintf(stderr, "usage: %s [-p] [-o] [-l loops] capture_file\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-p] [-o] [-l loops] capture_file\n", argv[0]);
+        return 1;
+    }
+
+    data = replay_file_load(argv[optind], &len);
+    if (data == NULL)
+    {
+        return 1;
+    }
+    replay_timer_calibrate();
+    replay_traffic_report(data, len, outbound);
+
+    /* 按抓包节奏回放时只回放一遍, 循环次数只用于最快速度回放 */
+    loops = paced ? 1 : loops;
+    start_ns = replay_now_ns();
+    for (uint32_t i = 0; i < loops; i++)
+    {
+        offset = sizeof(MqttCaptureFileStruct);
+        while (replay_record_next(data, len, &offset, &record, &frame) == 0)
+        {
+            if ((record.direction == MQTT_CAPTURE_OUTBOUND) && (outbound == 0))
+            {
+                continue;
+            }
+
+            if (paced)
+            {
+                struct timespec deadline;
+                uint64_t target_ns = 0;
+
+                if (first_timestamp == 0)
+                {
+                    first_timestamp = record.timestamp_ns;
+                }
+                target_ns = start_ns + (record.timestamp_ns - first_timestamp);
+                deadline.tv_sec = target_ns / 1000000000ULL;
+                deadline.tv_nsec = target_ns % 1000000000ULL;
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+                {
+                }
+            }
+
+            /* 流量特征已在replay_traffic_report中统计, 这里只统计耗时 */
+            replay_frame_decode(frame, record.length, 0);
+        }
+    }
+    elapsed_ns = replay_now_ns() - start_ns;
+    elapsed_ns = (elapsed_ns == 0) ? 1 : elapsed_ns;
+
+    uint64_t decoded = gsst_replay_stats.frames * loops;
+    uint64_t decoded_bytes = gsst_replay_stats.bytes * loops;
+
+    printf("replay mode          : %s, %u loop(s)\n", paced ? "recorded pace" : "max speed", loops);
+    printf("frames decoded       : %" PRIu64 " (%" PRIu64 " errors per loop)\n", decoded, gsst_replay_stats.errors);
+    printf("elapsed              : %.3f ms\n", elapsed_ns / 1e6);
+    printf("throughput           : %.0f frames/s, %.2f MB/s\n",
+           decoded * 1e9 / elapsed_ns, decoded_bytes * 1e3 / elapsed_ns);
+    if (decoded > 0)
+    {
+        printf("decode cost (ns)     : avg %.1f, p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64 ", p99.9 %" PRIu64 " (timer overhead %" PRIu64 " subtracted)\n",
+               (double)gsst_replay_stats.cost_total_ns / decoded, replay_cost_percentile(0.50),
+               replay_cost_percentile(0.90), replay_cost_percentile(0.99), replay_cost_percentile(0.999),
+               gs_timer_overhead_ns);
+    }
+
+    free(data);
+
+    return 0;
+}
+
+/**
+ * @brief 获取单调时钟时间
+ *
+ * @return 纳秒
+ */
+static uint64_t replay_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief 测量两次连续取时间的最小开销, 统计单报文耗时时减去
+ *
+ */
+static void replay_timer_calibrate(void)
+{
+    uint64_t overhead = UINT64_MAX;
+
+    for (uint32_t i = 0; i < MQTT_REPLAY_CALIBRATE_NUM; i++)
+    {
+        uint64_t t0 = replay_now_ns();
+        uint64_t t1 = replay_now_ns();
+
+        overhead = (t1 - t0 < overhead) ? (t1 - t0) : overhead;
+    }
+    gs_timer_overhead_ns = overhead;
+}
+
+/**
+ * @brief 读取整个抓包文件并校验文件头
+ *
+ * @param path 抓包文件路径
+ * @param len 文件长度
+ * @return NULL: 失败; 其他: 文件内容, 由调用者释放
+ */
+static uint8_t *replay_file_load(const char *path, uint64_t *len)
+{
+    struct stat file_stat;
+    MqttCaptureFileStruct *file_header = NULL;
+    uint8_t *data = NULL;
+    uint64_t received = 0;
+    ssize_t nread = 0;
+    int fd = -1;
+
+    if (((fd = open(path, O_RDONLY)) < 0) || (fstat(fd, &file_stat) < 0))
+    {
+        fprintf(stderr, "open %s error: %s\n", path, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    *len = file_stat.st_size;
+    if ((*len < sizeof(MqttCaptureFileStruct)) || ((data = (uint8_t *)malloc(*len)) == NULL))
+    {
+        fprintf(stderr, "%s is not a mqtt capture file\n", path);
+        close(fd);
+        return NULL;
+    }
+    while (received < *len)
+    {
+        nread = read(fd, data + received, *len - received);
+        if (nread <= 0)
+        {
+            if ((nread < 0) && (errno == EINTR))
+            {
+                continue;
+            }
+            fprintf(stderr, "read %s error\n", path);
+            free(data);
+            close(fd);
+            return NULL;
+        }
+        received += nread;
+    }
+    close(fd);
+
+    file_header = (MqttCaptureFileStruct *)data;
+    if ((memcmp(file_header->magic, MQTT_CAPTURE_MAGIC, sizeof(file_header->magic)) != 0) ||
+        (file_header->version != MQTT_CAPTURE_VERSION))
+    {
+        fprintf(stderr, "%s is not a mqtt capture file\n", path);
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+/**
+ * @brief 取下一条抓包记录
+ *
+ * @param data 文件内容
+ * @param len 文件长度
+ * @param offset 当前记录的偏移, 返回时指向下一条记录
+ * @param record 记录头
+ * @param frame 记录中的报文
+ * @return -1: 没有更多完整有效的记录; 0: 成功
+ */
+static int replay_record_next(uint8_t *data, uint64_t len, uint64_t *offset, MqttCaptureRecordStruct *record, uint8_t **frame)
+{
+    if (*offset + sizeof(MqttCaptureRecordStruct) > len)
+    {
+        return -1;
+    }
+    memcpy(record, data + *offset, sizeof(MqttCaptureRecordStruct));
+
+    /* 报文至少有固定报头的2字节, 方向或长度不对说明文件已损坏, 后面的记录不再可信 */
+    if ((record->length < 2) ||
+        ((record->direction != MQTT_CAPTURE_INBOUND) && (record->direction != MQTT_CAPTURE_OUTBOUND)))
+    {
+        return -1;
+    }
+    /* 抓包进程异常退出时最后一条记录可能不完整 */
+    if (*offset + sizeof(MqttCaptureRecordStruct) + record->length > len)
+    {
+        return -1;
+    }
+    *frame = data + *offset + sizeof(MqttCaptureRecordStruct);
+    *offset += sizeof(MqttCaptureRecordStruct) + record->length;
+
+    return 0;
+}
+
+/**
+ * @brief 按接收流程解码一个报文并统计耗时
+ *
+ * @param frame 报文
+ * @param frame_len 报文长度
+ * @param collect 1: 同时统计报文个数和流量特征; 0: 只统计耗时
+ */
+static void replay_frame_decode(uint8_t *frame, uint32_t frame_len, uint8_t collect)
+{
+    MqttPacketStruct packet;
+    uint64_t cost = 0;
+    int ret = -1;
+
+    uint64_t t0 = replay_now_ns();
+    if (mqtt_frame_length(frame, frame_len) == (int)frame_len)
+    {
+        ret = mqtt_packet_decode(frame, frame_len, &packet);
+    }
+    uint64_t t1 = replay_now_ns();
+
+    cost = t1 - t0;
+    cost = (cost > gs_timer_overhead_ns) ? (cost - gs_timer_overhead_ns) : 0;
+    gsst_replay_stats.cost_total_ns += cost;
+    gsst_replay_stats.cost_count[(cost < MQTT_REPLAY_COST_MAX_NS) ? cost : MQTT_REPLAY_COST_MAX_NS]++;
+
+    if (collect == 0)
+    {
+        return;
+    }
+    gsst_replay_stats.frames++;
+    gsst_replay_stats.bytes += frame_len;
+    if (ret < 0)
+    {
+        gsst_replay_stats.errors++;
+        return;
+    }
+    gsst_replay_stats.type_count[packet.fixed_header >> 4]++;
+    if ((packet.fixed_header & 0xF0) == MQTT_MSG_PUBLISH)
+    {
+        gsst_replay_stats.publish_count++;
+        gsst_replay_stats.topic_bytes += packet.topic_length;
+        gsst_replay_stats.payload_bytes += packet.payload_length;
+        gsst_replay_stats.topic_max = (packet.topic_length > gsst_replay_stats.topic_max) ? packet.topic_length : gsst_replay_stats.topic_max;
+        gsst_replay_stats.payload_max = (packet.payload_length > gsst_replay_stats.payload_max) ? packet.payload_length : gsst_replay_stats.payload_max;
+    }
+}
+
+/**
+ * @brief 输出抓包文件的流量特征: 报文个数和大小、抓包时长和速率、突发程度(1ms内最多报文数)
+ *
+ * @param data 文件内容
+ * @param len 文件长度
+ * @param outbound 1: 包含发送方向的报文
+ */
+static void replay_traffic_report(uint8_t *data, uint64_t len, uint8_t outbound)
+{
+    uint64_t offset = sizeof(MqttCaptureFileStruct);
+    uint64_t frames = 0;
+    uint64_t first_timestamp = 0;
+    uint64_t last_timestamp = 0;
+    uint64_t window_start = 0;
+    uint64_t window_count = 0;
+    uint64_t burst_max = 0;
+    uint8_t *frame = NULL;
+    MqttCaptureRecordStruct record;
+
+    while (replay_record_next(data, len, &offset, &record, &frame) == 0)
+    {
+        if ((record.direction == MQTT_CAPTURE_OUTBOUND) && (outbound == 0))
+        {
+            continue;
+        }
+        if (frames == 0)
+        {
+            first_timestamp = record.timestamp_ns;
+            window_start = record.timestamp_ns;
+        }
+        frames++;
+        last_timestamp = record.timestamp_ns;
+
+        if (record.timestamp_ns - window_start >= 1000000ULL)
+        {
+            window_start = record.timestamp_ns;
+            window_count = 0;
+        }
+        window_count++;
+        burst_max = (window_count > burst_max) ? window_count : burst_max;
+    }
+    if (offset != len)
+    {
+        printf("capture file truncated or corrupt, %" PRIu64 " trailing bytes ignored\n", len - offset);
+    }
+
+    double duration_ms = (last_timestamp - first_timestamp) / 1e6;
+    printf("capture frames       : %" PRIu64 " over %.3f ms", frames, duration_ms);
+    if (duration_ms > 0)
+    {
+        printf(", recorded rate %.0f frames/s", frames * 1e3 / duration_ms);
+    }
+    printf("\n");
+    printf("burst                : max %" PRIu64 " frames within 1 ms\n", burst_max);
+
+    /* 先解码一遍统计流量特征, 耗时统计清零后再正式回放 */
+    offset = sizeof(MqttCaptureFileStruct);
+    while (replay_record_next(data, len, &offset, &record, &frame) == 0)
+    {
+        if ((record.direction == MQTT_CAPTURE_OUTBOUND) && (outbound == 0))
+        {
+            continue;
+        }
+        replay_frame_decode(frame, record.length, 1);
+    }
+    if (gsst_replay_stats.publish_count > 0)
+    {
+        printf("publish              : %" PRIu64 ", topic avg %.1f max %" PRIu64 " bytes, payload avg %.1f max %" PRIu64 " bytes\n",
+               gsst_replay_stats.publish_count,
+               (double)gsst_replay_stats.topic_bytes / gsst_replay_stats.publish_count, gsst_replay_stats.topic_max,
+               (double)gsst_replay_stats.payload_bytes / gsst_replay_stats.publish_count, gsst_replay_stats.payload_max);
+    }
+    printf("frame types          :");
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        if (gsst_replay_stats.type_count[i] > 0)
+        {
+            printf(" 0x%X0=%" PRIu64, i, gsst_replay_stats.type_count[i]);
+        }
+    }
+    printf("\n");
+
+    uint64_t frames_total = gsst_replay_stats.frames;
+    uint64_t bytes_total = gsst_replay_stats.bytes;
+    uint64_t errors_total = gsst_replay_stats.errors;
+    memset(&gsst_replay_stats, 0, sizeof(gsst_replay_stats));
+    gsst_replay_stats.frames = frames_total;
+    gsst_replay_stats.bytes = bytes_total;
+    gsst_replay_stats.errors = errors_total;
+}
+
+/**
+ * @brief 计算单报文解码耗时的百分位数
+ *
+ * @param percentile 百分位(0-1)
+ * @return 纳秒, 超过MQTT_REPLAY_COST_MAX_NS时返回MQTT_REPLAY_COST_MAX_NS
+ */
+static uint64_t replay_cost_percentile(double percentile)
+{
+    uint64_t total = 0;
+    uint64_t count = 0;
+    uint64_t target = 0;
+
+    for (uint32_t i = 0; i <= MQTT_REPLAY_COST_MAX_NS; i++)
+    {
+        total += gsst_replay_stats.cost_count[i];
+    }
+    target = (uint64_t)(total * percentile);
+    for (uint32_t i = 0; i <= MQTT_REPLAY_COST_MAX_NS; i++)
+    {
+        count += gsst_replay_stats.cost_count[i];
+        if (count > target)
+        {
+            return i;
+        }
+    }
+
+    return MQTT_REPLAY_COST_MAX_NS;
+}
@@ -0,0 +1,694 @@
+/**
+ * @file mqtt_test.c
+ * @version V1.0.0
+ * @date 2022-05-10
+ * @brief MQTT客户端单元测试: 主题名/主题过滤器校验(含各扫描实现结果一致性)、缓冲区池等级选择、
+ *        报文切分和解码、抓包写入和回读
+ *
+ *        用法: mqtt_test, 全部通过返回0, 否则输出失败项并返回1
+ *
+ * @copyright 2018-2022 (C) Cooley Chan (https://github.com/Coooooley/mqtt)
+ *
+ * @par 版本记录
+ *
+ * 修改日期 | 版本 | 修改人 | 修改内容
+ * -|-|-|-
+ * 2022-05-10 | V1.0.0 | Cooley Chan | First edition
+ *
+ */
+
+#include "mqtt_client.h"
+
+/*********************************** Macro **********************************/
+#define MQTT_TEST_RANDOM_NUM            200000      //随机主题个数
+#define MQTT_TEST_RANDOM_MAX_LEN        100
+#define MQTT_TEST_LEVEL_MAX             8
+#define MQTT_TEST_CAPTURE_PATH          "/tmp/mqtt_test.mqcp"
+#define MQTT_TEST_PUBLISH_NUM           3
+
+/* 检查条件, 失败时输出位置并计数, 不中断后续检查 */
+#define TEST_CHECK(cond)                                                            \
+    do                                                                              \
+    {                                                                               \
+        gs_test_count++;                                                            \
+        if (!(cond))                                                                \
+        {                                                                           \
+            gs_test_failed++;                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                                           \
+    } while (0)
+
+/********************************** Typedef *********************************/
+typedef struct
+{
+    const char *topic;
+    int name_result;                                //mqtt_topic_name_check期望返回值
+    int filter_result;                              //mqtt_topic_filter_check期望返回值
+} MqttTestTopicStruct;
+
+/****************************** Global Variable *****************************/
+static uint32_t gs_test_count = 0;
+static uint32_t gs_test_failed = 0;
+static uint32_t gs_random_state = 0x12345678;
+static uint32_t gs_callback_count = 0;
+
+static const MqttTestTopicStruct gsst_topic_case[] =
+{
+    {"a",                   0,  0},
+    {"a/b/c",               0,  0},
+    {"/",                   0,  0},
+    {"//a//",               0,  0},
+    {"$SYS/broker",         0,  0},
+    {"+",                   -1, 0},
+    {"#",                   -1, 0},
+    {"+/+",                 -1, 0},
+    {"a/+/b",               -1, 0},
+    {"a/#",                 -1, 0},
+    {"/#",                  -1, 0},
+    {"a/#/b",               -1, -1},
+    {"a+/b",                -1, -1},
+    {"a/b+",                -1, -1},
+    {"a/#b",                -1, -1},
+    {"##",                  -1, -1},
+    {"++",                  -1, -1},
+    {"$share/g/a/+",        -1, 0},
+    {"$share/g/#",          -1, 0},
+    {"$share/g/a",          0,  0},
+    {"$share/g//",          0,  0},
+    {"$share//a",           0,  -1},
+    {"$share/g",            0,  -1},
+    {"$share/g/",           0,  -1},
+    {"$share/g+/a",         -1, -1},
+    {"$share/#/a",          -1, -1},
+    {"$share/+",            -1, -1},
+    {"$sharex/a/+",         -1, 0},
+    {"caf\xC3\xA9/\xE4\xB8\xAD",                0,  0},
+    {"\xF0\x9F\x98\x80",                        0,  0},
+    {"\xF4\x8F\xBF\xBF",                        0,  0},
+    {"\xC0\xAF",                                -1, -1},   //过长编码
+    {"\xE0\x80\xAF",                            -1, -1},
+    {"\xED\xA0\x80",                            -1, -1},   //代理区
+    {"\xF4\x90\x80\x80",                        -1, -1},   //超过U+10FFFF
+    {"\xF5\x80\x80\x80",                        -1, -1},
+    {"\x80",                                    -1, -1},
+    {"\xC3",                                    -1, -1},   //多字节字符不完整
+    {"\xE4\xB8",                                -1, -1},
+    {"0123456789abcde\xC3\xA9",                 0,  0},    //多字节字符跨16字节块
+    {"0123456789abcdef0123456789abcde\xE4\xB8\xAD", 0, 0}, //多字节字符跨32字节块
+    {"0123456789abcdef0123456789abcde\xE4\xB8", -1, -1},   //块边界处截断
+    {"0123456789abcdef0123456789abcdef+",       -1, -1},
+    {"0123456789abcdef0123456789abcde/#",       -1, 0},
+};
+
+/********************************** Function ********************************/
+static void test_topic_case(void);
+static void test_topic_boundary(void);
+static void test_topic_scan_parity(void);
+static void test_topic_level_split(void);
+static void test_pool_class(void);
+static void test_frame_length(void);
+static void test_packet_decode(void);
+static void test_capture_round_trip(void);
+static uint32_t test_random(void);
+static uint32_t test_random_topic(char *topic);
+static uint32_t test_publish_build(uint8_t *frame, uint8_t qos, const char *topic, uint16_t packet_identifier, const char *payload);
+static int test_listen(uint16_t *port);
+static void test_message_callback(uint8_t *msg_data, uint16_t msg_len);
+
+
+/**
+ * @brief main function
+ *
+ * @return 0: 全部通过; 1: 有失败项
+ */
+int main(void)
+{
+    test_topic_case();
+    test_topic_boundary();
+    test_topic_scan_parity();
+    test_topic_level_split();
+    test_pool_class();
+    test_frame_length();
+    test_packet_decode();
+    test_capture_round_trip();
+
+    printf("mqtt_test: %u checks, %u failed\n", gs_test_count, gs_test_failed);
+
+    return (gs_test_failed == 0) ? 0 : 1;
+}
+
+/**
+ * @brief 按用例表校验主题名和主题过滤器, 每个可用的扫描实现各校验一遍
+ *
+ */
+static void test_topic_case(void)
+{
+    for (uint8_t type = MQTT_TOPIC_SCAN_SCALAR; type <= MQTT_TOPIC_SCAN_NEON; type++)
+    {
+        if (mqtt_topic_scan_select(type) < 0)
+        {
+            continue;
+        }
+        for (uint32_t i = 0; i < sizeof(gsst_topic_case) / sizeof(gsst_topic_case[0]); i++)
+        {
+            const MqttTestTopicStruct *test_case = &gsst_topic_case[i];
+            uint32_t len = strlen(test_case->topic);
+
+            if ((mqtt_topic_name_check(test_case->topic, len) != test_case->name_result) ||
+                (mqtt_topic_filter_check(test_case->topic, len) != test_case->filter_result))
+            {
+                fprintf(stderr, "topic case %u failed with scan type %u\n", i, type);
+            }
+            TEST_CHECK(mqtt_topic_name_check(test_case->topic, len) == test_case->name_result);
+            TEST_CHECK(mqtt_topic_filter_check(test_case->topic, len) == test_case->filter_result);
+        }
+    }
+    TEST_CHECK(mqtt_topic_scan_select(MQTT_TOPIC_SCAN_AUTO) == 0);
+    TEST_CHECK(mqtt_topic_scan_select(0xFF) < 0);
+}
+
+/**
+ * @brief 边界情况: 空主题、空字符、超长主题、层级数超过过滤器记录的分隔符个数
+ *
+ */
+static void test_topic_boundary(void)
+{
+    static char topic[MQTT_TOPIC_MAX_LEN + 2];
+    uint32_t len = 0;
+
+    TEST_CHECK(mqtt_topic_name_check("", 0) < 0);
+    TEST_CHECK(mqtt_topic_filter_check("", 0) < 0);
+    TEST_CHECK(mqtt_topic_name_check("a\0b", 3) < 0);
+    TEST_CHECK(mqtt_topic_filter_check("a\0b", 3) < 0);
+
+    memset(topic, 'a', sizeof(topic));
+    TEST_CHECK(mqtt_topic_name_check(topic, MQTT_TOPIC_MAX_LEN) == 0);
+    TEST_CHECK(mqtt_topic_name_check(topic, MQTT_TOPIC_MAX_LEN + 1) < 0);
+    TEST_CHECK(mqtt_topic_filter_check(topic, MQTT_TOPIC_MAX_LEN + 1) < 0);
+
+    /* 100层"a/"后跟通配符, 超过32层的部分由memchr查找 */
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        topic[len++] = 'a';
+        topic[len++] = '/';
+    }
+    topic[len] = '#';
+    TEST_CHECK(mqtt_topic_filter_check(topic, len + 1) == 0);
+    topic[len] = '+';
+    TEST_CHECK(mqtt_topic_filter_check(topic, len + 1) == 0);
+    topic[len + 1] = 'b';
+    TEST_CHECK(mqtt_topic_filter_check(topic, len + 2) < 0);
+    topic[len - 1] = '#';
+    topic[len] = '/';
+    topic[len + 1] = 'b';
+    TEST_CHECK(mqtt_topic_filter_check(topic, len + 2) < 0);
+    topic[len - 2] = '+';
+    topic[len - 1] = '/';
+    TEST_CHECK(mqtt_topic_filter_check(topic, len + 2) == 0);
+    TEST_CHECK(mqtt_topic_name_check(topic, len + 2) < 0);
+}
+
+/**
+ * @brief 随机主题在各扫描实现下的校验结果必须与标量实现一致
+ *
+ */
+static void test_topic_scan_parity(void)
+{
+    char topic[MQTT_TEST_RANDOM_MAX_LEN];
+    uint32_t mismatch = 0;
+
+    for (uint32_t i = 0; i < MQTT_TEST_RANDOM_NUM; i++)
+    {
+        uint32_t len = test_random_topic(topic);
+        int name_result = 0;
+        int filter_result = 0;
+        int utf8_result = 0;
+
+        mqtt_topic_scan_select(MQTT_TOPIC_SCAN_SCALAR);
+        name_result = mqtt_topic_name_check(topic, len);
+        filter_result = mqtt_topic_filter_check(topic, len);
+        utf8_result = mqtt_utf8_check((const uint8_t *)topic, len);
+
+        for (uint8_t type = MQTT_TOPIC_SCAN_SSE2; type <= MQTT_TOPIC_SCAN_NEON; type++)
+        {
+            if (mqtt_topic_scan_select(type) < 0)
+            {
+                continue;
+            }
+            if ((mqtt_topic_name_check(topic, len) != name_result) ||
+                (mqtt_topic_filter_check(topic, len) != filter_result) ||
+                (mqtt_utf8_check((const uint8_t *)topic, len) != utf8_result))
+            {
+                mismatch++;
+            }
+        }
+    }
+    mqtt_topic_scan_select(MQTT_TOPIC_SCAN_AUTO);
+    TEST_CHECK(mismatch == 0);
+}
+
+/**
+ * @brief 层级切分结果与逐字节查找分隔符的结果比较, 包括层级数超过max_levels的情况
+ *
+ */
+static void test_topic_level_split(void)
+{
+    char topic[MQTT_TEST_RANDOM_MAX_LEN];
+    uint16_t level_offset[MQTT_TEST_LEVEL_MAX];
+    uint32_t mismatch = 0;
+
+    for (uint32_t i = 0; i < MQTT_TEST_RANDOM_NUM / 10; i++)
+    {
+        uint32_t len = test_random_topic(topic);
+        uint16_t expect[MQTT_TEST_RANDOM_MAX_LEN + 1];
+        uint16_t expect_count = 1;
+        uint16_t count = 0;
+
+        if (mqtt_utf8_check((const uint8_t *)topic, len) < 0)
+        {
+            continue;
+        }
+        expect[0] = 0;
+        for (uint32_t j = 0; j < len; j++)
+        {
+            if (topic[j] == MQTT_TOPIC_LEVEL_SEPARATOR)
+            {
+                expect[expect_count++] = j + 1;
+            }
+        }
+
+        count = mqtt_topic_level_split(topic, len, level_offset, MQTT_TEST_LEVEL_MAX);
+        if (count != expect_count)
+        {
+            mismatch++;
+            continue;
+        }
+        for (uint16_t j = 0; (j < count) && (j < MQTT_TEST_LEVEL_MAX); j++)
+        {
+            mismatch += (level_offset[j] != expect[j]) ? 1 : 0;
+        }
+    }
+    TEST_CHECK(mismatch == 0);
+    TEST_CHECK(mqtt_topic_level_split("a/bb/ccc", 8, level_offset, MQTT_TEST_LEVEL_MAX) == 3);
+    TEST_CHECK((level_offset[0] == 0) && (level_offset[1] == 2) && (level_offset[2] == 5));
+}
+
+/**
+ * @brief 缓冲区池按申请大小选择等级, 超过最大等级时使用malloc
+ *
+ */
+static void test_pool_class(void)
+{
+    static const uint32_t size[] = {1, 64, 65, 128, 1024, 1025, 4096, 16385, 65536, 65537};
+    static const int expect_class[] = {0, 0, 1, 1, 4, 5, 5, 7, 7, -1};     //-1: 超过最大等级
+    MqttPoolStatsStruct before;
+    MqttPoolStatsStruct after;
+
+    for (uint32_t i = 0; i < sizeof(size) / sizeof(size[0]); i++)
+    {
+        uint8_t *ptr = NULL;
+
+        mqtt_pool_stats_get(&before);
+        ptr = (uint8_t *)mqtt_pool_alloc(size[i]);
+        TEST_CHECK(ptr != NULL);
+        if (ptr == NULL)
+        {
+            continue;
+        }
+        memset(ptr, 0xA5, size[i]);
+        mqtt_pool_stats_get(&after);
+        if (expect_class[i] < 0)
+        {
+            TEST_CHECK(after.large_count == before.large_count + 1);
+        }
+        else
+        {
+            TEST_CHECK(after.in_use[expect_class[i]] == before.in_use[expect_class[i]] + 1);
+        }
+
+        mqtt_pool_free(ptr);
+        mqtt_pool_stats_get(&after);
+        TEST_CHECK(memcmp(after.in_use, before.in_use, sizeof(after.in_use)) == 0);
+        TEST_CHECK(after.free_count == before.free_count + 1);
+    }
+
+    /* 释放后再次申请同一等级应从线程本地缓存取得 */
+    void *first = mqtt_pool_alloc(100);
+    mqtt_pool_free(first);
+    mqtt_pool_stats_get(&before);
+    void *second = mqtt_pool_alloc(100);
+    mqtt_pool_stats_get(&after);
+    TEST_CHECK(second == first);
+    TEST_CHECK(after.cache_hit == before.cache_hit + 1);
+    mqtt_pool_free(second);
+    mqtt_pool_free(NULL);
+}
+
+/**
+ * @brief 剩余长度编码: 数据不足、编码超过4字节、1-4字节编码的边界值
+ *
+ */
+static void test_frame_length(void)
+{
+    static const uint8_t need_more_1[] = {0x30};
+    static const uint8_t need_more_2[] = {0x30, 0x80};
+    static const uint8_t need_more_4[] = {0x30, 0xFF, 0xFF, 0xFF};
+    static const uint8_t overlong[] = {0x30, 0xFF, 0xFF, 0xFF, 0xFF, 0x01};
+    static const uint8_t len_0[] = {0xC0, 0x00};
+    static const uint8_t len_127[] = {0x30, 0x7F};
+    static const uint8_t len_128[] = {0x30, 0x80, 0x01};
+    static const uint8_t len_16383[] = {0x30, 0xFF, 0x7F};
+    static const uint8_t len_16384[] = {0x30, 0x80, 0x80, 0x01};
+    static const uint8_t len_max[] = {0x30, 0xFF, 0xFF, 0xFF, 0x7F};
+
+    TEST_CHECK(mqtt_frame_length(need_more_1, sizeof(need_more_1)) == 0);
+    TEST_CHECK(mqtt_frame_length(need_more_2, sizeof(need_more_2)) == 0);
+    TEST_CHECK(mqtt_frame_length(need_more_4, sizeof(need_more_4)) == 0);
+    TEST_CHECK(mqtt_frame_length(overlong, sizeof(overlong)) == -1);
+    TEST_CHECK(mqtt_frame_length(len_0, sizeof(len_0)) == 2);
+    TEST_CHECK(mqtt_frame_length(len_127, sizeof(len_127)) == 2 + 127);
+    TEST_CHECK(mqtt_frame_length(len_128, sizeof(len_128)) == 3 + 128);
+    TEST_CHECK(mqtt_frame_length(len_16383, sizeof(len_16383)) == 3 + 16383);
+    TEST_CHECK(mqtt_frame_length(len_16384, sizeof(len_16384)) == 4 + 16384);
+    TEST_CHECK(mqtt_frame_length(len_max, sizeof(len_max)) == 5 + 268435455);
+}
+
+/**
+ * @brief 报文解码: 长度不符、各类报文格式错误和合法的PUBLISH报文
+ *
+ */
+static void test_packet_decode(void)
+{
+    uint8_t frame[256];
+    uint32_t frame_len = 0;
+    MqttPacketStruct packet;
+
+    /* 长度与剩余长度不符 */
+    uint8_t pingresp[] = {0xD0, 0x00, 0x00};
+    TEST_CHECK(mqtt_packet_decode(pingresp, 1, &packet) < 0);
+    TEST_CHECK(mqtt_packet_decode(pingresp, 3, &packet) < 0);
+    TEST_CHECK(mqtt_packet_decode(pingresp, 2, &packet) == 0);
+    TEST_CHECK(packet.fixed_header == MQTT_MSG_PINGRESP);
+
+    uint8_t overlong[] = {0x30, 0xFF, 0xFF, 0xFF, 0xFF, 0x01};
+    TEST_CHECK(mqtt_packet_decode(overlong, sizeof(overlong), &packet) < 0);
+
+    /* CONNACK剩余长度必须为2 */
+    uint8_t connack[] = {0x20, 0x02, 0x01, 0x00};
+    uint8_t connack_short[] = {0x20, 0x01, 0x00};
+    uint8_t connack_long[] = {0x20, 0x03, 0x00, 0x00, 0x00};
+    TEST_CHECK(mqtt_packet_decode(connack, sizeof(connack), &packet) == 0);
+    TEST_CHECK((packet.payload_length == 2) && (packet.payload[0] == 0x01) && (packet.payload[1] == 0x00));
+    TEST_CHECK(mqtt_packet_decode(connack_short, sizeof(connack_short), &packet) < 0);
+    TEST_CHECK(mqtt_packet_decode(connack_long, sizeof(connack_long), &packet) < 0);
+
+    /* 确认报文缺少报文标识符 */
+    uint8_t puback[] = {0x40, 0x02, 0x12, 0x34};
+    uint8_t puback_short[] = {0x40, 0x01, 0x12};
+    TEST_CHECK(mqtt_packet_decode(puback, sizeof(puback), &packet) == 0);
+    TEST_CHECK(packet.packet_identifier == 0x1234);
+    TEST_CHECK(mqtt_packet_decode(puback_short, sizeof(puback_short), &packet) < 0);
+
+    /* 合法的QoS1 PUBLISH */
+    frame_len = test_publish_build(frame, QOS_VALUE1, "a/b", 0x0102, "hello");
+    TEST_CHECK(mqtt_packet_decode(frame, frame_len, &packet) == 0);
+    TEST_CHECK(packet.qos == QOS_VALUE1);
+    TEST_CHECK(packet.packet_identifier == 0x0102);
+    TEST_CHECK((packet.topic_length == 3) && (memcmp(packet.topic, "a/b", 3) == 0));
+    TEST_CHECK((packet.payload_length == 5) && (memcmp(packet.payload, "hello", 5) == 0));
+
+    /* QoS1缺少报文标识符 */
+    frame_len = test_publish_build(frame, QOS_VALUE0, "a/b", 0, "");
+    frame[0] |= QOS_VALUE1 << 1;
+    TEST_CHECK(mqtt_packet_decode(frame, frame_len, &packet) < 0);
+
+    /* QoS为3 */
+    frame_len = test_publish_build(frame, QOS_VALUE1, "a/b", 1, "x");
+    frame[0] |= 0x06;
+    TEST_CHECK(mqtt_packet_decode(frame, frame_len, &packet) < 0);
+
+    /* 主题名包含通配符或非法UTF-8 */
+    frame_len = test_publish_build(frame, QOS_VALUE0, "a/+", 0, "x");
+    TEST_CHECK(mqtt_packet_decode(frame, frame_len, &packet) < 0);
+    frame_len = test_publish_build(frame, QOS_VALUE0, "a/\xC0\xAF", 0, "x");
+    TEST_CHECK(mqtt_packet_decode(frame, frame_len, &packet) < 0);
+
+    /* 主题长度超过报文 */
+    frame_len = test_publish_build(frame, QOS_VALUE0, "a/b", 0, "");
+    frame[3] = 0x10;
+    TEST_CHECK(mqtt_packet_decode(frame, frame_len, &packet) < 0);
+}
+
+/**
+ * @brief 抓包写入和回读: 连接本地服务端, 抓取CONNECT/CONNACK/PUBLISH后按文件格式逐条解析
+ *
+ */
+static void test_capture_round_trip(void)
+{
+    static const char *outbound_topic[MQTT_TEST_PUBLISH_NUM] = {"out/0", "out/1", "out/2"};
+    MqttParamStruct param;
+    MqttCaptureFileStruct file_header;
+    MqttCaptureRecordStruct record;
+    MqttPacketStruct packet;
+    uint8_t frame[256];
+    uint8_t buffer[1024];
+    uint32_t frame_len = 0;
+    uint32_t inbound_num = 0;
+    uint32_t outbound_num = 0;
+    uint32_t outbound_publish = 0;
+    uint16_t port = 0;
+    int listen_fd = -1;
+    int server_fd = -1;
+    FILE *file = NULL;
+
+    listen_fd = test_listen(&port);
+    TEST_CHECK(listen_fd >= 0);
+    if (listen_fd < 0)
+    {
+        return;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.port = port;
+    param.keep_alive = 60;
+    strcpy(param.ipaddr, "127.0.0.1");
+    strcpy(param.client_id, "mqtt_test");
+    param.mqtt_callback_function = test_message_callback;
+
+    /* 事件循环模式, 由mqtt_poll接收, 测试在单线程中同时充当服务端 */
+    mqtt_set_fasync(0);
+    TEST_CHECK(mqtt_init(param) == 0);
+    server_fd = accept(listen_fd, NULL, NULL);
+    TEST_CHECK(server_fd >= 0);
+    if (server_fd < 0)
+    {
+        close(listen_fd);
+        return;
+    }
+
+    TEST_CHECK(mqtt_capture_start(MQTT_TEST_CAPTURE_PATH) == 0);
+    mqtt_connect();
+
+    /* 服务端: CONNACK + 一条QoS0 PUBLISH */
+    uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    TEST_CHECK(write(server_fd, connack, sizeof(connack)) == sizeof(connack));
+    frame_len = test_publish_build(frame, QOS_VALUE0, "in/t", 0, "hello");
+    TEST_CHECK(write(server_fd, frame, frame_len) == (ssize_t)frame_len);
+    for (uint32_t i = 0; (i < 10) && (gs_callback_count == 0); i++)
+    {
+        mqtt_poll(100);
+    }
+    TEST_CHECK(gs_callback_count == 1);
+
+    for (uint32_t i = 0; i < MQTT_TEST_PUBLISH_NUM; i++)
+    {
+        TEST_CHECK(mqtt_publish(outbound_topic[i], "data", 4, 0, QOS_VALUE0) == 0);
+    }
+    mqtt_capture_stop();
+    mqtt_disconnect();
+    while (read(server_fd, buffer, sizeof(buffer)) > 0)
+    {
+    }
+    close(server_fd);
+    close(listen_fd);
+
+    /* 按文件格式回读 */
+    file = fopen(MQTT_TEST_CAPTURE_PATH, "rb");
+    TEST_CHECK(file != NULL);
+    if (file == NULL)
+    {
+        return;
+    }
+    TEST_CHECK(fread(&file_header, sizeof(file_header), 1, file) == 1);
+    TEST_CHECK(memcmp(file_header.magic, MQTT_CAPTURE_MAGIC, sizeof(file_header.magic)) == 0);
+    TEST_CHECK(file_header.version == MQTT_CAPTURE_VERSION);
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        TEST_CHECK((record.length >= 2) && (record.length <= sizeof(buffer)));
+        TEST_CHECK(record.timestamp_ns > 0);
+        if ((record.length < 2) || (record.length > sizeof(buffer)) ||
+            (fread(buffer, record.length, 1, file) != 1))
+        {
+            TEST_CHECK(0);
+            break;
+        }
+        TEST_CHECK(mqtt_frame_length(buffer, record.length) == (int)record.length);
+        TEST_CHECK(mqtt_packet_decode(buffer, record.length, &packet) == 0);
+
+        if (record.direction == MQTT_CAPTURE_INBOUND)
+        {
+            /* 收到的依次为CONNACK和PUBLISH */
+            TEST_CHECK(packet.fixed_header == ((inbound_num == 0) ? MQTT_MSG_CONNACK : MQTT_MSG_PUBLISH));
+            if (packet.fixed_header == MQTT_MSG_PUBLISH)
+            {
+                TEST_CHECK((packet.topic_length == 4) && (memcmp(packet.topic, "in/t", 4) == 0));
+            }
+            inbound_num++;
+        }
+        else
+        {
+            TEST_CHECK(record.direction == MQTT_CAPTURE_OUTBOUND);
+            TEST_CHECK((outbound_num != 0) || (packet.fixed_header == MQTT_MSG_CONNECT));
+            if ((packet.fixed_header & 0xF0) == MQTT_MSG_PUBLISH)
+            {
+                TEST_CHECK(outbound_publish < MQTT_TEST_PUBLISH_NUM);
+                if (outbound_publish < MQTT_TEST_PUBLISH_NUM)
+                {
+                    TEST_CHECK(packet.topic_length == strlen(outbound_topic[outbound_publish]));
+                    TEST_CHECK(memcmp(packet.topic, outbound_topic[outbound_publish], packet.topic_length) == 0);
+                    TEST_CHECK((packet.payload_length == 4) && (memcmp(packet.payload, "data", 4) == 0));
+                }
+                outbound_publish++;
+            }
+            outbound_num++;
+        }
+    }
+    TEST_CHECK(feof(file));
+    fclose(file);
+    unlink(MQTT_TEST_CAPTURE_PATH);
+
+    TEST_CHECK(inbound_num == 2);
+    TEST_CHECK(outbound_publish == MQTT_TEST_PUBLISH_NUM);
+}
+
+/**
+ * @brief 伪随机数, 固定种子使每次运行的用例相同
+ *
+ * @return 随机数
+ */
+static uint32_t test_random(void)
+{
+    gs_random_state ^= gs_random_state << 13;
+    gs_random_state ^= gs_random_state >> 17;
+    gs_random_state ^= gs_random_state << 5;
+
+    return gs_random_state;
+}
+
+/**
+ * @brief 生成随机主题, 字符集偏向分隔符、通配符、共享订阅前缀和UTF-8多字节边界字节
+ *
+ * @param topic 主题缓冲区, 至少MQTT_TEST_RANDOM_MAX_LEN字节
+ * @return 主题长度
+ */
+static uint32_t test_random_topic(char *topic)
+{
+    static const uint8_t charset[] =
+    {
+        'a', 'b', '/', '/', '+', '#', '$', 0x00, 0x7F,
+        0x80, 0xBF, 0xC2, 0xC0, 0xDF, 0xE0, 0xED, 0xEF, 0xF0, 0xF4, 0xF5, 0xFF, 0xA0, 0x90, 0x8F
+    };
+    uint32_t len = test_random() % MQTT_TEST_RANDOM_MAX_LEN;
+    uint32_t pos = 0;
+
+    if ((len > sizeof(MQTT_TOPIC_SHARE_PREFIX)) && (test_random() % 4 == 0))
+    {
+        memcpy(topic, MQTT_TOPIC_SHARE_PREFIX, strlen(MQTT_TOPIC_SHARE_PREFIX));
+        pos = strlen(MQTT_TOPIC_SHARE_PREFIX);
+    }
+    for (; pos < len; pos++)
+    {
+        /* 多数为普通字符, 保证较长的合法主题能覆盖SIMD的整块处理 */
+        topic[pos] = (test_random() % 4 != 0) ? (char)('a' + test_random() % 26) : (char)charset[test_random() % sizeof(charset)];
+    }
+
+    return len;
+}
+
+/**
+ * @brief 编码PUBLISH报文, 剩余长度小于128
+ *
+ * @param frame 报文缓冲区
+ * @param qos 服务质量
+ * @param topic 主题名
+ * @param packet_identifier 报文标识符, QoS=0时不编码
+ * @param payload 消息数据
+ * @return 报文长度
+ */
+static uint32_t test_publish_build(uint8_t *frame, uint8_t qos, const char *topic, uint16_t packet_identifier, const char *payload)
+{
+    uint32_t topic_length = strlen(topic);
+    uint32_t payload_length = strlen(payload);
+    uint32_t offset = 0;
+
+    frame[offset++] = MQTT_MSG_PUBLISH | (qos << 1);
+    frame[offset++] = 2 + topic_length + ((qos != QOS_VALUE0) ? 2 : 0) + payload_length;
+    frame[offset++] = (uint8_t)(topic_length >> 8);
+    frame[offset++] = (uint8_t)topic_length;
+    memcpy(frame + offset, topic, topic_length);
+    offset += topic_length;
+    if (qos != QOS_VALUE0)
+    {
+        frame[offset++] = (uint8_t)(packet_identifier >> 8);
+        frame[offset++] = (uint8_t)packet_identifier;
+    }
+    memcpy(frame + offset, payload, payload_length);
+    offset += payload_length;
+
+    return offset;
+}
+
+/**
+ * @brief 在127.0.0.1的随机端口上监听
+ *
+ * @param port 监听端口
+ * @return -1: 失败; 其他: 监听socket
+ */
+static int test_listen(uint16_t *port)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = -1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 1) < 0) ||
+        (getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0))
+    {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+
+    return fd;
+}
+
+/**
+ * @brief 收到已订阅主题消息的回调函数
+ *
+ * @param msg_data 消息数据
+ * @param msg_len 消息长度
+ */
+static void test_message_callback(uint8_t *msg_data, uint16_t msg_len)
+{
+    (void)msg_data;
+    (void)msg_len;
+    gs_callback_count++;
+}
@@ -0,0 +1,587 @@
+/**
+ * @file mqtt_topic.c
+ * @version V1.0.0
+ * @date 2022-05-10
+ * @brief MQTT主题名/主题过滤器校验: UTF-8编码校验、层级分隔符扫描、通配符检测
+ *
+ * @copyright 2018-2022 (C) Cooley Chan (https://github.com/Coooooley/mqtt)
+ *
+ * @par 版本记录
+ *
+ * 修改日期 | 版本 | 修改人 | 修改内容
+ * -|-|-|-
+ * 2022-05-10 | V1.0.0 | Cooley Chan | First edition
+ *
+ */
+
+#include <string.h>
+#include "mqtt_topic.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MQTT_TOPIC_SIMD_X86             1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define MQTT_TOPIC_SIMD_NEON            1
+#endif
+
+/********************************** Typedef *********************************/
+typedef struct
+{
+    uint16_t *separator;                //层级分隔符位置, 为NULL时只计数
+    uint32_t separator_max;
+    uint32_t separator_count;
+    uint8_t wildcard;                   //是否包含'+'或'#'
+} TopicScanStruct;
+
+typedef int (*topic_scan_function)(const uint8_t *data, uint32_t len, TopicScanStruct *scan);
+
+/*********************************** Macro **********************************/
+#define TOPIC_SCAN_ERROR                0xFFFFFFFF
+#define TOPIC_FILTER_SEPARATOR_MAX      32          //主题过滤器校验时记录的分隔符个数, 更深的层级用memchr查找
+
+/****************************** Global Variable *****************************/
+static topic_scan_function gs_topic_scan_function = NULL;
+
+/********************************** Function ********************************/
+static int topic_scan(const uint8_t *data, uint32_t len, TopicScanStruct *scan);
+static int topic_scan_scalar(const uint8_t *data, uint32_t len, TopicScanStruct *scan);
+static uint32_t topic_wildcard_find(const char *filter, uint32_t begin, uint32_t end);
+static uint32_t topic_scan_scalar_range(const uint8_t *data, uint32_t pos, uint32_t end, uint32_t len, TopicScanStruct *scan);
+#if defined(MQTT_TOPIC_SIMD_X86) && defined(__SSE2__)
+static int topic_scan_sse2(const uint8_t *data, uint32_t len, TopicScanStruct *scan);
+#endif
+#if defined(MQTT_TOPIC_SIMD_X86) && defined(__GNUC__)
+__attribute__((target("avx2"))) static int topic_scan_avx2(const uint8_t *data, uint32_t len, TopicScanStruct *scan);
+#endif
+#if defined(MQTT_TOPIC_SIMD_NEON)
+static int topic_scan_neon(const uint8_t *data, uint32_t len, TopicScanStruct *scan);
+#endif
+
+
+/**
+ * @brief UTF-8编码校验, 同时拒绝空字符U+0000(MQTT协议要求)
+ *
+ * @param data 待校验数据
+ * @param len 数据长度
+ * @return 0: 合法; -1: 非法
+ */
+int mqtt_utf8_check(const uint8_t *data, uint32_t len)
+{
+    TopicScanStruct scan = {NULL, 0, 0, 0};
+
+    return topic_scan(data, len, &scan);
+}
+
+/**
+ * @brief 主题名校验: 长度1~65535, 合法UTF-8, 不能包含通配符(PUBLISH报文使用)
+ *
+ * @param topic 主题名
+ * @param len 主题名长度
+ * @return 0: 合法; -1: 非法
+ */
+int mqtt_topic_name_check(const char *topic, uint32_t len)
+{
+    TopicScanStruct scan = {NULL, 0, 0, 0};
+
+    if ((len == 0) || (len > MQTT_TOPIC_MAX_LEN))
+    {
+        return -1;
+    }
+    if (topic_scan((const uint8_t *)topic, len, &scan) < 0)
+    {
+        return -1;
+    }
+
+    return scan.wildcard ? -1 : 0;
+}
+
+/**
+ * @brief 主题过滤器校验: 长度1~65535, 合法UTF-8, '+'必须独占一个层级,
+ *        '#'必须独占最后一个层级(SUBSCRIBE/UNSUBSCRIBE报文使用).
+ *        共享订阅"$share/<组名>/<主题过滤器>"的组名不能为空且不能包含通配符
+ *
+ * @param filter 主题过滤器
+ * @param len 主题过滤器长度
+ * @return 0: 合法; -1: 非法
+ */
+int mqtt_topic_filter_check(const char *filter, uint32_t len)
+{
+    uint16_t separator[TOPIC_FILTER_SEPARATOR_MAX];
+    TopicScanStruct scan = {separator, TOPIC_FILTER_SEPARATOR_MAX, 0, 0};
+    uint8_t share = 0;
+    uint32_t begin = 0;
+    uint32_t end = 0;
+
+    if ((len == 0) || (len > MQTT_TOPIC_MAX_LEN))
+    {
+        return -1;
+    }
+    if (topic_scan((const uint8_t *)filter, len, &scan) < 0)
+    {
+        return -1;
+    }
+
+    share = (len >= sizeof(MQTT_TOPIC_SHARE_PREFIX) - 1) &&
+            (memcmp(filter, MQTT_TOPIC_SHARE_PREFIX, sizeof(MQTT_TOPIC_SHARE_PREFIX) - 1) == 0);
+    if ((scan.wildcard == 0) && (share == 0))
+    {
+        return 0;
+    }
+
+    /* 按扫描记录的分隔符逐层检查, 超出记录容量的层级再查找'/'.
+       通配符都是ASCII字符, 不会出现在多字节字符中, 直接按字节检查 */
+    for (uint32_t level = 0; level <= scan.separator_count; level++)
+    {
+        if (level == scan.separator_count)
+        {
+            end = len;
+        }
+        else if (level < TOPIC_FILTER_SEPARATOR_MAX)
+        {
+            end = separator[level];
+        }
+        else
+        {
+            end = (uint32_t)((const char *)memchr(filter + begin, MQTT_TOPIC_LEVEL_SEPARATOR, len - begin) - filter);
+        }
+
+        if (share && (level == 1))
+        {
+            /* 共享订阅的组名不能为空且不能包含通配符, 其后必须还有非空的主题过滤器 */
+            if ((begin == end) || (end + 1 >= len) || (topic_wildcard_find(filter, begin, end) != end))
+            {
+                return -1;
+            }
+        }
+        else if ((level > 1) || (share == 0))
+        {
+            /* '+'必须独占一个层级, '#'必须独占最后一个层级 */
+            uint32_t wildcard = topic_wildcard_find(filter, begin, end);
+
+            if ((wildcard != end) && ((end - begin != 1) ||
+                ((filter[wildcard] == MQTT_TOPIC_WILDCARD_MULTI) && (level != scan.separator_count))))
+            {
+                return -1;
+            }
+        }
+        begin = end + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief 查找层级[begin, end)中第一个通配符
+ *
+ * @param filter 主题过滤器
+ * @param begin 层级起始位置
+ * @param end 层级结束位置
+ * @return end: 没有通配符; 其他: 通配符位置
+ */
+static uint32_t topic_wildcard_find(const char *filter, uint32_t begin, uint32_t end)
+{
+    while ((begin < end) && (filter[begin] != MQTT_TOPIC_WILDCARD_SINGLE) && (filter[begin] != MQTT_TOPIC_WILDCARD_MULTI))
+    {
+        begin++;
+    }
+
+    return begin;
+}
+
+/**
+ * @brief 按'/'拆分主题层级, 同时校验UTF-8编码
+ *
+ * @param topic 主题名或主题过滤器
+ * @param len 长度
+ * @param level_offset 输出每个层级的起始偏移, 最多写入max_levels个
+ * @param max_levels level_offset的容量
+ * @return 0: UTF-8编码非法; 其他: 层级数(可能大于max_levels)
+ */
+uint16_t mqtt_topic_level_split(const char *topic, uint32_t len, uint16_t *level_offset, uint16_t max_levels)
+{
+    TopicScanStruct scan = {NULL, 0, 0, 0};
+
+    if ((len > MQTT_TOPIC_MAX_LEN) || (max_levels == 0))
+    {
+        return 0;
+    }
+
+    /* 分隔符位置直接写入level_offset[1...], 之后加1即为下一层级的起始偏移 */
+    scan.separator = level_offset + 1;
+    scan.separator_max = max_levels - 1;
+    if (topic_scan((const uint8_t *)topic, len, &scan) < 0)
+    {
+        return 0;
+    }
+
+    level_offset[0] = 0;
+    for (uint32_t i = 1; (i <= scan.separator_count) && (i < max_levels); i++)
+    {
+        level_offset[i]++;
+    }
+
+    return (uint16_t)(scan.separator_count + 1);
+}
+
+/**
+ * @brief 记录一个层级分隔符
+ *
+ * @param scan 扫描结果
+ * @param pos 分隔符位置
+ */
+static inline void topic_separator_record(TopicScanStruct *scan, uint32_t pos)
+{
+    if (scan->separator_count < scan->separator_max)
+    {
+        scan->separator[scan->separator_count] = (uint16_t)pos;
+    }
+    scan->separator_count++;
+}
+
+/**
+ * @brief 选择扫描实现, 用于对比各实现的结果和性能. 不调用时首次校验按CPU特性自动选择
+ *
+ * @param type MQTT_TOPIC_SCAN_AUTO / SCALAR / SSE2 / AVX2 / NEON
+ * @return -1: 当前平台或CPU不支持; 0: 成功
+ */
+int mqtt_topic_scan_select(uint8_t type)
+{
+    topic_scan_function function = NULL;
+
+    switch (type)
+    {
+        case MQTT_TOPIC_SCAN_AUTO:
+            break;
+
+        case MQTT_TOPIC_SCAN_SCALAR:
+            function = topic_scan_scalar;
+            break;
+
+#if defined(MQTT_TOPIC_SIMD_X86) && defined(__SSE2__)
+        case MQTT_TOPIC_SCAN_SSE2:
+            function = topic_scan_sse2;
+            break;
+#endif
+
+#if defined(MQTT_TOPIC_SIMD_X86) && defined(__GNUC__)
+        case MQTT_TOPIC_SCAN_AVX2:
+            if (__builtin_cpu_supports("avx2") == 0)
+            {
+                return -1;
+            }
+            function = topic_scan_avx2;
+            break;
+#endif
+
+#if defined(MQTT_TOPIC_SIMD_NEON)
+        case MQTT_TOPIC_SCAN_NEON:
+            function = topic_scan_neon;
+            break;
+#endif
+
+        default :
+            return -1;
+    }
+    gs_topic_scan_function = function;
+
+    return 0;
+}
+
+/**
+ * @brief 标量扫描[pos, end)范围, 多字节字符可越过end, 但不能越过len
+ *
+ * @param data 数据
+ * @param pos 起始位置
+ * @param end 结束位置
+ * @param len 数据总长度
+ * @param scan 扫描结果
+ * @return TOPIC_SCAN_ERROR: UTF-8编码非法; 其他: 扫描结束的位置
+ */
+static uint32_t topic_scan_scalar_range(const uint8_t *data, uint32_t pos, uint32_t end, uint32_t len, TopicScanStruct *scan)
+{
+    while (pos < end)
+    {
+        uint8_t c = data[pos];
+        uint8_t min = 0x80;
+        uint8_t max = 0xBF;
+        uint8_t follow = 0;
+
+        if (c < 0x80)
+        {
+            if (c == 0x00)
+            {
+                return TOPIC_SCAN_ERROR;
+            }
+            else if (c == MQTT_TOPIC_LEVEL_SEPARATOR)
+            {
+                topic_separator_record(scan, pos);
+            }
+            else if ((c == MQTT_TOPIC_WILDCARD_SINGLE) || (c == MQTT_TOPIC_WILDCARD_MULTI))
+            {
+                scan->wildcard = 1;
+            }
+            pos++;
+            continue;
+        }
+
+        /* 多字节字符: 拒绝超长编码、代理对(U+D800~U+DFFF)以及超过U+10FFFF的码点 */
+        if ((c >= 0xC2) && (c <= 0xDF))
+        {
+            follow = 1;
+        }
+        else if ((c >= 0xE0) && (c <= 0xEF))
+        {
+            follow = 2;
+            if (c == 0xE0)
+            {
+                min = 0xA0;
+            }
+            else if (c == 0xED)
+            {
+                max = 0x9F;
+            }
+        }
+        else if ((c >= 0xF0) && (c <= 0xF4))
+        {
+            follow = 3;
+            if (c == 0xF0)
+            {
+                min = 0x90;
+            }
+            else if (c == 0xF4)
+            {
+                max = 0x8F;
+            }
+        }
+        else
+        {
+            return TOPIC_SCAN_ERROR;
+        }
+
+        if (pos + follow >= len)
+        {
+            return TOPIC_SCAN_ERROR;
+        }
+        if ((data[pos + 1] < min) || (data[pos + 1] > max))
+        {
+            return TOPIC_SCAN_ERROR;
+        }
+        for (uint8_t i = 2; i <= follow; i++)
+        {
+            if ((data[pos + i] & 0xC0) != 0x80)
+            {
+                return TOPIC_SCAN_ERROR;
+            }
+        }
+        pos += follow + 1;
+    }
+
+    return pos;
+}
+
+/**
+ * @brief 标量扫描整个主题
+ *
+ * @param data 数据
+ * @param len 数据长度
+ * @param scan 扫描结果
+ * @return 0: 合法; -1: 非法
+ */
+static int topic_scan_scalar(const uint8_t *data, uint32_t len, TopicScanStruct *scan)
+{
+    return (topic_scan_scalar_range(data, 0, len, len, scan) == TOPIC_SCAN_ERROR) ? -1 : 0;
+}
+
+#if defined(MQTT_TOPIC_SIMD_X86) && defined(__SSE2__)
+/**
+ * @brief SSE2扫描, 每次处理16字节, 块内全部为ASCII时只需几次比较,
+ *        含多字节字符的块交给标量处理
+ *
+ * @param data 数据
+ * @param len 数据长度
+ * @param scan 扫描结果
+ * @return 0: 合法; -1: 非法
+ */
+static int topic_scan_sse2(const uint8_t *data, uint32_t len, TopicScanStruct *scan)
+{
+    uint32_t pos = 0;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i separator = _mm_set1_epi8(MQTT_TOPIC_LEVEL_SEPARATOR);
+    const __m128i wildcard_single = _mm_set1_epi8(MQTT_TOPIC_WILDCARD_SINGLE);
+    const __m128i wildcard_multi = _mm_set1_epi8(MQTT_TOPIC_WILDCARD_MULTI);
+
+    while (pos + 16 <= len)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + pos));
+
+        if (_mm_movemask_epi8(block) != 0)
+        {
+            pos = topic_scan_scalar_range(data, pos, pos + 16, len, scan);
+            if (pos == TOPIC_SCAN_ERROR)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero)) != 0)
+        {
+            return -1;
+        }
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, wildcard_single),
+                                           _mm_cmpeq_epi8(block, wildcard_multi))) != 0)
+        {
+            scan->wildcard = 1;
+        }
+
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, separator));
+        while (mask)
+        {
+            topic_separator_record(scan, pos + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+        pos += 16;
+    }
+
+    return (topic_scan_scalar_range(data, pos, len, len, scan) == TOPIC_SCAN_ERROR) ? -1 : 0;
+}
+#endif
+
+#if defined(MQTT_TOPIC_SIMD_X86) && defined(__GNUC__)
+/**
+ * @brief AVX2扫描, 每次处理32字节, 运行时检测CPU支持后才会使用
+ *
+ * @param data 数据
+ * @param len 数据长度
+ * @param scan 扫描结果
+ * @return 0: 合法; -1: 非法
+ */
+__attribute__((target("avx2")))
+static int topic_scan_avx2(const uint8_t *data, uint32_t len, TopicScanStruct *scan)
+{
+    uint32_t pos = 0;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i separator = _mm256_set1_epi8(MQTT_TOPIC_LEVEL_SEPARATOR);
+    const __m256i wildcard_single = _mm256_set1_epi8(MQTT_TOPIC_WILDCARD_SINGLE);
+    const __m256i wildcard_multi = _mm256_set1_epi8(MQTT_TOPIC_WILDCARD_MULTI);
+
+    while (pos + 32 <= len)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + pos));
+
+        if (_mm256_movemask_epi8(block) != 0)
+        {
+            pos = topic_scan_scalar_range(data, pos, pos + 32, len, scan);
+            if (pos == TOPIC_SCAN_ERROR)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero)) != 0)
+        {
+            return -1;
+        }
+        if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, wildcard_single),
+                                                 _mm256_cmpeq_epi8(block, wildcard_multi))) != 0)
+        {
+            scan->wildcard = 1;
+        }
+
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, separator));
+        while (mask)
+        {
+            topic_separator_record(scan, pos + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+        pos += 32;
+    }
+
+    return (topic_scan_scalar_range(data, pos, len, len, scan) == TOPIC_SCAN_ERROR) ? -1 : 0;
+}
+#endif
+
+#if defined(MQTT_TOPIC_SIMD_NEON)
+/**
+ * @brief NEON扫描, 每次处理16字节, 分隔符位置在块内逐字节记录
+ *
+ * @param data 数据
+ * @param len 数据长度
+ * @param scan 扫描结果
+ * @return 0: 合法; -1: 非法
+ */
+static int topic_scan_neon(const uint8_t *data, uint32_t len, TopicScanStruct *scan)
+{
+    uint32_t pos = 0;
+    const uint8x16_t separator = vdupq_n_u8(MQTT_TOPIC_LEVEL_SEPARATOR);
+    const uint8x16_t wildcard_single = vdupq_n_u8(MQTT_TOPIC_WILDCARD_SINGLE);
+    const uint8x16_t wildcard_multi = vdupq_n_u8(MQTT_TOPIC_WILDCARD_MULTI);
+
+    while (pos + 16 <= len)
+    {
+        uint8x16_t block = vld1q_u8(data + pos);
+
+        if (vmaxvq_u8(block) >= 0x80)
+        {
+            pos = topic_scan_scalar_range(data, pos, pos + 16, len, scan);
+            if (pos == TOPIC_SCAN_ERROR)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if (vminvq_u8(block) == 0x00)
+        {
+            return -1;
+        }
+        if (vmaxvq_u8(vorrq_u8(vceqq_u8(block, wildcard_single), vceqq_u8(block, wildcard_multi))) != 0)
+        {
+            scan->wildcard = 1;
+        }
+        if (vmaxvq_u8(vceqq_u8(block, separator)) != 0)
+        {
+            for (uint32_t i = 0; i < 16; i++)
+            {
+                if (data[pos + i] == MQTT_TOPIC_LEVEL_SEPARATOR)
+                {
+                    topic_separator_record(scan, pos + i);
+                }
+            }
+        }
+        pos += 16;
+    }
+
+    return (topic_scan_scalar_range(data, pos, len, len, scan) == TOPIC_SCAN_ERROR) ? -1 : 0;
+}
+#endif
+
+/**
+ * @brief 扫描主题, 首次调用时根据CPU特性选择实现
+ *
+ * @param data 数据
+ * @param len 数据长度
+ * @param scan 扫描结果
+ * @return 0: 合法; -1: 非法
+ */
+static int topic_scan(const uint8_t *data, uint32_t len, TopicScanStruct *scan)
+{
+    if (gs_topic_scan_function == NULL)
+    {
+        topic_scan_function function = topic_scan_scalar;
+
+#if defined(MQTT_TOPIC_SIMD_X86) && defined(__SSE2__)
+        function = topic_scan_sse2;
+#elif defined(MQTT_TOPIC_SIMD_NEON)
+        function = topic_scan_neon;
+#endif
+#if defined(MQTT_TOPIC_SIMD_X86) && defined(__GNUC__)
+        if (__builtin_cpu_supports("avx2"))
+        {
+            function = topic_scan_avx2;
+        }
+#endif
+        gs_topic_scan_function = function;
+    }
+
+    return gs_topic_scan_function(data, len, scan);
+}
@@ -0,0 +1,52 @@
+/**
+ * @file mqtt_topic.h
+ * @version V1.0.0
+ * @date 2022-05-10
+ * @brief MQTT主题名/主题过滤器校验: UTF-8编码校验、层级分隔符扫描、通配符检测,
+ *        x86使用SSE2/AVX2, ARM64使用NEON, 其他平台使用标量实现
+ *
+ * @copyright 2018-2022 (C) Cooley Chan (https://github.com/Coooooley/mqtt)
+ *
+ * @par 版本记录
+ *
+ * 修改日期 | 版本 | 修改人 | 修改内容
+ * -|-|-|-
+ * 2022-05-10 | V1.0.0 | Cooley Chan | First edition
+ *
+ */
+
+#ifndef MQTT_TOPIC_H_
+#define MQTT_TOPIC_H_
+
+#include <stdint.h>
+
+/*********************************** Macro **********************************/
+#define MQTT_TOPIC_MAX_LEN              65535
+#define MQTT_TOPIC_LEVEL_SEPARATOR      '/'
+#define MQTT_TOPIC_WILDCARD_SINGLE      '+'
+#define MQTT_TOPIC_WILDCARD_MULTI       '#'
+#define MQTT_TOPIC_SHARE_PREFIX         "$share/"   //共享订阅: $share/<组名>/<主题过滤器>
+
+/* 扫描实现 */
+#define MQTT_TOPIC_SCAN_AUTO            0           //按CPU特性自动选择(默认)
+#define MQTT_TOPIC_SCAN_SCALAR          1
+#define MQTT_TOPIC_SCAN_SSE2            2
+#define MQTT_TOPIC_SCAN_AVX2            3
+#define MQTT_TOPIC_SCAN_NEON            4
+
+/********************************** Function ********************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int mqtt_utf8_check(const uint8_t *data, uint32_t len);
+int mqtt_topic_name_check(const char *topic, uint32_t len);
+int mqtt_topic_filter_check(const char *filter, uint32_t len);
+uint16_t mqtt_topic_level_split(const char *topic, uint32_t len, uint16_t *level_offset, uint16_t max_levels);
+int mqtt_topic_scan_select(uint8_t type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MQTT_TOPIC_H_ */
@@ -67,6 +67,13 @@ int main(void)
         char payload[8] = {0};
         char publish_name[128] = {0};
 
+        /* 连接断开后重连, 连续失败时mqtt_reconnect内部按指数退避等待 */
+        if (mqtt_is_connected() == 0)
+        {
+            mqtt_reconnect();
+            continue;
+        }
+
         for (uint8_t i = 0; i < 8; i++)
         {
             payload[i] = i;